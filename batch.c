@@ -0,0 +1,280 @@
+/*******************************************************************************************
+ *
+ *  Subread batches
+ *    A batch holds up to nmax subreads from either a .bam/.sam or a .bax.h5 source in
+ *    columnar form: one array per field, and the sequence and any requested streams of
+ *    all the subreads concatenated in arenas.  A batch is reused from one fill to the next
+ *    so that its memory is only ever grown.
+ *
+ *  Date  :  Oct. 17, 2026
+ *
+ ********************************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "DB.h"
+#include "batch.h"
+
+#define LOWER_OFFSET 32
+
+Batch *new_batch(int nmax, int want)
+{ Batch *b;
+
+  b = (Batch *) Malloc(sizeof(Batch),"Allocating batch");
+  if (b == NULL)
+    return (NULL);
+  b->nmax  = nmax;
+  b->want  = want;
+  b->isbax = 0;
+  b->nrec  = 0;
+
+  b->well  = (int *) Malloc(9ll*nmax*sizeof(int),"Allocating batch");
+  b->qual  = (float *) Malloc(5ll*nmax*sizeof(float),"Allocating batch");
+  b->soff  = (int64 *) Malloc(2ll*nmax*sizeof(int64),"Allocating batch");
+  if (b->well == NULL || b->qual == NULL || b->soff == NULL)
+    { free(b->soff);
+      free(b->qual);
+      free(b->well);
+      free(b);
+      return (NULL);
+    }
+  b->beg   = b->well  + nmax;
+  b->end   = b->beg   + nmax;
+  b->rq    = b->end   + nmax;
+  b->len   = b->rq    + nmax;
+  b->bc[0] = b->len   + nmax;
+  b->bc[1] = b->bc[0] + nmax;
+  b->bqual = b->bc[1] + nmax;
+  b->nump  = b->bqual + nmax;
+  b->snr   = b->qual  + nmax;
+  b->hoff  = b->soff  + nmax;
+
+  b->seq   = NULL;
+  b->arr   = NULL;
+  b->qv[0] = NULL;
+  b->alen  = 0;
+  b->amax  = 0;
+  b->names = NULL;
+  b->nlen  = 0;
+  b->nsize = 0;
+  return (b);
+}
+
+void free_batch(Batch *b)
+{ free(b->names);
+  free(b->qv[0]);
+  free(b->arr);
+  free(b->seq);
+  free(b->soff);
+  free(b->qual);
+  free(b->well);
+  free(b);
+}
+
+  //  Make room for len more bytes in each arena: 0 => OK, 1 => out of memory
+
+static int grow_arenas(Batch *b, int64 len)
+{ int64 amax;
+  int   i;
+
+  if (b->alen + len <= b->amax)
+    return (0);
+  amax = 1.2*(b->alen+len) + 100000;
+  b->seq = (char *) Realloc(b->seq,amax,"Allocating batch arena");
+  if (b->seq == NULL)
+    return (1);
+  if (b->want & HASPW)
+    { b->arr = (char *) Realloc(b->arr,amax,"Allocating batch arena");
+      if (b->arr == NULL)
+        return (1);
+    }
+  if (b->want & HASQV)
+    { char *qv = (char *) Malloc(5*amax,"Allocating batch arena");
+      if (qv == NULL)
+        return (1);
+      if (b->alen > 0)
+        for (i = 0; i < 5; i++)
+          memcpy(qv+i*amax,b->qv[i],b->alen);
+      free(b->qv[0]);
+      for (i = 0; i < 5; i++)
+        b->qv[i] = qv + i*amax;
+    }
+  b->amax = amax;
+  return (0);
+}
+
+  //  Set the movie name of the next subread: 0 => OK, 1 => out of memory
+
+static int add_name(Batch *b, char *name)
+{ int i, len;
+
+  i = b->nrec;
+  if (i > 0 && strcmp(b->names + b->hoff[i-1],name) == 0)
+    { b->hoff[i] = b->hoff[i-1];
+      return (0);
+    }
+  len = strlen(name)+1;
+  if (b->nlen + len > b->nsize)
+    { b->nsize = 1.2*(b->nlen+len) + 1000;
+      b->names = (char *) Realloc(b->names,b->nsize,"Allocating batch names");
+      if (b->names == NULL)
+        return (1);
+    }
+  memcpy(b->names+b->nlen,name,len);
+  b->hoff[i] = b->nlen;
+  b->nlen   += len;
+  return (0);
+}
+
+static void clear_batch(Batch *b, int isbax)
+{ b->nrec  = 0;
+  b->alen  = 0;
+  b->nlen  = 0;
+  b->isbax = isbax;
+}
+
+int sam_batch_extract(samFile *sf, Filter *v, Batch *b)
+{ samRecord *rec;
+  int        want, i, k, len;
+  int64      o;
+
+  clear_batch(b,0);
+  want = b->want;
+  if (v != NULL)
+    want |= filter_wants(v);
+
+  while (b->nrec < b->nmax)
+    { rec = sam_record_extract(sf,want);
+      if (rec == NULL)
+        return (-1);
+      if (rec == SAM_EOF)
+        break;
+
+      len = rec->len;
+      if (grow_arenas(b,len) || add_name(b,rec->header))
+        return (-1);
+
+      i = b->nrec++;
+      o = b->alen;
+      b->well[i]  = rec->well;
+      b->beg[i]   = rec->beg;
+      b->end[i]   = rec->end;
+      b->qual[i]  = rec->qual;
+      b->rq[i]    = (int) (rec->qual*1000.);
+      b->len[i]   = len;
+      b->soff[i]  = o;
+      b->bc[0][i] = rec->bc[0];
+      b->bc[1][i] = rec->bc[1];
+      b->bqual[i] = rec->bqual;
+      b->nump[i]  = rec->nump;
+
+      memcpy(b->seq+o,rec->seq,len);
+      if (b->want & HASPW)
+        { memcpy(b->arr+o,rec->arr,len);
+          memcpy(b->snr+4*i,rec->snr,4*sizeof(float));
+        }
+      if (b->want & HASQV)
+        for (k = 0; k < 5; k++)
+          memcpy(b->qv[k]+o,rec->qv[k],len);
+      b->alen += len;
+    }
+
+  return (b->nrec);
+}
+
+  //  Add subread s of bx to b: 0 => OK, 1 => out of memory
+
+static int add_bax_subread(Batch *b, BaxData *bx, SubRead *s)
+{ int   i, k, a, len, roff;
+  int64 o;
+
+  len  = s->lpulse - s->fpulse;
+  roff = s->data_off + s->fpulse;
+  if (grow_arenas(b,len) || add_name(b,bx->movieName))
+    return (1);
+
+  i = b->nrec++;
+  o = b->alen;
+  b->well[i]  = s->well;
+  b->beg[i]   = s->fpulse;
+  b->end[i]   = s->lpulse;
+  b->qual[i]  = s->qv/1000.;
+  b->rq[i]    = s->qv;
+  b->len[i]   = len;
+  b->soff[i]  = o;
+  b->bc[0][i] = -1;
+  b->bc[1][i] = -1;
+  b->bqual[i] = -1;
+  b->nump[i]  = -1;
+
+  { char *bases = bx->baseCall + roff;
+    char *seq   = b->seq + o;
+
+    if (isupper(bases[0]))
+      for (a = 0; a < len; a++)
+        seq[a] = bases[a] + LOWER_OFFSET;
+    else
+      memcpy(seq,bases,len);
+  }
+
+  if (b->want & HASPW)
+    { float *snr = bx->snrVec + 4*s->zmw_off;
+
+      for (k = 0; k < 4; k++)
+        b->snr[4*i+k] = snr[bx->chan[k]];
+      getSubreadPulses(bx,s,b->arr+o);
+    }
+
+  if (b->want & HASQV)
+    { char *qv[5];
+
+      for (k = 0; k < 5; k++)
+        qv[k] = b->qv[k] + o;
+      getSubreadQVs(bx,s,qv);
+    }
+
+  b->alen += len;
+  return (0);
+}
+
+int bax_batch_extract(SubreadIter *it, Filter *v, Batch *b)
+{ BaxData *bx = it->bax;
+  SubRead *s;
+
+  clear_batch(b,1);
+
+  while (b->nrec < b->nmax)
+    { s = nextSubread(it);
+      if (s == NULL)
+        { if (bx->ecode != 0)
+            { fprintf(stderr,"%s: ",Prog_Name);
+              printBaxError(bx->ecode);
+              return (-1);
+            }
+          break;
+        }
+      if (v != NULL && ! evaluate_bax_filter(v,bx,s))
+        continue;
+      if (add_bax_subread(b,bx,s))
+        return (-1);
+    }
+
+  return (b->nrec);
+}
+
+int bax_batch_table(BaxData *bx, int *idx, int n, Batch *b)
+{ int i;
+
+  clear_batch(b,1);
+
+  if (n > b->nmax)
+    n = b->nmax;
+  for (i = 0; i < n; i++)
+    if (add_bax_subread(b,bx,bx->table + idx[i]))
+      return (-1);
+
+  return (b->nrec);
+}
@@ -0,0 +1,74 @@
+/*******************************************************************************************
+ *
+ *  Subread batches
+ *    A batch holds up to nmax subreads from either a .bam/.sam or a .bax.h5 source in
+ *    columnar form: one array per field, and the sequence and any requested streams of
+ *    all the subreads concatenated in arenas.  A batch is reused from one fill to the next
+ *    so that its memory is only ever grown.
+ *
+ *  Date  :  Oct. 17, 2026
+ *
+ ********************************************************************************************/
+
+#ifndef _BATCH
+#define _BATCH
+
+#include "DB.h"
+#include "sam.h"
+#include "bax.h"
+#include "expr.h"
+
+typedef struct
+  { int    nmax;       //  maximum # of subreads in a batch
+    int    want;       //  streams held: HASPW and/or HASQV
+    int    isbax;      //  subreads are from a .bax.h5 (their output format differs slightly)
+    int    nrec;       //  # of subreads in the batch
+
+    int   *well;       //  zm
+    int   *beg;        //  qs
+    int   *end;        //  qe
+    float *qual;       //  rq
+    int   *rq;         //  read quality x 1000 as printed in headers
+    int   *len;        //  length of subread
+    int64 *soff;       //  offset of subread's sequence & streams in the arenas
+    int64 *hoff;       //  offset of subread's movie name in names
+    int   *bc[2];      //  bc (-1 if absent)
+    int   *bqual;      //  bq (-1 if absent)
+    int   *nump;       //  np (-1 if absent)
+    float *snr;        //  4 per subread in output order (if HASPW)
+
+    char  *seq;        //  sequence arena
+    char  *arr;        //  pulse width arena (if HASPW)
+    char  *qv[5];      //  dq, dt, iq, mq, and sq arenas (if HASQV)
+    int64  alen;       //  # of bytes in use in each arena
+    int64  amax;       //  # of bytes allocated for each arena
+
+    char  *names;      //  movie names, '\0' terminated
+    int64  nlen;       //  # of bytes in use in names
+    int64  nsize;      //  # of bytes allocated for names
+  } Batch;
+
+  // new_batch: NULL => out of memory (message sent), an empty batch otherwise
+
+Batch *new_batch(int nmax, int want);
+void   free_batch(Batch *b);
+
+  // Fill b with the next (up to) b->nmax subreads that pass filter v (if not NULL).
+  //   Any previous contents of b are discarded.  For sam input the streams b->want are
+  //   decoded along with the fields v needs, v having been given to sf by select_bam_filter
+  //   so that the reader drops failing records before decoding their streams.  For bax
+  //   input the subreads come from iterator it, and the sequence and streams are converted
+  //   to the text form of sam input.
+  //   -1 => error (message sent), otherwise the # of subreads in b.  Fewer than b->nmax
+  //   subreads => the source is exhausted and must not be extracted from again.
+
+int sam_batch_extract(samFile *sf, Filter *v, Batch *b);
+int bax_batch_extract(SubreadIter *it, Filter *v, Batch *b);
+
+  // Fill b with the (up to b->nmax) subreads bx->table[idx[0..n-1]].  Distinct batches may
+  //   be filled from the same bx concurrently.  -1 => error (message sent), otherwise the
+  //   # of subreads in b.
+
+int bax_batch_table(BaxData *bx, int *idx, int n, Batch *b);
+
+#endif // _BATCH
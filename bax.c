@@ -18,12 +18,25 @@
 #include <strings.h>
 #include <math.h>
 #include <ctype.h>
+#include <time.h>
 #include <sys/stat.h>
+#include <pthread.h>
 
 #include <hdf5.h>
+#include <zlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_QV
+#endif
+
 #include "DB.h"
 #include "bax.h"
 
+#if H5_VERSION_GE(1,10,2)
+#define CHUNK_READ    //  H5Dread_chunk is available
+#endif
+
 // Exception codes
 
 #define CANNOT_OPEN_BAX_FILE   1
@@ -62,28 +75,89 @@ void initBaxData(BaxData *b, int fastq, int quivqv, int arrow)
   b->snrVec    = NULL;
   b->regions   = NULL;
   b->delLimit  = 0;
+  b->nparts    = 0;
+  b->hlo       = 1;
+  b->hhi       = 0;
+  b->chunk     = 0;
+  b->file_id   = -1;
+  b->ecode     = 0;
+  b->mmax      = 0;
+  b->bmax      = 0;
+  b->zmax      = 0;
+  b->hmax      = 0;
+  b->fetching  = 0;
+  b->fname     = NULL;
+  b->nthreads  = 1;
+  b->pool      = NULL;
+  b->table     = NULL;
+  b->ntable    = 0;
+  b->tmax      = 0;
+  b->keep      = NULL;
+  b->karg      = NULL;
+  b->span      = NULL;
+  b->nspan     = 0;
+  b->smax      = 0;
+  b->image     = 0;
+  b->topen     = 0.;
+  b->ttable    = 0.;
+  b->tbase     = 0.;
+}
+
+//  Henceforth only load the part'th of nparts slices of the wells of each file, or if
+//    nparts = 0, the wells with hole numbers in [lo,hi]
+
+void setBaxShard(BaxData *b, int part, int nparts, int lo, int hi)
+{ b->part   = part;
+  b->nparts = nparts;
+  b->hlo    = lo;
+  b->hhi    = hi;
+}
+
+//  Henceforth inflate the chunks of compressed base streams with nthreads threads
+
+void setBaxThreads(BaxData *b, int nthreads)
+{ b->nthreads = nthreads;
+}
+
+//  Henceforth, unless streaming, only load the base streams of the subreads s for which
+//    keep(arg,b,s) is non-zero
+
+void setBaxFilter(BaxData *b, int (*keep)(void *arg, BaxData *b, SubRead *s), void *arg)
+{ b->keep = keep;
+  b->karg = arg;
+}
+
+//  Henceforth, if image is non-zero, read each file whole into memory with one sequential
+//    read on opening it and serve all dataset reads from there (the HDF5 core driver)
+
+void setBaxImage(BaxData *b, int image)
+{ b->image = image;
+}
+
+//  Henceforth hold at most mbytes MB of base stream data in memory at a time (all if 0)
+
+void setBaxChunk(BaxData *b, int mbytes)
+{ b->chunk = mbytes * 0x100000ll;
 }
 
 //  Check if memory needed is above highwater mark, and if so allocate
 
 static void ensureMovie(BaxData *b, hsize_t len)
-{ static hsize_t mmax = 0;
-
-  b->numMV = len;
-  if (mmax < len)
-    { mmax = 1.2*len + 500;
-      b->movieName = (char *) Realloc(b->movieName, mmax+1, "Allocating movie name");
+{ b->numMV = len;
+  if (b->mmax < len)
+    { b->mmax = 1.2*len + 500;
+      b->movieName = (char *) Realloc(b->movieName, b->mmax+1, "Allocating movie name");
     }
 }
 
 //  Check if memory needed is above highwater mark, and if so allocate
 
 static void ensureBases(BaxData *b, hsize_t len)
-{ static hsize_t smax = 0;
+{ hsize_t smax;
 
   b->numBP = len;
-  if (smax < len)
-    { smax = 1.2*len + 10000;
+  if (b->bmax < len)
+    { smax = b->bmax = 1.2*len + 10000;
       b->baseCall = (char *) Realloc(b->baseCall, smax, "Allocating basecall vector");
       if (b->fastq)
         b->fastQV = (char *) Realloc(b->fastQV, smax, "Allocating fastq vector");
@@ -100,11 +174,11 @@ static void ensureBases(BaxData *b, hsize_t len)
 }
 
 static void ensureZMW(BaxData *b, hsize_t len)
-{ static hsize_t smax = 0;
+{ hsize_t smax;
 
   b->numZMW = len;
-  if (smax < len)
-    { smax = 1.2*len + 10000;
+  if (b->zmax < len)
+    { smax = b->zmax = 1.2*len + 10000;
       b->holeType = (char *) Realloc(b->holeType, smax, "Allocating hole vector");
       b->readLen  = (int *) Realloc(b->readLen , smax * sizeof(int), "Allocating event vector");
       if (b->arrow)
@@ -113,15 +187,26 @@ static void ensureZMW(BaxData *b, hsize_t len)
 }
 
 static void ensureHQR(BaxData *b, hsize_t len)
-{ static hsize_t smax = 0;
+{ hsize_t smax;
 
   b->numHQR = len;
-  if (smax < len)
-    { smax = 1.2*len + 10000;
+  if (b->hmax < len)
+    { smax = b->hmax = 1.2*len + 10000;
       b->regions = (int *) Realloc(b->regions,(5ll*smax+1)*sizeof(int),"Allocating region vector");
     }
 }
 
+//  Fields of a row of the Regions table
+
+#define HOLE   0
+#define TYPE   1
+#define    ADAPTER_REGION 0
+#define    INSERT_REGION  1
+#define    HQV_REGION     2
+#define START  2
+#define FINISH 3
+#define SCORE  4
+
 // Fetch the relevant contents of the current bax.h5 file and return the H5 file id.
 
 static char  DNA_2_NUMBER[256] =
@@ -136,7 +221,625 @@ static char  DNA_2_NUMBER[256] =
     0, 0, 0, 0, 3, 0, 0, 0,   0, 0, 0, 0, 0, 0, 0, 0,
   };
 
-int getBaxData(BaxData *b, char *fname)
+//  The HDF5 library is not thread safe, so every call into it is made holding H5_Lock.  The
+//    lock is only held for a call or a short run of them, e.g. the read of one dataset, so
+//    that the loads of different files (say a prefetch and the streaming of the file being
+//    extracted) interleave, and chunks are inflated without it.
+
+static pthread_mutex_t H5_Lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void closeFile(hid_t file_id)
+{ pthread_mutex_lock(&H5_Lock);
+  H5Fclose(file_id);
+  pthread_mutex_unlock(&H5_Lock);
+}
+
+typedef struct _inflater Inflater;
+
+#ifdef CHUNK_READ
+
+//  Direct chunk reads: H5Dread inflates the chunks of a deflated stream one after the other.
+//    Instead the raw chunks are pulled with H5Dread_chunk (holding H5_Lock) a batch at a
+//    time, and the chunks of a batch are inflated straight into the destination by a pool
+//    of threads that do not touch the HDF5 library, with H5_Lock released.  The pool of a
+//    BaxData is started by its first chunk read, and its threads wait for the next batch
+//    until freeBaxData, so that a load does not start threads batch after batch.
+
+#define CHUNK_BATCH 64    //  # of chunks read per thread before inflating a batch
+
+typedef struct
+  { uint8   *raw;     //  compressed chunk
+    hsize_t  rlen;    //  its length
+    uint32   mask;    //  filter mask: non-zero => chunk was stored uncompressed
+    hsize_t  cbeg;    //  index of the chunk's first element
+  } RawChunk;
+
+typedef struct
+  { RawChunk        *chunk;   //  the batch of chunks
+    int              nchunk;
+    int              next;    //  next chunk to inflate
+    pthread_mutex_t  lock;
+    uint8           *dest;    //  elements [boff,boff+n) go to dest
+    hsize_t          boff, n;
+    hsize_t          cdim;    //  elements per chunk
+    int              tsize;   //  bytes per element
+    int              error;   //  a chunk failed to inflate
+  } ChunkJob;
+
+struct _inflater
+  { int              nworker;   //  # of pool threads, the caller inflating with them
+    pthread_t       *thread;
+    pthread_mutex_t  lock;
+    pthread_cond_t   start;     //  a batch is posted or the pool is to quit
+    pthread_cond_t   done;      //  the last worker has finished the batch
+    ChunkJob        *job;       //  the batch posted
+    int              epoch;     //  # of batches posted
+    int              busy;      //  # of workers still on the batch
+    int              quit;
+    RawChunk        *chunk;     //  nbatch raw chunk buffers, reused from batch to batch
+    int              nbatch;
+  };
+
+static void *inflate_chunks(void *arg)
+{ ChunkJob *job = (ChunkJob *) arg;
+  RawChunk *c;
+  uint8    *tmp, *dst;
+  hsize_t   beg, end, clen;
+  uLongf    dlen;
+  int       k, ok;
+
+  clen = job->cdim * job->tsize;
+  tmp  = (uint8 *) malloc(clen);
+  if (tmp == NULL)
+    { job->error = 1;
+      return (NULL);
+    }
+
+  while (1)
+    { pthread_mutex_lock(&job->lock);
+      k = job->next++;
+      pthread_mutex_unlock(&job->lock);
+      if (k >= job->nchunk || job->error)
+        break;
+
+      c   = job->chunk + k;
+      beg = c->cbeg;
+      end = beg + job->cdim;
+      if (beg < job->boff)
+        beg = job->boff;
+      if (end > job->boff + job->n)
+        end = job->boff + job->n;
+      dst = job->dest + (beg - job->boff) * job->tsize;
+
+      if (c->mask != 0)
+        { ok = (c->rlen >= (end - c->cbeg) * job->tsize);
+          if (ok)
+            memcpy(dst,c->raw + (beg - c->cbeg) * job->tsize,(end-beg) * job->tsize);
+        }
+      else if (beg == c->cbeg && end == c->cbeg + job->cdim)
+        { dlen = clen;
+          ok   = (uncompress(dst,&dlen,c->raw,c->rlen) == Z_OK && dlen == clen);
+        }
+      else
+        { dlen = clen;
+          ok   = (uncompress(tmp,&dlen,c->raw,c->rlen) == Z_OK && dlen == clen);
+          if (ok)
+            memcpy(dst,tmp + (beg - c->cbeg) * job->tsize,(end-beg) * job->tsize);
+        }
+      if ( ! ok)
+        { job->error = 1;
+          break;
+        }
+    }
+
+  free(tmp);
+  return (NULL);
+}
+
+static void *inflate_worker(void *arg)
+{ Inflater *p = (Inflater *) arg;
+  ChunkJob *job;
+  int       seen;
+
+  seen = 0;
+  pthread_mutex_lock(&p->lock);
+  while (1)
+    { while (p->epoch == seen && ! p->quit)
+        pthread_cond_wait(&p->start,&p->lock);
+      if (p->quit)
+        break;
+      seen = p->epoch;
+      job  = p->job;
+      pthread_mutex_unlock(&p->lock);
+
+      inflate_chunks(job);
+
+      pthread_mutex_lock(&p->lock);
+      if (--p->busy == 0)
+        pthread_cond_signal(&p->done);
+    }
+  pthread_mutex_unlock(&p->lock);
+  return (NULL);
+}
+
+//  Start a pool of nthreads-1 threads (as many as can be started) that with the caller
+//    inflate batches of CHUNK_BATCH*nthreads chunks: NULL => out of memory (message sent)
+
+static Inflater *newInflater(int nthreads)
+{ Inflater *p;
+  int       i;
+
+  p = (Inflater *) Malloc(sizeof(Inflater),"Allocating inflate pool");
+  if (p == NULL)
+    return (NULL);
+  p->nbatch = CHUNK_BATCH * nthreads;
+  p->chunk  = (RawChunk *) Malloc(sizeof(RawChunk)*p->nbatch,"Allocating chunk batch");
+  p->thread = (pthread_t *) Malloc(sizeof(pthread_t)*nthreads,"Allocating inflate pool");
+  if (p->chunk == NULL || p->thread == NULL)
+    { free(p->thread);
+      free(p->chunk);
+      free(p);
+      return (NULL);
+    }
+  for (i = 0; i < p->nbatch; i++)
+    p->chunk[i].raw = NULL;
+
+  pthread_mutex_init(&p->lock,NULL);
+  pthread_cond_init(&p->start,NULL);
+  pthread_cond_init(&p->done,NULL);
+  p->job   = NULL;
+  p->epoch = 0;
+  p->busy  = 0;
+  p->quit  = 0;
+  for (i = 0; i < nthreads-1; i++)
+    if (pthread_create(p->thread+i,NULL,inflate_worker,p) != 0)
+      break;
+  p->nworker = i;
+  return (p);
+}
+
+static void freeInflater(Inflater *p)
+{ int i;
+
+  pthread_mutex_lock(&p->lock);
+  p->quit = 1;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+  for (i = 0; i < p->nworker; i++)
+    pthread_join(p->thread[i],NULL);
+
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->start);
+  pthread_mutex_destroy(&p->lock);
+  for (i = 0; i < p->nbatch; i++)
+    free(p->chunk[i].raw);
+  free(p->chunk);
+  free(p->thread);
+  free(p);
+}
+
+//  Inflate the batch job with the pool p and the calling thread
+
+static void inflateBatch(Inflater *p, ChunkJob *job)
+{ pthread_mutex_lock(&p->lock);
+  p->job    = job;
+  p->busy   = p->nworker;
+  p->epoch += 1;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+
+  inflate_chunks(job);
+
+  pthread_mutex_lock(&p->lock);
+  while (p->busy > 0)
+    pthread_cond_wait(&p->done,&p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+//  Read elements [boff,boff+n) of field_set into buf with direct chunk reads inflated by
+//    pool p: 0 => OK, -1 => error, 1 => the dataset is not a 1-dimensional deflated stream
+//    of the memory type, use H5Dread.  Called holding H5_Lock, which is released while
+//    inflating.
+
+static int readChunks(Inflater *p, hid_t field_set, hid_t type, hsize_t boff, hsize_t n,
+                      void *buf)
+{ hid_t     plist, ftype;
+  hsize_t   cdim, first, last, k, size;
+  unsigned  flags, filter;
+  size_t    nelmts;
+  int       i, nb, ret;
+  RawChunk *chunk;
+  uint8    *raw;
+  ChunkJob  job;
+
+  if ((plist = H5Dget_create_plist(field_set)) < 0)
+    return (-1);
+  if (H5Pget_layout(plist) != H5D_CHUNKED || H5Pget_chunk(plist,1,&cdim) != 1
+                                           || H5Pget_nfilters(plist) != 1)
+    { H5Pclose(plist);
+      return (1);
+    }
+  nelmts = 0;
+  filter = H5Pget_filter2(plist,0,&flags,&nelmts,NULL,0,NULL,NULL);
+  H5Pclose(plist);
+  if (filter != H5Z_FILTER_DEFLATE)
+    return (1);
+
+  if ((ftype = H5Dget_type(field_set)) < 0)
+    return (-1);
+  if (H5Tget_class(ftype) != H5T_INTEGER || H5Tget_size(ftype) != H5Tget_size(type)
+      || H5Tget_sign(ftype) != H5Tget_sign(type) || H5Tget_order(ftype) != H5Tget_order(type))
+    { H5Tclose(ftype);
+      return (1);
+    }
+  H5Tclose(ftype);
+
+  chunk     = p->chunk;
+  job.chunk = chunk;
+  job.dest  = (uint8 *) buf;
+  job.boff  = boff;
+  job.n     = n;
+  job.cdim  = cdim;
+  job.tsize = H5Tget_size(type);
+  job.error = 0;
+  pthread_mutex_init(&job.lock,NULL);
+
+  ret   = 0;
+  first = boff / cdim;
+  last  = (boff + n - 1) / cdim;
+  for (k = first; k <= last; k += nb)
+    { nb = p->nbatch;
+      if ((hsize_t) nb > (last-k)+1)
+        nb = (last-k)+1;
+
+      for (i = 0; i < nb; i++)
+        { RawChunk *c   = chunk+i;
+          hsize_t   off = (k+i)*cdim;
+
+          if (H5Dget_chunk_storage_size(field_set,&off,&size) < 0)
+            break;
+          raw = (uint8 *) realloc(c->raw,size);
+          if (raw == NULL)
+            break;
+          c->raw  = raw;
+          c->rlen = size;
+          c->cbeg = off;
+          if (H5Dread_chunk(field_set,H5P_DEFAULT,&off,&c->mask,c->raw) < 0)
+            break;
+        }
+      if (i < nb)
+        { ret = -1;
+          break;
+        }
+
+      pthread_mutex_unlock(&H5_Lock);
+      job.nchunk = nb;
+      job.next   = 0;
+      inflateBatch(p,&job);
+      pthread_mutex_lock(&H5_Lock);
+      if (job.error)
+        { ret = -1;
+          break;
+        }
+    }
+
+  pthread_mutex_destroy(&job.lock);
+  return (ret);
+}
+
+#endif
+
+//  Read the elements of the nspan spans [span[2i],span[2i+1]) of the base stream at path
+//    into buf, whose first element is that of index boff, and that holds n elements:
+//    0 => OK, ecode => error.  The stream must have nbases elements.  Given an inflate
+//    pool, a deflated stream is read with direct chunk reads, otherwise the spans are
+//    read with a single hyperslab selection.
+
+static int fetchSpans(hid_t file_id, char *path, int ecode, hid_t type, hsize_t nbases,
+                      hsize_t boff, hsize_t n, hsize_t *span, int nspan, void *buf,
+                      Inflater *pool)
+{ hid_t   field_set, field_space, mem_space;
+  hsize_t field_len[2], off, len;
+  herr_t  stat;
+  int     i;
+
+  pthread_mutex_lock(&H5_Lock);
+  if ((field_set = H5Dopen2(file_id, path, H5P_DEFAULT)) < 0)
+    { pthread_mutex_unlock(&H5_Lock);
+      return (ecode);
+    }
+  if ((field_space = H5Dget_space(field_set)) < 0)
+    { H5Dclose(field_set);
+      pthread_mutex_unlock(&H5_Lock);
+      return (ecode);
+    }
+  H5Sget_simple_extent_dims(field_space, field_len, NULL);
+  stat = 0;
+  if (field_len[0] != nbases || boff + n > nbases)
+    stat = -1;
+  for (i = 0; i < nspan && stat == 0; i++)
+    if (span[2*i] < boff || span[2*i+1] > boff + n)
+      stat = -1;
+  while (nspan > 0 && span[1] <= span[0])
+    { span  += 2;
+      nspan -= 1;
+    }
+  if (nspan == 0)
+    ;
+#ifdef CHUNK_READ
+  else if (stat == 0 && pool != NULL
+                     && (stat = readChunks(pool,field_set,type,span[0],span[1]-span[0],
+                                           ((char *) buf) + (span[0]-boff)*H5Tget_size(type)))
+                        <= 0)
+    { //  Whether the stream can be read by chunks (readChunks returns 1 if not) depends
+      //    only on the dataset, so having passed for the first span it holds for the rest
+
+      for (i = 1; i < nspan && stat == 0; i++)
+        if (span[2*i+1] > span[2*i])
+          stat = readChunks(pool,field_set,type,span[2*i],span[2*i+1]-span[2*i],
+                            ((char *) buf) + (span[2*i]-boff)*H5Tget_size(type));
+    }
+#endif
+  else if (stat >= 0)
+    { mem_space = H5Screate_simple(1,&n,NULL);
+      for (i = 0; i < nspan; i++)
+        { off = span[2*i];
+          len = span[2*i+1] - off;
+          if (len == 0)
+            continue;
+          H5Sselect_hyperslab(field_space,i == 0 ? H5S_SELECT_SET : H5S_SELECT_OR,
+                              &off,NULL,&len,NULL);
+          off -= boff;
+          H5Sselect_hyperslab(mem_space,i == 0 ? H5S_SELECT_SET : H5S_SELECT_OR,
+                              &off,NULL,&len,NULL);
+        }
+      stat = H5Dread(field_set,type,mem_space,field_space,H5P_DEFAULT,buf);
+      H5Sclose(mem_space);
+    }
+  H5Sclose(field_space);
+  H5Dclose(field_set);
+  pthread_mutex_unlock(&H5_Lock);
+  return (stat < 0 ? ecode : 0);
+}
+
+//  Read the n elements from boff on of the base stream at path into buf: 0 => OK,
+//    ecode => error.
+
+static int fetchSlab(hid_t file_id, char *path, int ecode, hid_t type,
+                     hsize_t nbases, hsize_t boff, hsize_t n, void *buf, Inflater *pool)
+{ hsize_t span[2];
+
+  span[0] = boff;
+  span[1] = boff+n;
+  return (fetchSpans(file_id,path,ecode,type,nbases,boff,n,span,1,buf,pool));
+}
+
+//  Load the base streams of the wells [zbeg,zend) whose first base is at boff, or if span
+//    is not NULL only the bases in its nspan spans
+
+static int fetchBases(BaxData *b, hid_t file_id, hsize_t zbeg, hsize_t zend, hsize_t boff,
+                      hsize_t *span, int nspan)
+{ hsize_t i, n, nb, all[2];
+  int     ecode;
+
+  n = 0;
+  for (i = zbeg; i < zend; i++)
+    n += b->readLen[i];
+  ensureBases(b,n);
+  b->cbeg = zbeg;
+  b->cend = zend;
+  b->coff = boff;
+
+#ifdef CHUNK_READ
+  if (b->nthreads > 1 && b->pool == NULL)
+    b->pool = (void *) newInflater(b->nthreads);
+#endif
+
+  nb = b->nbases;
+  if (span == NULL)
+    { all[0] = boff;
+      all[1] = boff+n;
+      span   = all;
+      nspan  = 1;
+    }
+
+#define SLAB(path,error,field,type)							\
+  if ((ecode = fetchSpans(file_id,path,error,type,nb,boff,n,span,nspan,			\
+                          b->field,(Inflater *) b->pool)) != 0)				\
+    return (ecode);
+
+  SLAB("/PulseData/BaseCalls/Basecall",BAX_BASECALL_ERR,baseCall,H5T_NATIVE_UCHAR)
+  if (b->arrow)
+    SLAB("/PulseData/BaseCalls/WidthInFrames",BAX_PULSE_ERR,pulseW,H5T_NATIVE_USHORT)
+  if (b->fastq)
+    SLAB("/PulseData/BaseCalls/QualityValue",BAX_QV_ERR,fastQV,H5T_NATIVE_UCHAR)
+  if (b->quivqv)
+    { SLAB("/PulseData/BaseCalls/DeletionQV",    BAX_DEL_ERR,delQV,  H5T_NATIVE_UCHAR)
+      SLAB("/PulseData/BaseCalls/DeletionTag",   BAX_TAG_ERR,delTag, H5T_NATIVE_UCHAR)
+      SLAB("/PulseData/BaseCalls/InsertionQV",   BAX_INS_ERR,insQV,  H5T_NATIVE_UCHAR)
+      SLAB("/PulseData/BaseCalls/MergeQV",       BAX_MRG_ERR,mergeQV,H5T_NATIVE_UCHAR)
+      SLAB("/PulseData/BaseCalls/SubstitutionQV",BAX_SUB_ERR,subQV,  H5T_NATIVE_UCHAR)
+    }
+
+  return (0);
+}
+
+//  When streaming, the last well of the chunk of wells from zbeg on whose base streams
+//    fit in b->chunk bytes (at least one well is always taken)
+
+static hsize_t chunkEnd(BaxData *b, hsize_t zbeg)
+{ hsize_t i, n, max;
+  int     per;
+
+  if (b->chunk <= 0)
+    return (b->zend);
+  per = 1;
+  if (b->arrow)
+    per += 2;
+  if (b->fastq)
+    per += 1;
+  if (b->quivqv)
+    per += 5;
+  max = b->chunk / per;
+  n   = 0;
+  for (i = zbeg; i < b->zend; i++)
+    { n += b->readLen[i];
+      if (n > max && i > zbeg)
+        break;
+    }
+  return (i);
+}
+
+//  Load the next chunk of wells (those from b->cend on): 0 => OK, ecode => error
+
+static int nextChunk(BaxData *b)
+{ hsize_t i, boff;
+  int     ecode;
+
+  boff = b->coff;
+  for (i = b->cbeg; i < b->cend; i++)
+    boff += b->readLen[i];
+  ecode = fetchBases(b,b->file_id,b->cend,chunkEnd(b,b->cend),boff,NULL,0);
+  return (ecode);
+}
+
+//  Read the Del Tags of bases [boff,bend) from the file until an N is found, setting
+//    b->delLimit to its Del QV and *found: 0 => OK, ecode => error
+
+#define DEL_AHEAD 0x400000   //  # of Del Tags read at a time
+
+static int readDelLimit(BaxData *b, hid_t file_id, hsize_t boff, hsize_t bend, int *found)
+{ hsize_t i, n, nb;
+  char   *tag, *qv;
+  int     ecode;
+
+  nb = DEL_AHEAD;
+  if (b->chunk > 0 && (hsize_t) b->chunk < nb)
+    nb = b->chunk;
+  tag = (char *) Malloc(nb+1,"Allocating Del Tag buffer");
+  if (tag == NULL)
+    return (BAX_TAG_ERR);
+  qv    = tag + nb;
+  ecode = 0;
+  for (n = 0; boff < bend; boff += n)
+    { n = bend - boff;
+      if (n > nb)
+        n = nb;
+      if ((ecode = fetchSlab(file_id,"/PulseData/BaseCalls/DeletionTag",BAX_TAG_ERR,
+                             H5T_NATIVE_UCHAR,b->nbases,boff,n,tag,(Inflater *) b->pool)) != 0)
+        break;
+      for (i = 0; i < n; i++)
+        if (tag[i] == 'N')
+          break;
+      if (i < n)
+        { ecode = fetchSlab(file_id,"/PulseData/BaseCalls/DeletionQV",BAX_DEL_ERR,
+                            H5T_NATIVE_UCHAR,b->nbases,boff+i,1,qv,NULL);
+          if (ecode == 0)
+            { b->delLimit = qv[0];
+              *found = 1;
+            }
+          break;
+        }
+    }
+  free(tag);
+  return (ecode);
+}
+
+//  Find the Del QV associated with N's in the Del Tag of the wells in the window.  The Del
+//    Tags in memory are those of the nspan spans of bases [span[2i],span[2i+1]) (in order).
+//    Any bases before the first N not in memory, i.e. those between spans or beyond the chunk
+//    in memory when streaming, are read from the file.
+
+static int findDelLimit(BaxData *b, hid_t file_id, hsize_t *span, int nspan)
+{ hsize_t i, pos, beg, end, wend;
+  int     k, ecode, found;
+
+  wend = b->zoff;
+  for (i = b->zbeg; i < b->zend; i++)
+    wend += b->readLen[i];
+
+  found = 0;
+  pos   = b->zoff;
+  for (k = 0; k < nspan; k++)
+    { beg = span[2*k];
+      end = span[2*k+1];
+      if (beg > pos)
+        { if ((ecode = readDelLimit(b,file_id,pos,beg,&found)) != 0 || found)
+            return (ecode);
+          pos = beg;
+        }
+      for (i = pos; i < end; i++)
+        if (b->delTag[i-b->coff] == 'N')
+          { b->delLimit = b->delQV[i-b->coff];
+            return (0);
+          }
+      if (end > pos)
+        pos = end;
+    }
+  if (pos < wend)
+    return (readDelLimit(b,file_id,pos,wend,&found));
+  return (0);
+}
+
+//  Set b->span to the spans of bases of the window that hold the subreads that pass b->keep,
+//    merging spans less than SPAN_GAP bases apart so that the reads are not too scattered:
+//    0 => OK, 1 => out of memory (message sent)
+
+#define SPAN_GAP 0x10000
+
+static int selectSpans(BaxData *b)
+{ SubreadIter it;
+  SubRead    *s;
+  hsize_t     beg, end, *span;
+  int         n;
+
+  b->cbeg = b->zbeg;
+  b->cend = b->zend;
+  b->coff = b->zoff;
+  initSubreadIter(&it,b,b->zbeg,b->zend);
+
+  span = b->span;
+  n    = 0;
+  while ((s = nextSubread(&it)) != NULL)
+    { if ( ! b->keep(b->karg,b,s))
+        continue;
+      beg = b->zoff + s->data_off + s->fpulse;
+      end = b->zoff + s->data_off + s->lpulse;
+      if (n > 0 && beg <= span[2*n-1] + SPAN_GAP)
+        { if (beg < span[2*n-2])
+            span[2*n-2] = beg;
+          if (end > span[2*n-1])
+            span[2*n-1] = end;
+          continue;
+        }
+      if (n >= b->smax)
+        { b->smax = 1.2*n + 1000;
+          span = (hsize_t *) Realloc(b->span,2*sizeof(hsize_t)*b->smax,"Allocating base spans");
+          if (span == NULL)
+            { b->smax = 0;
+              b->span = NULL;
+              return (1);
+            }
+          b->span = span;
+        }
+      span[2*n]   = beg;
+      span[2*n+1] = end;
+      n += 1;
+    }
+  b->nspan = n;
+  return (0);
+}
+
+static double wallTime()
+{ struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return (t.tv_sec + t.tv_nsec*1e-9);
+}
+
+#define IMAGE_INCREMENT 0x4000000   //  core driver growth increment (the image is not written)
+
+static int loadBaxData(BaxData *b, char *fname)
 { hid_t   field_space;
   hid_t   field_set;
   hsize_t field_len[2];
@@ -146,20 +849,48 @@ int getBaxData(BaxData *b, char *fname)
   hid_t   type;
   hid_t   attr;
   char   *name;
+  hsize_t boff, *span, mem[2];
+  int     nspan;
+  hid_t   fapl;
+  double  t0, t1;
+
+  if (b->file_id >= 0)
+    { closeFile(b->file_id);
+      b->file_id = -1;
+    }
+  b->ecode = 0;
 
+  t0 = wallTime();
+  pthread_mutex_lock(&H5_Lock);
   H5Eset_auto(H5E_DEFAULT,0,0); // silence hdf5 error stack
-
-  file_id = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+  if (b->image)
+    { if ((fapl = H5Pcreate(H5P_FILE_ACCESS)) < 0)
+        { pthread_mutex_unlock(&H5_Lock);
+          return (CANNOT_OPEN_BAX_FILE);
+        }
+      H5Pset_fapl_core(fapl,IMAGE_INCREMENT,0);
+      file_id = H5Fopen(fname, H5F_ACC_RDONLY, fapl);
+      H5Pclose(fapl);
+    }
+  else
+    file_id = H5Fopen(fname, H5F_ACC_RDONLY, H5P_DEFAULT);
+  pthread_mutex_unlock(&H5_Lock);
   if (file_id < 0)
     return (CANNOT_OPEN_BAX_FILE);
+  t1 = wallTime();
+  b->topen = t1-t0;
 
 #ifdef DEBUG
   printf("PROCESSING %s, file_id: %d\n", baxFileName, file_id);
 #endif
 
+  //  Each dataset is read holding H5_Lock from GET_SIZE to the end of its FETCH (or error
+  //    exit), and likewise each attribute
+
 #define GET_SIZE(path,error)									\
   { ecode = error;										\
-    if ((field_set = H5Dopen2(file_id, path, H5P_DEFAULT)) < 0) goto exit0;			\
+    pthread_mutex_lock(&H5_Lock);								\
+    if ((field_set = H5Dopen2(file_id, path, H5P_DEFAULT)) < 0) goto exit6;			\
     if ((field_space = H5Dget_space(field_set)) < 0) goto exit1;				\
     H5Sget_simple_extent_dims(field_space, field_len, NULL);					\
   }
@@ -168,6 +899,7 @@ int getBaxData(BaxData *b, char *fname)
   { stat = H5Dread(field_set, type, H5S_ALL, H5S_ALL, H5P_DEFAULT, b->field);			\
     H5Sclose(field_space);									\
     H5Dclose(field_set);									\
+    pthread_mutex_unlock(&H5_Lock);								\
     if (stat < 0) goto exit0;									\
   }
 
@@ -178,7 +910,8 @@ int getBaxData(BaxData *b, char *fname)
   }
 
   ecode = BAX_MOVIENAME_ERR;
-  if ((field_set = H5Gopen2(file_id,"/ScanData/RunInfo",H5P_DEFAULT)) < 0) goto exit0;
+  pthread_mutex_lock(&H5_Lock);
+  if ((field_set = H5Gopen2(file_id,"/ScanData/RunInfo",H5P_DEFAULT)) < 0) goto exit6;
   if ((attr = H5Aopen(field_set,"MovieName",H5P_DEFAULT)) < 0) goto exit3;
   if ((field_space = H5Aget_space(attr)) < 0) goto exit4;
   if ((type = H5Aget_type(attr)) < 0) goto exit5;
@@ -191,32 +924,25 @@ int getBaxData(BaxData *b, char *fname)
   H5Sclose(field_space);
   H5Aclose(attr);
   H5Gclose(field_set);
+  pthread_mutex_unlock(&H5_Lock);
 
-  GET_SIZE("/PulseData/BaseCalls/Basecall",BAX_BASECALL_ERR)
-  ensureBases(b,field_len[0]);
-  FETCH(baseCall,H5T_NATIVE_UCHAR)
-  if (b->arrow)
-    CHECK_FETCH("/PulseData/BaseCalls/WidthInFrames",BAX_PULSE_ERR,pulseW,H5T_NATIVE_USHORT,numBP)
-  if (b->fastq)
-    CHECK_FETCH("/PulseData/BaseCalls/QualityValue",BAX_QV_ERR,fastQV,H5T_NATIVE_UCHAR,numBP)
-  if (b->quivqv)
-    { CHECK_FETCH("/PulseData/BaseCalls/DeletionQV",    BAX_DEL_ERR,delQV,  H5T_NATIVE_UCHAR,numBP)
-      CHECK_FETCH("/PulseData/BaseCalls/DeletionTag",   BAX_TAG_ERR,delTag, H5T_NATIVE_UCHAR,numBP)
-      CHECK_FETCH("/PulseData/BaseCalls/InsertionQV",   BAX_INS_ERR,insQV,  H5T_NATIVE_UCHAR,numBP)
-      CHECK_FETCH("/PulseData/BaseCalls/MergeQV",       BAX_MRG_ERR,mergeQV,H5T_NATIVE_UCHAR,numBP)
-      CHECK_FETCH("/PulseData/BaseCalls/SubstitutionQV",BAX_SUB_ERR,subQV,  H5T_NATIVE_UCHAR,numBP)
-    }
+  GET_SIZE("/PulseData/Regions",BAX_REGION_ERR)
+  ensureHQR(b,field_len[0]);
+  FETCH(regions,H5T_NATIVE_INT)
 
   GET_SIZE("/PulseData/BaseCalls/ZMW/HoleStatus",BAX_HOLESTATUS_ERR)
   ensureZMW(b,field_len[0]);
   FETCH(holeType,H5T_NATIVE_UCHAR)
+
+  b->regions[5*b->numHQR] = b->numZMW + b->regions[HOLE];   //  sentinel for nextSubread
   CHECK_FETCH("/PulseData/BaseCalls/ZMW/NumEvent",BAX_NR_EVENTS_ERR,readLen,H5T_NATIVE_INT,numZMW)
   if (b->arrow)
     { CHECK_FETCH("/PulseData/BaseCalls/ZMWMetrics/HQRegionSNR",BAX_SNR_ERR,snrVec,
                   H5T_NATIVE_FLOAT,numZMW)
 
       ecode = BAX_CHIPSET_ERR;
-      if ((field_set = H5Gopen2(file_id,"/ScanData/DyeSet",H5P_DEFAULT)) < 0) goto exit0;
+      pthread_mutex_lock(&H5_Lock);
+      if ((field_set = H5Gopen2(file_id,"/ScanData/DyeSet",H5P_DEFAULT)) < 0) goto exit6;
       if ((attr = H5Aopen(field_set,"BaseMap",H5P_DEFAULT)) < 0) goto exit3;
       if ((field_space = H5Aget_space(attr)) < 0) goto exit4;
       if ((type = H5Aget_type(attr)) < 0) goto exit5;
@@ -233,26 +959,82 @@ int getBaxData(BaxData *b, char *fname)
       H5Sclose(field_space);
       H5Aclose(attr);
       H5Gclose(field_set);
+      pthread_mutex_unlock(&H5_Lock);
+    }
+
+  //  Determine the wells [zbeg,zend) to load and the bases [boff,boff+numBP) they cover
 
+  b->zbeg = 0;
+  b->zend = b->numZMW;
+  if (b->nparts > 0)
+    { b->zbeg = (b->numZMW * (b->part-1)) / b->nparts;
+      b->zend = (b->numZMW * b->part) / b->nparts;
+    }
+  else if (b->hlo <= b->hhi)
+    { int64 hole0, lo, hi;
+
+      hole0 = (b->numHQR > 0 ? b->regions[HOLE] : 0);
+      lo    = b->hlo - hole0;
+      hi    = (b->hhi - hole0) + 1;
+      if (lo < 0)
+        lo = 0;
+      if (lo > (int64) b->numZMW)
+        lo = b->numZMW;
+      if (hi > (int64) b->numZMW)
+        hi = b->numZMW;
+      if (hi < lo)
+        hi = lo;
+      b->zbeg = lo;
+      b->zend = hi;
     }
 
-  GET_SIZE("/PulseData/Regions",BAX_REGION_ERR)
-  ensureHQR(b,field_len[0]);
-  FETCH(regions,H5T_NATIVE_INT)
+  GET_SIZE("/PulseData/BaseCalls/Basecall",BAX_BASECALL_ERR)
+  b->nbases = field_len[0];
+  H5Sclose(field_space);
+  H5Dclose(field_set);
+  pthread_mutex_unlock(&H5_Lock);
 
-  //  Find the Del QV associated with N's in the Del Tag
+  { hsize_t i;
 
-  if (b->quivqv)
-    { hsize_t  i;
-  
-      for (i = 0; i < b->numBP; i++)
-        if (b->delTag[i] == 'N')
-          { b->delLimit = b->delQV[i];
-            break;
-          }
+    boff = 0;
+    for (i = 0; i < b->zbeg; i++)
+      boff += b->readLen[i];
+  }
+  b->zoff = boff;
+
+  //  Load the base streams of all the wells, or if streaming, of the first chunk of them.
+  //    If a filter is set and not streaming, only those of the subreads that pass it.
+
+  t0 = wallTime();
+  b->ttable = t0-t1;
+
+  span  = NULL;
+  nspan = 0;
+  if (b->keep != NULL && b->chunk <= 0 && selectSpans(b) == 0)
+    { span  = b->span;
+      nspan = b->nspan;
     }
 
-  H5Fclose(file_id);
+  if ((ecode = fetchBases(b,file_id,b->zbeg,chunkEnd(b,b->zbeg),boff,span,nspan)) != 0)
+    goto exit0;
+  if (b->cend < b->zend)
+    b->file_id = file_id;
+
+  if (span == NULL)
+    { mem[0] = b->coff;
+      mem[1] = b->coff + b->numBP;
+      span   = mem;
+      nspan  = 1;
+    }
+  if (b->quivqv && (ecode = findDelLimit(b,file_id,span,nspan)) != 0)
+    { b->file_id = -1;
+      goto exit0;
+    }
+  b->tbase = wallTime()-t0;
+
+  if (b->file_id >= 0)
+    return (0);
+  closeFile(file_id);
   return (0);
 
 exit5:
@@ -261,30 +1043,73 @@ exit4:
   H5Aclose(attr);
 exit3:
   H5Gclose(field_set);
-  H5Fclose(file_id);
-  return (ecode);
+  goto exit6;
 
 exit2:
   H5Sclose(field_space);
 exit1:
   H5Dclose(field_set);
+exit6:
+  pthread_mutex_unlock(&H5_Lock);
 exit0:
-  H5Fclose(file_id);
+  closeFile(file_id);
   return (ecode);
 }
 
+//  Load fname into b as above, clearing the calling thread's HDF5 error stack if it fails,
+//    as the library cannot be closed at exit while a loader thread's stack holds errors
+
+static int loadBaxFile(BaxData *b, char *fname)
+{ int status;
+
+  status = loadBaxData(b,fname);
+  if (status != 0)
+    { pthread_mutex_lock(&H5_Lock);
+      H5Eclear2(H5E_DEFAULT);
+      pthread_mutex_unlock(&H5_Lock);
+    }
+  return (status);
+}
+
+static void *fetchBaxData(void *arg)
+{ BaxData *b = (BaxData *) arg;
+
+  b->fstatus = loadBaxFile(b,b->fname);
+  return (NULL);
+}
+
+//  Start loading fname into b on a background thread.  A later getBaxData of fname on b
+//    waits for and returns the result, so b must not otherwise be touched in between.
+
+void prefetchBaxData(BaxData *b, char *fname)
+{ if (b->fetching)
+    { pthread_join(b->fetcher,NULL);
+      b->fetching = 0;
+    }
+  free(b->fname);
+  b->fname = Strdup(fname,"Allocating bax file name");
+  if (b->fname == NULL)
+    return;
+  if (pthread_create(&b->fetcher,NULL,fetchBaxData,b) == 0)
+    b->fetching = 1;
+}
+
+int getBaxData(BaxData *b, char *fname)
+{ int status;
+
+  if (b->fetching)
+    { pthread_join(b->fetcher,NULL);
+      b->fetching = 0;
+      if (strcmp(b->fname,fname) == 0)
+        return (b->fstatus);
+    }
+  status = loadBaxFile(b,fname);
+  return (status);
+}
+
 // Find the good read invervals of the baxfile b(FileID), output the reads of length >= minLen and
 //   score >= minScore to output (for the fasta or fastq part) and qvquiv (if b->quivqv is set)
 
-#define HOLE   0
-#define TYPE   1
-#define    ADAPTER_REGION 0
-#define    INSERT_REGION  1
-#define    HQV_REGION     2
-#define START  2
-#define FINISH 3
-#define SCORE  4
-
 #ifdef OBSOLETE
 
 static void writeBaxReads(BaxData *b, int minLen, int minScore, FILE *output, FILE* qvquiv)
@@ -428,38 +1253,69 @@ static void writeBaxReads(BaxData *b, int minLen, int minScore, FILE *output, FI
 
 #endif
 
-SubRead *nextSubread(BaxData *b, int prime)
-{ static SubRead sub;
+//  Set it to iterate over the subreads of the wells with indices in [zlo,zhi) of b (clipped
+//    to the wells [b->zbeg,b->zend) that were loaded).  Iterators over distinct or the same
+//    ranges of b may be used concurrently, except when b is being streamed in chunks, in
+//    which case an iterator always covers all the loaded wells and loads each chunk in turn
+//    (the first being reloaded if need be).
+
+void initSubreadIter(SubreadIter *it, BaxData *b, int zlo, int zhi)
+{ int *reg, lo, hi, m, hole;
+  int  i;
+
+  if (b->file_id >= 0)
+    { zlo = b->zbeg;
+      zhi = b->zend;
+      if (b->cbeg != b->zbeg)
+        b->ecode = fetchBases(b,b->file_id,b->zbeg,chunkEnd(b,b->zbeg),b->zoff,NULL,0);
+    }
+  if (zlo < (int) b->zbeg)
+    zlo = b->zbeg;
+  if (zhi > (int) b->zend)
+    zhi = b->zend;
+  if (zhi < zlo)
+    zhi = zlo;
+
+  reg  = b->regions;
+  hole = reg[HOLE] + zlo;
+  lo   = 0;                     //  first row of the region table for a hole >= hole
+  hi   = b->numHQR;
+  while (lo < hi)
+    { m = (lo+hi)/2;
+      if (reg[5*m+HOLE] < hole)
+        lo = m+1;
+      else
+        hi = m;
+    }
 
-  static int roff, *cur, h, w;
-  static int nreads, *hlen;
+  it->bax  = b;
+  it->cur  = reg + 5*lo;
+  it->r    = it->cur;
+  it->top  = it->cur;
+  it->h    = hole-1;
+  it->w    = zlo-1;
+  it->wbeg = zlo;
+  it->wend = zhi;
+  it->roff = 0;
+  for (i = b->cbeg; i < zlo; i++)
+    it->roff += b->readLen[i];
+}
 
-  static int *r, *top;
-  static int  hbeg, hend;
+//  Return the next subread of it, NULL when there are no more or a chunk could not be
+//    loaded (b->ecode != 0).  The subread is overwritten by the next call.
 
-#ifdef DEBUG
-  printf("printSubreadFields\n");
-#endif
+SubRead *nextSubread(SubreadIter *it)
+{ BaxData *b   = it->bax;
+  SubRead *sub = &it->sub;
+  int     *hlen, *cur, *r;
+  int      h, w;
 
   //  Find the HQV regions and output as reads according to the various output options
 
-  if (prime)
-    { cur     = b->regions;
-      h       = cur[HOLE]-1;
-      w       = -1;
-
-      nreads  = b->numZMW;
-      hlen    = b->readLen;
-      roff    = 0;
-
-      cur[5*b->numHQR] = nreads + cur[HOLE]; 
+  if (b->ecode != 0)
+    return (NULL);
 
-      r   = cur;
-      top = cur;
-      return (NULL);
-    }
-
-  for (r += 5 ; r <= top; r += 5)
+  for (r = it->r + 5; r <= it->top; r += 5)
     { int ibeg, iend;
 
       if (r[TYPE] != INSERT_REGION)
@@ -468,24 +1324,35 @@ SubRead *nextSubread(BaxData *b, int prime)
       ibeg = r[START];
       iend = r[FINISH];
 
-      if (ibeg < hbeg)
-        ibeg = hbeg;
-      if (iend > hend)
-        iend = hend;
-      if (iend-ibeg <= 0 || b->holeType[w] > 0)
+      if (ibeg < it->hbeg)
+        ibeg = it->hbeg;
+      if (iend > it->hend)
+        iend = it->hend;
+      if (iend-ibeg <= 0 || b->holeType[it->w] > 0)
         continue;
 
-      sub.fpulse = ibeg;
-      sub.lpulse = iend;
-      return (&sub);
+      it->r = r;
+      sub->fpulse = ibeg;
+      sub->lpulse = iend;
+      return (sub);
     }
 
-  if (w >= 0)
-    roff += hlen[w];
-  for (h++, w++; w < nreads; h++, w++)
+  hlen = b->readLen;
+  cur  = it->cur;
+  h    = it->h;
+  w    = it->w;
+  if (w >= it->wbeg)
+    it->roff += hlen[w];
+  for (h++, w++; w < it->wend; h++, w++)
     { int *bot, *hqv, qv;
       int ibeg, iend;
 
+      if (w >= (int) b->cend)
+        { if ((b->ecode = nextChunk(b)) != 0)
+            return (NULL);
+          it->roff = 0;
+        }
+
       while (cur[HOLE] < h)
         cur += 5;
       bot = hqv = cur;
@@ -494,41 +1361,222 @@ SubRead *nextSubread(BaxData *b, int prime)
             hqv = cur;
           cur += 5;
         }
-      top = cur-5;
+      it->top = cur-5;
 
       qv = hqv[SCORE];
       if (qv > 0)
-        { hbeg = hqv[START];
-          hend = hqv[FINISH];
-          for (r = bot; r <= top; r += 5)
+        { it->hbeg = hqv[START];
+          it->hend = hqv[FINISH];
+          for (r = bot; r <= it->top; r += 5)
             { if (r[TYPE] != INSERT_REGION)
                 continue;
 
               ibeg = r[START];
               iend = r[FINISH];
 
-              if (ibeg < hbeg)
-                ibeg = hbeg;
-              if (iend > hend)
-                iend = hend;
-	      if (iend-ibeg <= 0 || b->holeType[w] > 0)
+              if (ibeg < it->hbeg)
+                ibeg = it->hbeg;
+              if (iend > it->hend)
+                iend = it->hend;
+              if (iend-ibeg <= 0 || b->holeType[w] > 0)
                 continue;
 
-              sub.well     = h;
-              sub.fpulse   = ibeg;
-              sub.lpulse   = iend;
-              sub.qv       = qv;
-              sub.data_off = roff;
-              sub.zmw_off  = w;
-              return (&sub);
+              it->cur = cur;
+              it->h   = h;
+              it->w   = w;
+              it->r   = r;
+              sub->well     = h;
+              sub->fpulse   = ibeg;
+              sub->lpulse   = iend;
+              sub->qv       = qv;
+              sub->data_off = it->roff;
+              sub->zmw_off  = w;
+              return (sub);
             }
         }
-      roff += hlen[w];
+      it->roff += hlen[w];
     }
 
+  it->cur = cur;
+  it->h   = h;
+  it->w   = w;
+  it->r   = it->top = cur;
   return (NULL);
 }
 
+//  Fill b->table with all the subreads of the loaded wells in order, so that they can be
+//    filtered and formatted in any order or in parallel: -1 => out of memory (message sent)
+//    or b is being streamed in chunks, otherwise the # of subreads.
+
+int makeSubreadTable(BaxData *b)
+{ SubreadIter it;
+  SubRead    *s;
+  int         n;
+
+  if (b->file_id >= 0)
+    return (-1);
+
+  initSubreadIter(&it,b,b->zbeg,b->zend);
+  n = 0;
+  while ((s = nextSubread(&it)) != NULL)
+    { if (n >= b->tmax)
+        { b->tmax  = 1.2*n + 1000;
+          b->table = (SubRead *) Realloc(b->table,sizeof(SubRead)*b->tmax,
+                                         "Allocating subread table");
+          if (b->table == NULL)
+            { b->tmax = 0;
+              return (-1);
+            }
+        }
+      b->table[n++] = *s;
+    }
+  b->ntable = n;
+  return (n);
+}
+
+//  Transcoding of the base streams of a subread into the text form of .quiva and .arrow
+//    files.  On x86 the kernels do 16 bytes at a time with SSE2 compare-and-select, the
+//    instruction set being checked at run time, and the scalar loops finish the tail.
+
+#define LOWER_OFFSET 32
+#define PHRED_OFFSET 33
+
+#ifdef SIMD_QV
+
+__attribute__((target("sse2")))
+static int phred_sse2(char *dst, char *src, int len)
+{ __m128i v, big, top, off, lim;
+  int     i;
+
+  lim = _mm_set1_epi8(93);
+  top = _mm_set1_epi8(126);
+  off = _mm_set1_epi8(PHRED_OFFSET);
+  for (i = 0; i+16 <= len; i += 16)
+    { v   = _mm_loadu_si128((__m128i *) (src+i));
+      big = _mm_cmpgt_epi8(v,lim);
+      v   = _mm_or_si128(_mm_and_si128(big,top),_mm_andnot_si128(big,_mm_add_epi8(v,off)));
+      _mm_storeu_si128((__m128i *) (dst+i),v);
+    }
+  return (i);
+}
+
+__attribute__((target("sse2")))
+static int deltag_sse2(char *dst, char *tag, char *dqv, int len, int lower, int limit)
+{ __m128i t, e, low, lim, en;
+  int     i;
+
+  low = _mm_set1_epi8(lower);
+  lim = _mm_set1_epi8(limit);
+  en  = _mm_set1_epi8('n');
+  for (i = 0; i+16 <= len; i += 16)
+    { t = _mm_add_epi8(_mm_loadu_si128((__m128i *) (tag+i)),low);
+      e = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) (dqv+i)),lim);
+      t = _mm_or_si128(_mm_and_si128(e,en),_mm_andnot_si128(e,t));
+      _mm_storeu_si128((__m128i *) (dst+i),t);
+    }
+  return (i);
+}
+
+__attribute__((target("sse2")))
+static int pulse_sse2(char *dst, uint16 *pw, int len)
+{ __m128i a, b, four, zero;
+  int     i;
+
+  four = _mm_set1_epi16(4);
+  zero = _mm_set1_epi8('0');
+  for (i = 0; i+16 <= len; i += 16)
+    { a = _mm_loadu_si128((__m128i *) (pw+i));
+      b = _mm_loadu_si128((__m128i *) (pw+i+8));
+      a = _mm_sub_epi16(a,_mm_subs_epu16(a,four));     //  min(pw,4)
+      b = _mm_sub_epi16(b,_mm_subs_epu16(b,four));
+      _mm_storeu_si128((__m128i *) (dst+i),_mm_add_epi8(_mm_packus_epi16(a,b),zero));
+    }
+  return (i);
+}
+
+#endif
+
+static void phred(char *dst, char *src, int len)
+{ int i;
+
+  i = 0;
+#ifdef SIMD_QV
+  if (__builtin_cpu_supports("sse2"))
+    i = phred_sse2(dst,src,len);
+#endif
+  for ( ; i < len; i++)
+    if (src[i] > 93)
+      dst[i] = 126;
+    else
+      dst[i] = src[i] + PHRED_OFFSET;
+}
+
+//  Write the 5 quiva streams of subread s of b (dq, dt, iq, mq, and sq) to qv[0..4], without
+//    modifying b: the QVs as Phred+33 (capped at '~'), and the Del Tags in lower case save
+//    that a tag whose Del QV is that of N's becomes 'n'
+
+void getSubreadQVs(BaxData *b, SubRead *s, char *qv[5])
+{ char *dqv, *tag;
+  int   len, roff, lower, limit;
+  int   i;
+
+  len  = s->lpulse - s->fpulse;
+  roff = s->data_off + s->fpulse;
+  dqv  = b->delQV + roff;
+  tag  = b->delTag + roff;
+
+  lower = (len > 0 && isupper(tag[0])) ? LOWER_OFFSET : 0;
+  limit = b->delLimit;
+  if (isupper(limit))
+    limit += LOWER_OFFSET;
+
+  i = 0;
+#ifdef SIMD_QV
+  if (__builtin_cpu_supports("sse2"))
+    i = deltag_sse2(qv[1],tag,dqv,len,lower,limit);
+#endif
+  for ( ; i < len; i++)
+    if (dqv[i] == limit)
+      qv[1][i] = 'n';
+    else
+      qv[1][i] = tag[i] + lower;
+
+  phred(qv[0],dqv,len);
+  phred(qv[2],b->insQV+roff,len);
+  phred(qv[3],b->mergeQV+roff,len);
+  phred(qv[4],b->subQV+roff,len);
+}
+
+//  Write the pulse widths of subread s of b to arr as the digits '0' to '4' (all widths
+//    of 4 or more becoming '4'), without modifying b
+
+void getSubreadPulses(BaxData *b, SubRead *s, char *arr)
+{ uint16 *pw;
+  int     len, i;
+
+  len = s->lpulse - s->fpulse;
+  pw  = b->pulseW + s->data_off + s->fpulse;
+
+  i = 0;
+#ifdef SIMD_QV
+  if (__builtin_cpu_supports("sse2"))
+    i = pulse_sse2(arr,pw,len);
+#endif
+  for ( ; i < len; i++)
+    if (pw[i] >= 4)
+      arr[i] = '4';
+    else
+      arr[i] = pw[i] + '0';
+}
+
+//  Print the time taken by the last load of b
+
+void printBaxTiming(BaxData *b)
+{ fprintf(stderr,"   Loaded with the %s driver: open %.3fs, well tables %.3fs,",
+                 b->image ? "core (whole file image)" : "sec2",b->topen,b->ttable);
+  fprintf(stderr," base streams %.3fs\n",b->tbase);
+}
+
 //  Print an error message
 
 void printBaxError(int ecode)
@@ -589,7 +1637,18 @@ void printBaxError(int ecode)
 //  Free *the* bax data structure
 
 void freeBaxData(BaxData *b)
-{ free(b->baseCall);
+{ if (b->fetching)
+    pthread_join(b->fetcher,NULL);
+  if (b->file_id >= 0)
+    closeFile(b->file_id);
+#ifdef CHUNK_READ
+  if (b->pool != NULL)
+    freeInflater((Inflater *) b->pool);
+#endif
+  free(b->fname);
+  free(b->table);
+  free(b->span);
+  free(b->baseCall);
   free(b->delQV);
   free(b->fastQV);
   free(b->holeType);
@@ -598,3 +1657,88 @@ void freeBaxData(BaxData *b)
   free(b->pulseW);
   free(b->snrVec);
 }
+
+#ifdef ITER_CHECK
+
+  //  make iter_check: load each .bax.h5 argument whole and check that the subreads of one
+  //    iterator over all its wells are exactly those of IC_PARTS iterators over consecutive
+  //    ranges of the wells run concurrently, one per thread.
+
+#define IC_PARTS 3
+
+typedef struct
+  { BaxData  *bax;
+    int       zlo, zhi;
+    int       nsub;
+    SubRead  *sub;
+  } IterPart;
+
+static void *iter_part(void *arg)
+{ IterPart   *p = (IterPart *) arg;
+  SubreadIter it;
+  SubRead    *s;
+
+  p->nsub = 0;
+  initSubreadIter(&it,p->bax,p->zlo,p->zhi);
+  while ((s = nextSubread(&it)) != NULL)
+    p->sub[p->nsub++] = *s;
+  return (NULL);
+}
+
+int main(int argc, char *argv[])
+{ BaxData   b;
+  IterPart  all, part[IC_PARTS];
+  pthread_t thread[IC_PARTS];
+  int       i, k, n, m, status, fail;
+
+  fail = 0;
+  for (i = 1; i < argc; i++)
+    { initBaxData(&b,1,1,1);
+      if ((status = getBaxData(&b,argv[i])) != 0)
+        { fprintf(stderr,"iter_check: %s: ",argv[i]);
+          printBaxError(status);
+          freeBaxData(&b);
+          fail = 1;
+          continue;
+        }
+
+      all.bax = &b;
+      all.zlo = b.zbeg;
+      all.zhi = b.zend;
+      all.sub = (SubRead *) malloc(sizeof(SubRead)*(b.numHQR+1));
+      iter_part(&all);
+
+      n = b.zend - b.zbeg;
+      for (k = 0; k < IC_PARTS; k++)
+        { part[k].bax = &b;
+          part[k].zlo = b.zbeg + (n*k)/IC_PARTS;
+          part[k].zhi = b.zbeg + (n*(k+1))/IC_PARTS;
+          part[k].sub = (SubRead *) malloc(sizeof(SubRead)*(b.numHQR+1));
+          pthread_create(thread+k,NULL,iter_part,part+k);
+        }
+      for (k = 0; k < IC_PARTS; k++)
+        pthread_join(thread[k],NULL);
+
+      m = 0;
+      for (k = 0; k < IC_PARTS; k++)
+        { if (m + part[k].nsub > all.nsub
+              || memcmp(all.sub+m,part[k].sub,sizeof(SubRead)*part[k].nsub) != 0)
+            break;
+          m += part[k].nsub;
+        }
+      if (k < IC_PARTS || m != all.nsub)
+        { printf("  FAIL  %d iterators on %s\n",IC_PARTS,argv[i]);
+          fail = 1;
+        }
+      else
+        printf("  ok    %d iterators on %s (%d subreads)\n",IC_PARTS,argv[i],m);
+
+      for (k = 0; k < IC_PARTS; k++)
+        free(part[k].sub);
+      free(all.sub);
+      freeBaxData(&b);
+    }
+  exit (fail);
+}
+
+#endif
@@ -16,9 +16,10 @@
 #define _BAX_H5
 
 #include <hdf5.h>
+#include <pthread.h>
 #include "DB.h"
 
-typedef struct
+typedef struct BaxData_
   { int     fastq;         // if non-zero get fastq quality values (obsolete)
     int     quivqv;        // if non-zero get quiver file
     int     arrow;         // if non-zero get arrow data
@@ -47,9 +48,46 @@ typedef struct
 
     int     delLimit;     //  The Del QV associated with N's in the Del Tag
 
+    int     part, nparts;  // if nparts > 0 only load the part'th of nparts slices of the wells
+    int     hlo, hhi;      // else if hlo <= hhi only load the wells with hole # in [hlo,hhi]
+    hsize_t zbeg, zend;    // wells [zbeg,zend) are extracted, the first base of zbeg is at zoff
+    hsize_t zoff;
+
+    int64   chunk;         // if > 0 the base streams are read in chunks of at most this many bytes
+    hid_t   file_id;       // the open file while streaming chunks, -1 otherwise
+    hsize_t nbases;        // # of bases in the file
+    hsize_t cbeg, cend;    // the base streams hold the bases of wells [cbeg,cend) from coff on
+    hsize_t coff;
+    int     nthreads;      // # of threads inflating the chunks of compressed base streams
+    void   *pool;          // the pool of threads doing so, started by the first chunk read
+    int     ecode;         // non-zero => nextSubread failed to load a chunk, the error code
+
+    hsize_t mmax, bmax;    // highwater marks of the movie name, base stream, ZMW, and region
+    hsize_t zmax, hmax;    //   allocations
+
+    int       fetching;    // non-zero => fname is being loaded by thread fetcher,
+    char     *fname;       //   with result fstatus
+    pthread_t fetcher;
+    int       fstatus;
+
+    struct SubRead_ *table;  // all the subreads of the loaded wells (see makeSubreadTable)
+    int       ntable;
+    int       tmax;
+
+    int     (*keep)(void *, struct BaxData_ *, struct SubRead_ *);
+    void     *karg;        // if keep != NULL, only the bases of subreads passing keep are loaded
+    hsize_t  *span;        //   namely those in the spans [span[2i],span[2i+1]) of the last load
+    int       nspan;
+    int       smax;
+
+    int       image;       // if non-zero read each file whole into memory on opening it
+    double    topen;       // wall seconds the last load spent opening the file (with image,
+    double    ttable;      //   reading it), reading the per-well tables, and reading the
+    double    tbase;       //   base streams (if streaming, of the first chunk)
+
   } BaxData;
 
-typedef struct
+typedef struct SubRead_
   { int data_off;   //  Offset of stream data into vectors
     int zmw_off;    //  Offset of well-indexed data
 
@@ -59,11 +97,38 @@ typedef struct
     int qv;
   } SubRead;
 
+typedef struct
+  { BaxData *bax;
+    SubRead  sub;         //  the subread last returned
+    int      roff;        //  offset in bax's base streams of the current well's bases
+    int      h, w;        //  hole number and index of the current well
+    int      wbeg, wend;  //  the range of well indices iterated over
+    int     *cur;         //  next row of the region table to examine
+    int     *r, *top;     //  the current and last region rows of the current well
+    int      hbeg, hend;  //  the HQ interval of the current well
+  } SubreadIter;
+
 void initBaxData(BaxData *b, int fastq, int quivqv, int arrow);
+void setBaxShard(BaxData *b, int part, int nparts, int lo, int hi);
+void setBaxChunk(BaxData *b, int mbytes);
+void setBaxThreads(BaxData *b, int nthreads);
+void setBaxImage(BaxData *b, int image);
+void setBaxFilter(BaxData *b, int (*keep)(void *arg, BaxData *b, SubRead *s), void *arg);
 void freeBaxData(BaxData *b);
 
 int      getBaxData(BaxData *b, char *fname);
+void     prefetchBaxData(BaxData *b, char *fname);
 void     printBaxError(int ecode);
-SubRead *nextSubread(BaxData *b, int prime);
+void     printBaxTiming(BaxData *b);
+void     initSubreadIter(SubreadIter *it, BaxData *b, int zlo, int zhi);
+SubRead *nextSubread(SubreadIter *it);   //  NULL & b->ecode != 0 => error
+int      makeSubreadTable(BaxData *b);
+
+  //  Transcode the streams of subread s of b into the caller's buffers (each of at least
+  //    s->lpulse - s->fpulse bytes) in the text form of .quiva and .arrow files: b is not
+  //    modified so the same subread can be transcoded any number of times
+
+void     getSubreadQVs(BaxData *b, SubRead *s, char *qv[5]);
+void     getSubreadPulses(BaxData *b, SubRead *s, char *arr);
 
 #endif // _BAX_H5
@@ -0,0 +1,94 @@
+#!/bin/bash
+#
+#  check.sh <input:pacbio> ...
+#
+#    Extract each .bax.h5 or .subreads.bam input along the plain path and along each of
+#    the alternative paths of dextract and dex2DB that must give the same result, and
+#    report any whose output differs.  Run from the build directory, e.g.
+#
+#        make check INPUTS="m1.1.bax.h5 m1.subreads.bam"
+#
+#    Exits with 1 if any check failed.
+
+DEXTRACT=./dextract
+DEX2DB=./dex2DB
+ITER_CHECK=./iter_check
+FILTER='ln>=500&&rq>=750'
+
+TMP=$(mktemp -d)
+trap 'rm -rf $TMP' EXIT
+FAIL=0
+
+#  report <what> <input> <status>
+
+report()
+{ if [ $3 = 0 ]
+    then echo "  ok    $1"
+    else echo "  FAIL  $1 on $2"; FAIL=1
+  fi
+}
+
+#  same_x <what> <input> <flags> <alternative flags>: dextract the input with each set of
+#    flags and compare the outputs
+
+same_x()
+{ rm -rf $TMP/a $TMP/b
+  mkdir $TMP/a $TMP/b
+  $DEXTRACT $3 -o$TMP/a/x "$2" && $DEXTRACT $4 -o$TMP/b/x "$2" && diff -r $TMP/a $TMP/b >/dev/null
+  report "$1" "$2" $?
+}
+
+#  same_db <what> <input> <flags> <alternative flags>: build a DB from the input with each
+#    set of flags and compare them
+
+same_db()
+{ rm -rf $TMP/a $TMP/b
+  mkdir $TMP/a $TMP/b
+  $DEX2DB $3 $TMP/a/D "$2" && $DEX2DB $4 $TMP/b/D "$2" && diff -r $TMP/a $TMP/b >/dev/null
+  report "$1" "$2" $?
+}
+
+#  same_pbi <what> <input> <flags>: dextract the input with the flags both as is and through
+#    a link without its .pbi index, and compare the outputs
+
+same_pbi()
+{ rm -rf $TMP/a $TMP/b $TMP/np
+  mkdir $TMP/a $TMP/b $TMP/np
+  ln -s "$(cd "$(dirname "$2")" && pwd)/$(basename "$2")" $TMP/np/x.subreads.bam
+  $DEXTRACT $3 -o$TMP/a/x "$2" && $DEXTRACT $3 -o$TMP/b/x $TMP/np/x.subreads.bam &&
+    diff -r $TMP/a $TMP/b >/dev/null
+  report "$1" "$2" $?
+}
+
+if [ $# = 0 ]
+  then echo "Usage: check.sh <input:pacbio> ..."; exit 1
+fi
+
+for IN in "$@"
+do
+  echo "$IN:"
+  case "$IN" in
+  *.bax.h5)
+    same_x  "dextract -m1 (streaming)"      "$IN" "-faq" "-faq -m1"
+    same_x  "dextract -e (filtered spans)"  "$IN" "-faq -m1 -e$FILTER" "-faq -e$FILTER"
+    same_x  "dextract -e -T3 (span chunks)" "$IN" "-faq -m1 -e$FILTER" "-faq -T3 -e$FILTER"
+    same_db "dex2DB -q -m1 (streaming)"     "$IN" "-q" "-q -m1"
+    same_db "dex2DB -a -m1 (streaming)"     "$IN" "-a" "-a -m1"
+    same_db "dex2DB -q -e (filtered spans)" "$IN" "-q -m1 -e$FILTER" "-q -e$FILTER"
+    same_x  "dextract -i (file image)"      "$IN" "-faq" "-faq -i"
+    $ITER_CHECK "$IN" || FAIL=1
+    ;;
+  *.subreads.bam)
+    if [ -e "$IN.pbi" ]
+      then same_pbi "dextract -e (.pbi pushdown)"     "$IN" "-faq -e$FILTER"
+           same_pbi "dextract -e -T3 (.pbi pushdown)" "$IN" "-faq -T3 -e$FILTER"
+      else echo "  skipped .pbi checks, no index"
+    fi
+    ;;
+  *)
+    echo "  skipped, not a .bax.h5 or .subreads.bam file"
+    ;;
+  esac
+done
+
+exit $FAIL
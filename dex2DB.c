@@ -28,6 +28,7 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "DB.h"
 #include "sam.h"
@@ -41,8 +42,8 @@
 #endif
 
 static char *Usage[] =
-         { "[-vlaq] [-e<expr(ln>=500 && rq>=750)>]",
-           "  <path:string> ( -f<file> | <input:pacbio> ... )"
+         { "[-vlaqi] [-T<int(4)>] [-B<int(4)>] [-m<int>] [-P<int(1)>] [-s<shard:i/n|lo-hi>]",
+           "  [-J<path>] [-e<expr(ln>=500 && rq>=750)>] <path:string> ( -f<file> | <input:pacbio> ... )"
          };
 
 typedef struct
@@ -102,6 +103,67 @@ int next_file(File_Iterator *it)
   return (1);
 }
 
+  //  The name next_file will deliver after the next k without advancing it, NULL if there
+  //    is none or it cannot be read.  The name is in a static buffer.
+
+char *peek_file(File_Iterator *it, int k)
+{ static char pbuffer[MAX_NAME+8];
+  char  *eol;
+  off_t  off;
+
+  if (it->input == NULL)
+    { if (it->count+k >= it->argc)
+        return (NULL);
+      return (it->argv[it->count+k]);
+    }
+  off = ftello(it->input);
+  eol = NULL;
+  do
+    { if (fgets(pbuffer,MAX_NAME+8,it->input) == NULL)
+        eol = NULL;
+      else
+        eol = index(pbuffer,'\n');
+    }
+  while (eol != NULL && k-- > 0);
+  fseeko(it->input,off,SEEK_SET);
+  if (eol == NULL)
+    return (NULL);
+  *eol = '\0';
+  return (pbuffer);
+}
+
+#define IS_BAX 0
+#define IS_BAM 1
+#define IS_SAM 2
+
+  //  Determine the type of PacBio input name, setting *path and *core to its directory and
+  //    root name and *empty to whether the file is empty: -1 => there is no such file with
+  //    a PacBio extension
+
+static int inputType(char *name, char **path, char **core, int *empty)
+{ FILE *file;
+  int   type;
+
+  *path = PathTo(name);
+  *core = Root(name,".subreads.bam");
+  type  = IS_BAM;
+  if ((file = fopen(Catenate(*path,"/",*core,".subreads.bam"),"r")) == NULL)
+    { free(*core);
+      *core = Root(name,".subreads.sam");
+      type  = IS_SAM;
+      if ((file = fopen(Catenate(*path,"/",*core,".subreads.sam"),"r")) == NULL)
+        { free(*core);
+          *core = Root(name,".bax.h5");
+          type  = IS_BAX;
+          if ((file = fopen(Catenate(*path,"/",*core,".bax.h5"),"r")) == NULL)
+            return (-1);
+        }
+    }
+  *empty = (fgetc(file) == EOF);
+  fclose(file);
+  return (type);
+}
+
 static char Number[128] =
     { 0, 0, 0, 0, 0, 0, 0, 0,
       0, 0, 0, 0, 0, 0, 0, 0,
@@ -121,6 +183,387 @@ static char Number[128] =
       0, 0, 0, 0, 0, 0, 0, 0,
     };
 
+  //  Filter a bax subread.  The loader of the next .bax.h5 also filters on its thread so as to
+  //    read only the base streams of the subreads that pass, and concurrent parts filter as
+  //    they transcode, all sharing the one filter.
+
+static int keepSubread(void *arg, BaxData *b, SubRead *s)
+{ return (evaluate_bax_filter((Filter *) arg,b,s)); }
+
+  //  Adding the subreads of a loaded .bax.h5 to a DB.  An Adder holds the streams to which
+  //    they are appended (quiva if a Quiver DB, arrow if an Arrow DB), the filters of the
+  //    Quiver scan and of the transfer, the state of the append, and the totals of the reads
+  //    added.  The reads go to the .bps from offset boff on, blen bytes being added.  The
+  //    transcoding scratch buffers and the record buffer of a well are its own, so that
+  //    with -P each part has an Adder writing to temporary streams.
+
+typedef struct
+  { FILE      *bases, *indx, *quiva, *arrow;
+    int        lossy;
+    Filter    *scan, *expr;
+    int64      boff, blen;
+    int        nreads, maxlen;
+    int64      totlen, count[4];
+    DAZZ_READ *prec;
+    int        pmax;
+    char      *scratch;
+    int        smax;
+    char      *sqv[5], *sread, *spulse;
+  } Adder;
+
+static int initAdder(Adder *a, FILE *bases, FILE *indx, FILE *quiva, FILE *arrow, int lossy,
+                     Filter *scan, Filter *expr)
+{ a->bases   = bases;
+  a->indx    = indx;
+  a->quiva   = quiva;
+  a->arrow   = arrow;
+  a->lossy   = lossy;
+  a->scan    = scan;
+  a->expr    = expr;
+  a->scratch = NULL;
+  a->smax    = 0;
+  a->pmax    = 100;
+  a->prec    = (DAZZ_READ *) Malloc(sizeof(DAZZ_READ)*a->pmax,"Allocating record buffer");
+  return (a->prec == NULL);
+}
+
+static void freeAdder(Adder *a)
+{ free(a->scratch);
+  free(a->prec);
+}
+
+  //  Scratch buffers into which the bases and streams of a bax subread are transcoded, so
+  //    that the loaded data is never modified (Compress_Read also zeroes the bytes just past
+  //    the read): 0 => OK, 1 => out of memory (message sent)
+
+static int ensureScratch(Adder *a, int len)
+{ int k;
+
+  if (len+4 <= a->smax)
+    return (0);
+  a->smax    = 1.2*len + 1000;
+  a->scratch = (char *) Realloc(a->scratch,7ll*a->smax,"Allocating scratch buffers");
+  if (a->scratch == NULL)
+    { a->smax = 0;
+      return (1);
+    }
+  for (k = 0; k < 5; k++)
+    a->sqv[k] = a->scratch + k*a->smax;
+  a->sread  = a->scratch + 5*a->smax;
+  a->spulse = a->scratch + 6*a->smax;
+  return (0);
+}
+
+  //  The Quiver coding routines accumulate their statistics in, and return, static state,
+  //    so the parts of a Quiver DB take turns from the scan through the transfer, i.e. only
+  //    their loads overlap
+
+static pthread_mutex_t QV_Lock = PTHREAD_MUTEX_INITIALIZER;
+
+  //  Append the subreads of bax that pass a->expr to the streams of a: 0 => OK, 1 => error
+  //    (message sent)
+
+static int addBax(Adder *a, BaxData *bax, int verbose)
+{ SubreadIter iter;
+  SubRead    *s;
+  QVcoding   *coding = NULL;
+  int         pwell, pcnt;
+  int         i, x, ret;
+  int64       qpos = 0;
+  DAZZ_READ  *prec;
+
+  a->blen   = 0;
+  a->nreads = 0;
+  a->maxlen = 0;
+  a->totlen = 0;
+  for (i = 0; i < 4; i++)
+    a->count[i] = 0;
+
+  ret = 1;
+  if (a->quiva != NULL)
+    pthread_mutex_lock(&QV_Lock);
+
+  //  If QUIVER then in a first pass accumulate all the QV statistics and produce
+  //    coding tables
+
+  if (a->quiva != NULL)
+    { if (verbose)
+        { fprintf(stderr, "  Compressing streams ...\n"); fflush(stderr); }
+
+      initSubreadIter(&iter,bax,bax->zbeg,bax->zend);
+      QVcoding_Scan1(0,NULL,NULL,NULL,NULL,NULL);
+      while ((s = nextSubread(&iter)) != NULL)
+        { int rlen;
+
+          if ( ! keepSubread(a->scan,bax,s))
+            continue;
+
+          rlen = s->lpulse - s->fpulse;
+          if (ensureScratch(a,rlen))
+            goto exit;
+          getSubreadQVs(bax,s,a->sqv);
+
+          QVcoding_Scan1(rlen,a->sqv[0],a->sqv[1],a->sqv[2],a->sqv[3],a->sqv[4]);
+        }
+      if (bax->ecode != 0)
+        { fprintf(stderr, "%s: ", Prog_Name);
+          printBaxError(bax->ecode);
+          goto exit;
+        }
+
+      coding = Create_QVcoding(a->lossy);
+      if (coding == NULL)
+        goto exit;
+
+      coding->prefix = Strdup(".qvs","Allocating header prefix");
+      if (coding->prefix == NULL)
+        goto exit;
+
+      qpos = ftello(a->quiva);
+      Write_QVcoding(a->quiva,coding);
+    }
+
+  //  In the penultimate pass, read each entry and accumulate in DB
+
+  if (verbose)
+    { fprintf(stderr, "  Transferring data ...\n"); fflush(stderr); }
+
+  prec  = a->prec;
+  pcnt  = 0;
+  pwell = -1;
+  initSubreadIter(&iter,bax,bax->zbeg,bax->zend);
+  while ((s = nextSubread(&iter)) != NULL)
+    { int    rlen, clen;
+      char  *base, *read;
+
+      if ( ! keepSubread(a->expr,bax,s))
+        continue;
+
+      rlen    = s->lpulse - s->fpulse;
+      base    = bax->baseCall + s->fpulse + s->data_off;
+      if (ensureScratch(a,rlen))
+        goto exit;
+      read    = a->sread;
+
+      for (i = 0; i < rlen; i++)
+        { x = Number[(int) base[i]];
+          a->count[x] += 1;
+          read[i] = x;
+        }
+      a->nreads += 1;
+      a->totlen += rlen;
+      if (rlen > a->maxlen)
+        a->maxlen = rlen;
+
+      prec[pcnt].origin = s->well;
+      prec[pcnt].fpulse = s->fpulse;
+      prec[pcnt].rlen   = rlen;
+      prec[pcnt].boff   = a->boff + a->blen;
+      prec[pcnt].flags  = s->qv;
+      prec[pcnt].coff   = -1;
+
+      Compress_Read(rlen,read);
+      clen = COMPRESSED_LEN(rlen);
+      fwrite(read,1,clen,a->bases);
+
+      if (a->quiva != NULL)
+        { getSubreadQVs(bax,s,a->sqv);
+
+          prec[pcnt].coff = qpos;
+
+          Compress_Next_QVentry1(rlen,a->sqv[0],a->sqv[1],a->sqv[2],
+                                 a->sqv[3],a->sqv[4],a->quiva,coding,a->lossy);
+          qpos = ftello(a->quiva);
+        }
+      if (a->arrow != NULL)
+        { float  *snr;
+          uint16 *raw;
+          char   *pulse;
+          uint16  cnr[4];
+
+          raw   = bax->pulseW + s->fpulse + s->data_off;
+          pulse = a->spulse;
+
+          for (i = 0; i < rlen; i++)
+            pulse[i] = raw[i]-1;
+
+          snr = bax->snrVec + 4*s->zmw_off;
+          for (i = 0; i < 4; i++)
+            cnr[i] = (uint32) (snr[bax->chan[i]] * 100.);
+          *((uint64  *) &(prec[pcnt].coff)) = ((uint64) cnr[0]) << 48 |
+                                              ((uint64) cnr[1]) << 32 |
+                                              ((uint64) cnr[2]) << 16 |
+                                              ((uint64) cnr[3]);
+
+          Compress_Read(rlen,pulse);
+          fwrite(pulse,1,clen,a->arrow);
+        }
+
+      a->blen += clen;
+
+      if (pwell == s->well)
+        { prec[pcnt].flags |= DB_CCS;
+          pcnt += 1;
+          if (pcnt >= a->pmax)
+            { a->pmax = ((int) (pcnt*1.2)) + 100;
+              prec = (DAZZ_READ *) realloc(prec,sizeof(DAZZ_READ)*a->pmax);
+              if (prec == NULL)
+                { fprintf(stderr,"%s: Out of memory",Prog_Name);
+                  fprintf(stderr," (Allocating %d read records)\n",a->pmax);
+                  goto exit;
+                }
+              a->prec = prec;
+            }
+        }
+      else if (pcnt == 0)
+        pcnt += 1;
+      else
+        { x = 0;
+          for (i = 1; i < pcnt; i++)
+            if (prec[i].rlen > prec[x].rlen)
+              x = i;
+          prec[x].flags |= DB_BEST;
+          fwrite(prec,sizeof(DAZZ_READ),pcnt,a->indx);
+          prec[0] = prec[pcnt];
+          pcnt = 1;
+        }
+      pwell = s->well;
+    }
+  if (bax->ecode != 0)
+    { fprintf(stderr, "%s: ", Prog_Name);
+      printBaxError(bax->ecode);
+      goto exit;
+    }
+
+  //  Complete processing of current file: flush last well group
+
+  x = 0;
+  for (i = 1; i < pcnt; i++)
+    if (prec[i].rlen > prec[x].rlen)
+      x = i;
+  prec[x].flags |= DB_BEST;
+  fwrite(prec,sizeof(DAZZ_READ),pcnt,a->indx);
+  ret = 0;
+
+exit:
+  if (a->quiva != NULL)
+    pthread_mutex_unlock(&QV_Lock);
+  return (ret);
+}
+
+  //  With -P, a run of consecutive .bax.h5 inputs (e.g. the 3 parts of an RS II movie) are
+  //    loaded and transcoded concurrently, each part into temporary .bps, .idx, and .qvs or
+  //    .arw streams that are then appended to the DB in input order, relocating the .bps and
+  //    .qvs offsets of the part's read records.
+
+typedef struct
+  { BaxData   bax;       //  this part's bax buffer
+    Adder     add;       //    and its adder writing to temporaries
+    char     *fname;     //  .bax.h5 file to add
+    int       status;    //  getBaxData status
+    int       ret;       //  0 => OK, 1 => error
+    int       forked;    //  part is being added by thread
+    pthread_t thread;
+  } Part;
+
+static void *addPart(void *arg)
+{ Part *p = (Part *) arg;
+
+  p->status = getBaxData(&p->bax,p->fname);
+  if (p->status != 0)
+    p->ret = 1;
+  else
+    p->ret = addBax(&p->add,&p->bax,0);
+  return (NULL);
+}
+
+  //  Close the temporary streams of part p
+
+static void closePart(Part *p)
+{ FILE **t[4];
+  int    k;
+
+  t[0] = &p->add.bases;
+  t[1] = &p->add.indx;
+  t[2] = &p->add.quiva;
+  t[3] = &p->add.arrow;
+  for (k = 0; k < 4; k++)
+    { if (*t[k] != NULL)
+        fclose(*t[k]);
+      *t[k] = NULL;
+    }
+}
+
+  //  Create new temporary streams for part p: 0 => OK, 1 => error (message sent)
+
+static int openPart(Part *p, int quiver, int arrow)
+{ closePart(p);
+  if ((p->add.bases = tmpfile()) == NULL || (p->add.indx = tmpfile()) == NULL ||
+      (quiver && (p->add.quiva = tmpfile()) == NULL) ||
+      (arrow  && (p->add.arrow = tmpfile()) == NULL))
+    { fprintf(stderr,"%s: Cannot create temporary output for %s\n",Prog_Name,p->fname);
+      return (1);
+    }
+  return (0);
+}
+
+  //  Wait for the parts [beg,end) of a run that are still underway, so that no part is
+  //    left inside the HDF5 library when exiting on an error
+
+static void waitParts(Part *part, int beg, int end)
+{ for ( ; beg < end; beg++)
+    if (part[beg].forked)
+      { pthread_join(part[beg].thread,NULL);
+        part[beg].forked = 0;
+      }
+}
+
+  //  Append the contents of temporary src to dst: 0 => OK, 1 => error (message sent)
+
+static int appendPart(FILE *dst, FILE *src)
+{ char   buf[0x10000];
+  size_t n;
+
+  if (src == NULL)
+    return (0);
+  rewind(src);
+  while ((n = fread(buf,1,sizeof(buf),src)) > 0)
+    if (fwrite(buf,1,n,dst) != n)
+      { fprintf(stderr,"%s: Could not write to DB\n",Prog_Name);
+        return (1);
+      }
+  if (ferror(src))
+    { fprintf(stderr,"%s: Could not read back temporary part output\n",Prog_Name);
+      return (1);
+    }
+  return (0);
+}
+
+  //  Append the read records of temporary src to dst, adding boff to their .bps offsets and,
+  //    if quiver, coff to their .qvs offsets: 0 => OK, 1 => error (message sent)
+
+static int appendRecords(FILE *dst, FILE *src, int64 boff, int quiver, int64 coff)
+{ DAZZ_READ rec[1024];
+  size_t    n, i;
+
+  rewind(src);
+  while ((n = fread(rec,sizeof(DAZZ_READ),1024,src)) > 0)
+    { for (i = 0; i < n; i++)
+        { rec[i].boff += boff;
+          if (quiver)
+            rec[i].coff += coff;
+        }
+      if (fwrite(rec,sizeof(DAZZ_READ),n,dst) != n)
+        { fprintf(stderr,"%s: Could not write to DB\n",Prog_Name);
+          return (1);
+        }
+    }
+  if (ferror(src))
+    { fprintf(stderr,"%s: Could not read back temporary part output\n",Prog_Name);
+      return (1);
+    }
+  return (0);
+}
 
 int main(int argc, char *argv[])
 { FILE  *istub, *ostub;
@@ -142,24 +585,40 @@ int main(int argc, char *argv[])
   int     LOSSY;
   int     ARROW;
   int     QUIVER;
-  Filter *EXPR;
+  int     IMAGE;
+  int     NTHREADS;
+  int     BUFFER;
+  int     CHUNK;
+  int     PARTS;
+  Filter *EXPR, *WATCH;
+  char   *JSON;
+  FILE   *JFILE;
+  int     JCOUNT;
+  Shard   SHARD, *SP;
 
   //   Process command line
 
   { int   i, j, k;
     int   flags[128];
+    char *eptr;
 
     ARG_INIT("dex2DB")
 
-    IFILE = NULL;
-    EXPR  = NULL;
+    IFILE    = NULL;
+    EXPR     = NULL;
+    JSON     = NULL;
+    NTHREADS = 4;
+    BUFFER   = 4;
+    CHUNK    = 0;
+    PARTS    = 1;
+    SP       = NULL;
 
     j = 1;
     for (i = 1; i < argc; i++)
       if (argv[i][0] == '-')
         switch (argv[i][1])
         { default:
-            ARG_FLAGS("vlaq")
+            ARG_FLAGS("vlaqi")
             break;
           case 'f':
             IFILE = fopen(argv[i]+2,"r");
@@ -171,6 +630,30 @@ int main(int argc, char *argv[])
           case 'e':
             EXPR = parse_filter(argv[i]+2);
             break;
+          case 'J':
+            JSON = argv[i]+2;
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+          case 'B':
+            ARG_POSITIVE(BUFFER,"Read-ahead buffer size (MB)")
+            if (BUFFER > 1024)
+              { fprintf(stderr,"%s: Read-ahead buffer size (MB) must be <= 1024\n",Prog_Name);
+                exit (1);
+              }
+            break;
+          case 'm':
+            ARG_POSITIVE(CHUNK,"Bax chunk size (MB)")
+            break;
+          case 'P':
+            ARG_POSITIVE(PARTS,"Number of concurrent bax parts")
+            break;
+          case 's':
+            if (parse_shard(argv[i]+2,&SHARD))
+              exit (1);
+            SP = &SHARD;
+            break;
         }
       else
         argv[j++] = argv[i];
@@ -180,6 +663,9 @@ int main(int argc, char *argv[])
     LOSSY   = flags['l'];
     ARROW   = flags['a'];
     QUIVER  = flags['q'];
+    IMAGE   = flags['i'];
+
+    sam_set_buffer(BUFFER);
 
     if (EXPR == NULL)
       EXPR = parse_filter("ln>=500 && rq>=750");
@@ -193,6 +679,21 @@ int main(int argc, char *argv[])
         fprintf(stderr,"      -a: Build or add to an arrow DB.\n");
         fprintf(stderr,"      -q: Build or add to a quiva DB.\n");
         fprintf(stderr,"      -l: Use lossy compression (with -q option only).\n");
+        fprintf(stderr,"      -i: Read each .bax.h5 whole into memory with one sequential read.\n");
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -T: Number of threads used to decompress .bam input and to inflate\n");
+        fprintf(stderr,"        : the base streams of .bax.h5 input.\n");
+        fprintf(stderr,"      -P: Load up to this many consecutive .bax.h5 inputs concurrently,\n");
+        fprintf(stderr,"        : e.g. -P3 for the 3 parts of an RS II movie.  The reads of the\n");
+        fprintf(stderr,"        : parts are transcoded concurrently, save for a Quiver DB whose\n");
+        fprintf(stderr,"        : parts are transcoded one at a time.\n");
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -s: Only add the i'th of n equal slices of the wells of each input,\n");
+        fprintf(stderr,"        : or the wells with hole numbers in [lo,hi].  A slice of a .bam\n");
+        fprintf(stderr,"        : requires its .pbi index.\n");
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -v: Report progress and per file filter statistics and timing.\n");
+        fprintf(stderr,"      -J: Write the per file filter statistics to path as JSON.\n");
         fprintf(stderr,"\n");
         fprintf(stderr,"      -e: subread selection expression.  Possible variables are:\n");
         fprintf(stderr,"           zm  - well number\n");
@@ -211,6 +712,25 @@ int main(int argc, char *argv[])
       }
   }
 
+  //  With -v or -J, the subreads added are filtered through a watched handle on EXPR that
+  //    counts what each input's records do, while pre-tests and first passes use EXPR
+
+  WATCH = EXPR;
+  if (VERBOSE || JSON != NULL)
+    { WATCH = watch_filter(EXPR);
+      if (WATCH == NULL)
+        exit (1);
+    }
+
+  JFILE  = NULL;
+  JCOUNT = 0;
+  if (JSON != NULL)
+    { JFILE = Fopen(JSON,"w");
+      if (JFILE == NULL)
+        exit (1);
+      fprintf(JFILE,"{ \"program\": \"dex2DB\", \"inputs\": [");
+    }
+
   //  Try to open DB file, if present then adding to DB, otherwise creating new DB.  Set up
   //  variables as follows:
   //    dbname = full name of db = <pwd>/<root>.db
@@ -387,7 +907,10 @@ int main(int argc, char *argv[])
     DAZZ_READ     *prec;
     int            c;
     File_Iterator *ng = NULL;
-    BaxData       _bax, *bax = &_bax;
+    BaxData       _bax[2], *bax = _bax;
+    Adder          serial;
+    Part          *part;
+    int            pcur, prun;
     samFile       *input;
 
     //  Buffer for reads all in the same well
@@ -408,48 +931,68 @@ int main(int argc, char *argv[])
     if (ng == NULL)                              //    from command line or file
       goto error;
 
-    initBaxData(bax,0,QUIVER,ARROW);
+    //  Two bax buffers so that the next .bax.h5 is loaded while the current one is added
+
+    for (c = 0; c < 2; c++)
+      { initBaxData(_bax+c,0,QUIVER,ARROW);
+        setBaxChunk(_bax+c,CHUNK);
+        setBaxThreads(_bax+c,NTHREADS);
+        setBaxImage(_bax+c,IMAGE);
+        setBaxFilter(_bax+c,keepSubread,EXPR);
+        if (SP != NULL)
+          setBaxShard(_bax+c,SP->part,SP->nparts,SP->lo,SP->hi);
+      }
+    if (initAdder(&serial,bases,indx,quiva,arrow,LOSSY,EXPR,WATCH))
+      goto error;
+
+    //  With -P, a bax buffer and an adder for each concurrent part
+
+    part = NULL;
+    if (PARTS > 1)
+      { part = (Part *) Malloc(sizeof(Part)*PARTS,"Allocating parts");
+        if (part == NULL)
+          goto error;
+        for (c = 0; c < PARTS; c++)
+          { Filter *w;
+
+            initBaxData(&part[c].bax,0,QUIVER,ARROW);
+            setBaxChunk(&part[c].bax,CHUNK);
+            setBaxThreads(&part[c].bax,NTHREADS);
+            setBaxImage(&part[c].bax,IMAGE);
+            setBaxFilter(&part[c].bax,keepSubread,EXPR);
+            if (SP != NULL)
+              setBaxShard(&part[c].bax,SP->part,SP->nparts,SP->lo,SP->hi);
+            w = WATCH;
+            if (WATCH != EXPR && (w = watch_filter(EXPR)) == NULL)
+              goto error;
+            if (initAdder(&part[c].add,NULL,NULL,NULL,NULL,LOSSY,EXPR,w))
+              goto error;
+            part[c].add.boff = 0;
+            part[c].fname    = NULL;
+          }
+      }
+    pcur = prun = 0;
 
     while (next_file(ng))
-      { FILE    *file;
-        char    *path, *core;
+      { char    *path, *core;
         int      status, empty, intype;
+        Filter  *watch;
 
         if (ng->name == NULL) goto error;
 
         //  Determine file type
 
-#define IS_BAX 0
-#define IS_BAM 1
-#define IS_SAM 2
-
-        path  = PathTo(ng->name);
-        core  = Root(ng->name,".subreads.bam");
-        if ((file = fopen(Catenate(path,"/",core,".subreads.bam"),"r")) == NULL)
-          { free(core);
-            core  = Root(ng->name,".subreads.sam");
-            if ((file = fopen(Catenate(path,"/",core,".subreads.sam"),"r")) == NULL)
-              { free(core);
-                core  = Root(ng->name,".bax.h5");
-                if ((file = fopen(Catenate(path,"/",core,".bax.h5"),"r")) == NULL)
-                  { fprintf(stderr,"%s: Cannot find %s/%s with a Pacbio extension\n",
-                                   Prog_Name,path,core);
-                    goto error;
-                  }
-                intype = IS_BAX;
-              }
-            else
-              intype = IS_SAM;
+        intype = inputType(ng->name,&path,&core,&empty);
+        if (intype < 0)
+          { fprintf(stderr,"%s: Cannot find %s/%s with a Pacbio extension\n",
+                           Prog_Name,path,core);
+            goto error;
           }
-        else
-          intype = IS_BAM;
-        empty = (fgetc(file) == EOF);
-        fclose(file);
 
         if (empty)
-          { free(path);
+          { fprintf(stderr,"Skipping '%s', file is empty!\n",core);
+            free(path);
             free(core);
-            fprintf(stderr,"Skipping '%s', file is empty!\n",core);
             continue;
           }
 
@@ -481,210 +1024,124 @@ int main(int argc, char *argv[])
 
         //  Get all the data from the file
 
-#define LOWER_OFFSET 32
-#define PHRED_OFFSET 33
-
+        watch = WATCH;
         if (intype == IS_BAX)
-          { SubRead  *s;
-            QVcoding *coding = NULL;
-            int       pwell, pcnt;
-            int       i, x;
-            int64     qpos = 0;
-
-            if (VERBOSE)
-              { fprintf(stderr, "  Extracting subreads ...\n"); fflush(stderr); }
-
-            if ((status = getBaxData(bax,Catenate(path,"/",core,".bax.h5"))) != 0)
-             { fprintf(stderr, "%s: ", Prog_Name);
-                printBaxError(status);
-                goto error;
-              }
-
-            //  If QUIVER then in a first pass accumulate all the QV statistics and produce
-            //    coding tables
-
-            if (QUIVER)
-              { if (VERBOSE)
-                  { fprintf(stderr, "  Compressing streams ...\n"); fflush(stderr); }
-
-                nextSubread(bax,1);
-                QVcoding_Scan1(0,NULL,NULL,NULL,NULL,NULL);
-                while ((s = nextSubread(bax,0)) != NULL)
-                  { int   rlen;
-                    char *delQV, *delTag, *insQV, *mergeQV, *subQV;
-
-                    if ( ! evaluate_bax_filter(EXPR,bax,s))
-                      continue;
-
-                    rlen = s->lpulse - s->fpulse;
-                    delQV   = bax->delQV   + s->fpulse + s->data_off;
-                    delTag  = bax->delTag  + s->fpulse + s->data_off;
-                    insQV   = bax->insQV   + s->fpulse + s->data_off;
-                    mergeQV = bax->mergeQV + s->fpulse + s->data_off;
-                    subQV   = bax->subQV   + s->fpulse + s->data_off;
-
-                    if (isupper(delTag[0]))
-                      for (i = 0; i < rlen; i++)
-                        delTag[i] += LOWER_OFFSET;
-                    x = bax->delLimit;
-                    if (isupper(x))
-                      x += LOWER_OFFSET;
-
-                    for (i = 0; i < rlen; i++)
-                      { if (delQV[i] == x)
-                          delTag[i] = 'n';
-                        if (delQV[i] > 93)
-                          delQV[i] = 126;
-                        else
-                          delQV[i] += PHRED_OFFSET;
-                        if (insQV[i] > 93)
-                          insQV[i] = 126;
-                        else
-                          insQV[i] += PHRED_OFFSET;
-                        if (mergeQV[i] > 93)
-                          mergeQV[i] = 126;
-                        else
-                          mergeQV[i] += PHRED_OFFSET;
-                        if (subQV[i] > 93)
-                          subQV[i] = 126;
-                        else
-                          subQV[i] += PHRED_OFFSET;
+          { Adder   *a;
+            BaxData *bx;
+
+            if (PARTS > 1)
+              { Part *p;
+                int64 qbase;
+
+                //  Start the run of up to PARTS bax inputs beginning with this one if not
+                //    yet underway
+
+                if (pcur >= prun)
+                  { pcur = 0;
+                    for (prun = 0; prun < PARTS; prun++)
+                      { char *name, *npath, *ncore;
+                        int   ntype, nempty;
+
+                        name = (prun == 0 ? ng->name : peek_file(ng,prun-1));
+                        if (name == NULL)
+                          break;
+                        p = part + prun;
+                        ntype = inputType(name,&npath,&ncore,&nempty);
+                        if (ntype == IS_BAX && ! nempty)
+                          p->fname = Strdup(Catenate(npath,"/",ncore,".bax.h5"),
+                                            "Allocating file name");
+                        free(npath);
+                        free(ncore);
+                        if (ntype != IS_BAX || nempty)
+                          break;
+                        if (p->fname == NULL || openPart(p,QUIVER,ARROW))
+                          { waitParts(part,0,prun);
+                            goto error;
+                          }
+                        p->forked = (pthread_create(&p->thread,NULL,addPart,p) == 0);
                       }
-
-                    QVcoding_Scan1(rlen,delQV,delTag,insQV,mergeQV,subQV);
                   }
 
-                coding = Create_QVcoding(LOSSY);
-                if (coding == NULL)
-                  goto error;
-
-                coding->prefix = Strdup(".qvs","Allocating header prefix");
-                if (coding->prefix == NULL)
-                  goto error;
-
-                qpos = ftello(quiva);
-                Write_QVcoding(quiva,coding);
-              }
-
-            //  In the penultimate pass, read each entry and accumulate in DB
-
-            if (VERBOSE)
-              { fprintf(stderr, "  Transferring data ...\n"); fflush(stderr); }
+                //  Wait for this part and append its output to the DB
 
-            pcnt  = 0;
-            pwell = -1;
-            nextSubread(bax,1);
-            while ((s = nextSubread(bax,0)) != NULL)
-              { int    rlen, clen;
-                char  *read;
+                if (VERBOSE)
+                  { fprintf(stderr, "  Merging part ...\n"); fflush(stderr); }
 
-                if ( ! evaluate_bax_filter(EXPR,bax,s))
-                  continue;
-
-                rlen    = s->lpulse - s->fpulse;
-                read    = bax->baseCall + s->fpulse + s->data_off;
-
-                for (i = 0; i < rlen; i++)
-                  { x = Number[(int) read[i]];
-                    count[x] += 1;
-                    read[i] = x;
+                p = part + pcur++;
+                if (p->forked)
+                  waitParts(part,pcur-1,pcur);
+                else
+                  addPart(p);
+                free(p->fname);
+                p->fname = NULL;
+
+                if (p->status != 0)
+                  { fprintf(stderr, "%s: ", Prog_Name);
+                    printBaxError(p->status);
+                    waitParts(part,0,prun);
+                    goto error;
                   }
-                ureads += 1;
-                totlen += rlen;
-                if (rlen > maxlen)
-                  maxlen = rlen;
-
-                prec[pcnt].origin = s->well;
-                prec[pcnt].fpulse = s->fpulse;
-                prec[pcnt].rlen   = rlen;
-                prec[pcnt].boff   = offset;
-                prec[pcnt].flags  = s->qv;
-                prec[pcnt].coff   = -1;
-
-                Compress_Read(rlen,read);
-                clen = COMPRESSED_LEN(rlen);
-                fwrite(read,1,clen,bases);
-
-                if (QUIVER)
-                  { char  *delQV, *delTag, *insQV, *mergeQV, *subQV;
-
-                    delQV   = bax->delQV   + s->fpulse + s->data_off;
-                    delTag  = bax->delTag  + s->fpulse + s->data_off;
-                    insQV   = bax->insQV   + s->fpulse + s->data_off;
-                    mergeQV = bax->mergeQV + s->fpulse + s->data_off;
-                    subQV   = bax->subQV   + s->fpulse + s->data_off;
-
-                    prec[pcnt].coff = qpos;
-
-                    Compress_Next_QVentry1(rlen,delQV,delTag,insQV,
-                                           mergeQV,subQV,quiva,coding,LOSSY);
-                    qpos = ftello(quiva);
+                if (VERBOSE && ! p->ret)
+                  printBaxTiming(&p->bax);
+
+                qbase = (QUIVER ? ftello(quiva) : 0);
+                if (p->ret || appendPart(bases,p->add.bases) || appendPart(arrow,p->add.arrow) ||
+                              appendPart(quiva,p->add.quiva) ||
+                              appendRecords(indx,p->add.indx,offset,QUIVER,qbase))
+                  { waitParts(part,0,prun);
+                    goto error;
                   }
-                if (ARROW)
-                  { float  *snr;
-                    uint16 *raw;
-                    char   *pulse;
-                    uint16  cnr[4];
 
-                    raw   = bax->pulseW + s->fpulse + s->data_off;
-                    pulse = (char *) raw;
-
-                    for (i = 0; i < rlen; i++)
-                      pulse[i] = raw[i]-1;
+                a     = &p->add;
+                bx    = &p->bax;
+                watch = a->expr;
+              }
 
-                    snr = bax->snrVec + 4*s->zmw_off;
-                    for (i = 0; i < 4; i++)
-                      cnr[i] = (uint32) (snr[bax->chan[i]] * 100.);
-                    *((uint64  *) &(prec[pcnt].coff)) = ((uint64) cnr[0]) << 48 |
-                                                        ((uint64) cnr[1]) << 32 |
-                                                        ((uint64) cnr[2]) << 16 |
-                                                        ((uint64) cnr[3]);
+            else
+              { if (VERBOSE)
+                  { fprintf(stderr, "  Extracting subreads ...\n"); fflush(stderr); }
 
-                    Compress_Read(rlen,pulse);
-                    fwrite(pulse,1,clen,arrow);
+                if ((status = getBaxData(bax,Catenate(path,"/",core,".bax.h5"))) != 0)
+                  { fprintf(stderr, "%s: ", Prog_Name);
+                    printBaxError(status);
+                    goto error;
                   }
+                if (VERBOSE)
+                  printBaxTiming(bax);
+
+                { char *name, *npath, *ncore;
+
+                  name = peek_file(ng,0);
+                  if (name != NULL)
+                    { if (inputType(name,&npath,&ncore,&empty) == IS_BAX && ! empty)
+                        prefetchBaxData(_bax + (bax == _bax),
+                                        Catenate(npath,"/",ncore,".bax.h5"));
+                      free(npath);
+                      free(ncore);
+                    }
+                }
 
-                offset += clen;
+                serial.boff = offset;
+                if (addBax(&serial,bax,VERBOSE))
+                  goto error;
 
-                if (pwell == s->well)
-                  { prec[pcnt].flags |= DB_CSS;
-                    pcnt += 1;
-                    if (pcnt >= pmax)
-                      { pmax = ((int) (pcnt*1.2)) + 100;
-                        prec = (DAZZ_READ *) realloc(prec,sizeof(DAZZ_READ)*pmax);
-                        if (prec == NULL)
-                          { fprintf(stderr,"%s: Out of memory",Prog_Name);
-                            fprintf(stderr," (Allocating %d read records)\n",pmax);
-                            goto error;
-                          }
-                      }
-                  }
-                else if (pcnt == 0)
-                  pcnt += 1;
-                else
-                  { x = 0;
-                    for (i = 1; i < pcnt; i++)
-                      if (prec[i].rlen > prec[x].rlen)
-                        x = i;
-                    prec[x].flags |= DB_BEST;
-                    fwrite(prec,sizeof(DAZZ_READ),pcnt,indx);
-                    prec[0] = prec[pcnt];
-                    pcnt = 1;
-                  }
-                pwell = s->well;
+                a   = &serial;
+                bx  = bax;
+                bax = _bax + (bax == _bax);
               }
 
-            //  Complete processing of current file: flush last well group, write file line
-            //      in db image, and close file
+            //  Add the part's totals to those of the new reads and write the file line in
+            //    the db image
 
-            x = 0;
-            for (i = 1; i < pcnt; i++)
-              if (prec[i].rlen > prec[x].rlen)
-                x = i;
-            prec[x].flags |= DB_BEST;
-            fwrite(prec,sizeof(DAZZ_READ),pcnt,indx);
-  
-            fprintf(ostub,DB_FDATA,ureads,core,bax->movieName);
+            ureads += a->nreads;
+            totlen += a->totlen;
+            if (a->maxlen > maxlen)
+              maxlen = a->maxlen;
+            for (c = 0; c < 4; c++)
+              count[c] += a->count[c];
+            offset += a->blen;
+
+            fprintf(ostub,DB_FDATA,ureads,core,bx->movieName);
             ocells += 1;
           }
 
@@ -697,21 +1154,21 @@ int main(int argc, char *argv[])
             char      *hdr = NULL;
 
             if (intype == IS_BAM)
-              { if ((input = sam_open(Catenate(path,"/",core,".subreads.bam"))) == NULL)
+              { if ((input = sam_open(Catenate(path,"/",core,".subreads.bam"),NTHREADS)) == NULL)
                   { fprintf(stderr, "%s: can't open %s as a Bam file\n", Prog_Name, ng->name);
                     goto error;
                   }
                 fflush(stderr);
               }
             else
-              { if ((input = sam_open(Catenate(path,"/",core,".subreads.sam"))) == NULL)
+              { if ((input = sam_open(Catenate(path,"/",core,".subreads.sam"),NTHREADS)) == NULL)
                   { fprintf(stderr, "%s: can't open %s as a Sam file\n", Prog_Name, ng->name);
                     goto error;
                   }
               }
 
             status = sam_header_process(input,1);
-            if (status < 0)
+            if (status < 0 || select_bam_filter(QUIVER ? EXPR : WATCH,SP,input))
               goto error;
             else if ((status & HASPW) == 0 && ARROW)
               { fprintf(stderr, "%s: %s does not have Arrow information\n", Prog_Name, ng->name);
@@ -722,6 +1179,14 @@ int main(int argc, char *argv[])
                 goto error;
               }
 
+            //  Only decode the streams that go into the DB and the fields the filter needs
+
+            status = filter_wants(EXPR);
+            if (ARROW)
+              status |= HASPW;
+            if (QUIVER)
+              status |= HASQV;
+
             //  If QUIVER then in a first pass accumulate all the QV statistics and produce
             //    coding tables
 
@@ -736,9 +1201,6 @@ int main(int argc, char *argv[])
                     if (rec == NULL)
                       goto error;
 
-                    if ( ! evaluate_bam_filter(EXPR,rec))
-                      continue;
-
                     delQV   = rec->qv[0];
                     delTag  = rec->qv[1];
                     insQV   = rec->qv[2];
@@ -763,10 +1225,12 @@ int main(int argc, char *argv[])
 
                 sam_close(input);
                 if (intype == IS_BAM)
-                  input = sam_open(Catenate(path,"/",core,".subreads.bam"));
+                  input = sam_open(Catenate(path,"/",core,".subreads.bam"),NTHREADS);
                 else
-                  input = sam_open(Catenate(path,"/",core,".subreads.sam"));
-                sam_header_process(input,1);
+                  input = sam_open(Catenate(path,"/",core,".subreads.sam"),NTHREADS);
+                if (input == NULL || sam_header_process(input,1) < 0
+                                  || select_bam_filter(WATCH,SP,input))
+                  goto error;
               }
 
             //  In the penultimate pass, read each entry and accumulate in DB
@@ -783,9 +1247,6 @@ int main(int argc, char *argv[])
                 if (rec == NULL)
                   goto error;
 
-                if ( ! evaluate_bam_filter(EXPR,rec))
-                  continue;
-
                 rlen = rec->len;
                 read = rec->seq;
 
@@ -803,7 +1264,11 @@ int main(int argc, char *argv[])
                 prec[pcnt].flags  = (int) (1000.*rec->qual);
                 prec[pcnt].coff   = -1;
 
-                hdr = rec->header;
+                if (hdr == NULL)
+                  { hdr = Strdup(rec->header,"Allocating movie name");
+                    if (hdr == NULL)
+                      goto error;
+                  }
 
                 Compress_Read(rlen,read);
                 clen = COMPRESSED_LEN(rlen);
@@ -843,7 +1308,7 @@ int main(int argc, char *argv[])
                 offset += clen;
 
                 if (pwell == rec->well)
-                  { prec[pcnt].flags |= DB_CSS;
+                  { prec[pcnt].flags |= DB_CCS;
                     pcnt += 1;
                     if (pcnt >= pmax)
                       { pmax = ((int) (pcnt*1.2)) + 100;
@@ -881,16 +1346,44 @@ int main(int argc, char *argv[])
             fwrite(prec,sizeof(DAZZ_READ),pcnt,indx);
 
             fprintf(ostub,DB_FDATA,ureads,core,hdr);
+            free(hdr);
             ocells += 1;
 
             sam_close(input);
           }
     
+        //  Report and reset the filter statistics of the input
+
+        if (VERBOSE)
+          print_filter_stats(watch,stderr);
+        if (JFILE != NULL)
+          { fprintf(JFILE,"%s\n  ",JCOUNT++ > 0 ? "," : "");
+            json_filter_stats(watch,ng->name,JFILE);
+          }
+        reset_filter_stats(watch);
+
         free(path);
         if (VERBOSE)
           { fprintf(stderr,   "Done\n"); fflush(stdout); }
       }
 
+    freeAdder(&serial);
+    if (part != NULL)
+      { for (c = 0; c < PARTS; c++)
+          { closePart(part+c);
+            freeAdder(&part[c].add);
+            if (part[c].add.expr != EXPR)
+              free_filter(part[c].add.expr);
+            freeBaxData(&part[c].bax);
+          }
+        free(part);
+      }
+    freeBaxData(_bax);
+    freeBaxData(_bax+1);
+    if (WATCH != EXPR)
+      free_filter(WATCH);
+    free_filter(EXPR);
+
     //  Finished loading all sequences: update relevant fields in db record
 
     db.ureads = ureads;
@@ -1016,12 +1509,21 @@ int main(int argc, char *argv[])
 
   rename(Catenate(pwd,"/",root,".dbx"),dbname);   //  New image replaces old image
 
+  if (JFILE != NULL)
+    { fprintf(JFILE," ] }\n");
+      fclose(JFILE);
+    }
+
   exit (0);
 
   //  Error exit:  Either truncate or remove the .idx and .bps files as appropriate.
-  //               Remove the new image file <pwd>/<root>.dbx
+  //               Remove the new image file <pwd>/<root>.dbx and the incomplete JSON statistics
 
 error:
+  if (JFILE != NULL)
+    { fclose(JFILE);
+      unlink(JSON);
+    }
   if (ioff != 0)
     { fseeko(indx,0,SEEK_SET);
       if (ftruncate(fileno(indx),ioff) < 0)
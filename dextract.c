@@ -12,195 +12,409 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include "DB.h"
 #include "sam.h"
 #include "bax.h"
 #include "expr.h"
+#include "batch.h"
 
-#define LOWER_OFFSET 32
-#define PHRED_OFFSET 33
+#define BATCH_SIZE 1000   //  # of subreads extracted and written at a time
 
-static char *Usage = "[-vfaq] [-o[<path>]] [-e<expr(ln>=500 && rq>=750)> <input:pacbio> ...";
+static char *Usage[] =
+         { "[-vfaqi] [-T<int(4)>] [-B<int(4)>] [-m<int>] [-P<int(1)>] [-s<shard:i/n|lo-hi>]",
+           "  [-o[<path>]] [-J<path>] [-e<expr(ln>=500 && rq>=750)>] <input:pacbio> ..."
+         };
 
-  //  Write subreads s from bax data set b to non-NULL file types
+#define IS_BAX 0
+#define IS_BAM 1
+#define IS_SAM 2
 
-static void writeSubread(BaxData *b, SubRead *s, FILE *fas, FILE *arr, FILE* qvs)
-{ int ibeg, iend, roff, len;
+  //  Determine the type of PacBio input arg, setting *path and *core to its directory and
+  //    root name: -1 => there is no such file with a PacBio extension
+
+static int inputType(char *arg, char **path, char **core)
+{ FILE *file;
+  int   type;
+
+  *path = PathTo(arg);
+  *core = Root(arg,".subreads.bam");
+  type  = IS_BAM;
+  if ((file = fopen(Catenate(*path,"/",*core,".subreads.bam"),"r")) == NULL)
+    { free(*core);
+      *core = Root(arg,".subreads.sam");
+      type  = IS_SAM;
+      if ((file = fopen(Catenate(*path,"/",*core,".subreads.sam"),"r")) == NULL)
+        { free(*core);
+          *core = Root(arg,".bax.h5");
+          type  = IS_BAX;
+          if ((file = fopen(Catenate(*path,"/",*core,".bax.h5"),"r")) == NULL)
+            return (-1);
+        }
+    }
+  fclose(file);
+  return (type);
+}
+
+  //  Write the subreads of batch b to non-NULL file types.  The subreads of a .bax.h5 have
+  //    always had an '@' starting their .quiva header, and an empty line after an .arrow
+  //    stream whose length is a multiple of 80.
 
-  ibeg = s->fpulse;
-  iend = s->lpulse;
-  roff = s->data_off + ibeg;
-  len  = iend - ibeg;
+static void writeBatch(Batch *b, FILE *fas, FILE *arr, FILE *qvs)
+{ int   i, j, len;
+  char *name, *seq;
 
-  if (arr != NULL)  //  .arrow
-    { int     a;
-      uint16 *pulse;
-      float  *snr;
+  for (j = 0; j < b->nrec; j++)
+    { name = b->names + b->hoff[j];
+      len  = b->len[j];
 
-      pulse = b->pulseW + roff;
-      snr   = b->snrVec + 4*s->zmw_off;
+      if (fas != NULL)
+        { seq = b->seq + b->soff[j];
+          fprintf(fas,">%s/%d/%d_%d RQ=0.%d\n",name,b->well[j],b->beg[j],b->end[j],b->rq[j]);
+          for (i = 0; i < len; i += 80)
+            if (i+80 <= len)
+              fprintf(fas,"%.80s\n",seq+i);
+            else
+              fprintf(fas,"%.*s\n",len-i,seq+i);
+        }
 
-      fprintf(arr,">%s SN=%.2f",b->movieName,snr[b->chan[0]]);
-      for (a = 1; a < 4; a++)
-        fprintf(arr,",%.2f",snr[b->chan[a]]);
-      fprintf(arr,"\n");
+      if (arr != NULL)
+        { float *snr = b->snr + 4*j;
 
-      for (a = 0; a < len; a++)
-        { if (pulse[a] >= 4)
-            fputc('4',arr);
-          else
-            fputc(pulse[a]+'0',arr);
-          if (a % 80 == 79)
+          seq = b->arr + b->soff[j];
+          fprintf(arr,">%s SN=%.2f,%.2f,%.2f,%.2f\n",name,snr[0],snr[1],snr[2],snr[3]);
+          for (i = 0; i < len; i += 80)
+            if (i+80 <= len)
+              fprintf(arr,"%.80s\n",seq+i);
+            else
+              fprintf(arr,"%.*s\n",len-i,seq+i);
+          if (b->isbax && len % 80 == 0)
             fputc('\n',arr);
         }
-      if (a % 80 != 80)
-        fputc('\n',arr);
+
+      if (qvs != NULL)
+        { int64 o = b->soff[j];
+
+          fprintf(qvs,"%c%s/%d/%d_%d RQ=0.%d\n",b->isbax ? '@' : '>',
+                      name,b->well[j],b->beg[j],b->end[j],b->rq[j]);
+          for (i = 0; i < 5; i++)
+            fprintf(qvs,"%.*s\n",len,b->qv[i]+o);
+        }
     }
+}
 
-  if (fas != NULL)   //   .fasta
-    { int   a;
-      char *baseCall;
+  //  Filter callback with which a bax loader (possibly a prefetch thread) reads only the base
+  //    streams of the subreads that pass.  A parsed filter may be evaluated by any number of
+  //    threads at once, so concurrent parts and loaders share EXPR.
+
+static int keepSubread(void *arg, BaxData *b, SubRead *s)
+{ return (evaluate_bax_filter((Filter *) arg,b,s)); }
+
+  //  Write the subreads of b that pass filter e from its subread table.  The passing
+  //    subreads are cut into runs of BATCH_SIZE, and run j is formatted into bt[j%nthr].
+  //    nthr-1 threads started for the window and the calling thread claim the runs in
+  //    order, at most nthr ahead of the last one written, and the caller writes them in
+  //    order as they complete: 0 => OK, 1 => error (message sent)
+
+typedef struct
+  { BaxData        *bax;
+    int            *idx;     //  table indices of the subreads to write
+    int             m;
+    int             nrun;    //  # of runs of idx
+    Batch         **bt;
+    int             nthr;
+    int            *done;    //  done[t] = j+1 => run j is formatted in bt[t]
+    int             next;    //  next run to format
+    int             nwrit;   //  # of runs written
+    int             error;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;    //  a run is formatted or written
+  } Formatter;
+
+  //  Claim the next run if its batch is free, -1 if not (called holding f->lock)
+
+static int claim_run(Formatter *f)
+{ if (f->error || f->next >= f->nrun || f->next >= f->nwrit + f->nthr)
+    return (-1);
+  return (f->next++);
+}
 
-      baseCall = b->baseCall + roff;
+  //  Format run j into its batch (called without f->lock, returns holding it)
 
-      fprintf(fas,">%s/%d/%d_%d RQ=0.%0d\n",b->movieName,s->well,ibeg,iend,s->qv);
+static void format_run(Formatter *f, int j)
+{ int r, ret;
 
-      if (isupper(baseCall[0]))
-        for (a = 0; a < len; a++)
-          baseCall[a] += LOWER_OFFSET;
+  r = f->m - j*BATCH_SIZE;
+  if (r > BATCH_SIZE)
+    r = BATCH_SIZE;
+  ret = bax_batch_table(f->bax,f->idx + j*BATCH_SIZE,r,f->bt[j%f->nthr]);
 
-      for (a = 0; a < len; a += 80)
-        if (a+80 > len)
-          fprintf(fas,"%.*s\n", len-a, baseCall + a);
-        else
-          fprintf(fas,"%.80s\n", baseCall + a);
-    }
+  pthread_mutex_lock(&f->lock);
+  if (ret < 0)
+    f->error = 1;
+  f->done[j%f->nthr] = j+1;
+  pthread_cond_broadcast(&f->cond);
+}
+
+static void *format_runs(void *arg)
+{ Formatter *f = (Formatter *) arg;
+  int        j;
 
-  if (qvs != NULL)    //   .quiva
-    { int   a, d;
-      char *delQV, *delTag, *insQV, *mergeQV, *subQV;
-
-      delQV   = b->delQV + roff;
-      delTag  = b->delTag + roff;
-      insQV   = b->insQV + roff;
-      mergeQV = b->mergeQV + roff;
-      subQV   = b->subQV + roff;
-
-      fprintf(qvs,"@%s/%d/%d_%d RQ=0.%0d\n",b->movieName,s->well,ibeg,iend,s->qv);
-
-      if (isupper(delTag[0]))
-        for (a = 0; a < len; a++)
-          delTag[a] += LOWER_OFFSET;
-      d = b->delLimit;
-      if (isupper(d))
-        d += LOWER_OFFSET;
-
-      for (a = 0; a < len; a++)
-        { if (delQV[a] == d)
-            delTag[a] = 'n';
-          if (delQV[a] > 93)
-            delQV[a] = 126;
-          else
-            delQV[a] += PHRED_OFFSET;
-          if (insQV[a] > 93)
-            insQV[a] = 126;
-          else
-            insQV[a] += PHRED_OFFSET;
-          if (mergeQV[a] > 93)
-            mergeQV[a] = 126;
-          else
-            mergeQV[a] += PHRED_OFFSET;
-          if (subQV[a] > 93)
-            subQV[a] = 126;
-          else
-            subQV[a] += PHRED_OFFSET;
+  pthread_mutex_lock(&f->lock);
+  while ( ! f->error && f->next < f->nrun)
+    { if ((j = claim_run(f)) < 0)
+        pthread_cond_wait(&f->cond,&f->lock);
+      else
+        { pthread_mutex_unlock(&f->lock);
+          format_run(f,j);
         }
+    }
+  pthread_mutex_unlock(&f->lock);
+  return (NULL);
+}
 
-      fprintf (qvs, "%.*s\n", len, delQV);
-      fprintf (qvs, "%.*s\n", len, delTag);
-      fprintf (qvs, "%.*s\n", len, insQV);
-      fprintf (qvs, "%.*s\n", len, mergeQV);
-      fprintf (qvs, "%.*s\n", len, subQV);
+static int writeBaxTable(BaxData *b, Filter *e, Batch **bt, int nthr,
+                         FILE *fas, FILE *arr, FILE *qvs)
+{ Formatter f;
+  pthread_t thread[nthr];
+  int       done[nthr];
+  int      *idx, n, m;
+  uint64   *sel, w;
+  int       i, j, t, nwork;
+
+  n = makeSubreadTable(b);
+  if (n < 0)
+    return (1);
+  sel = (uint64 *) Malloc(sizeof(uint64)*(n/64+1) + sizeof(int)*(n+1),
+                         "Allocating subread index");
+  if (sel == NULL)
+    return (1);
+  idx = (int *) (sel + (n/64+1));
+
+  evaluate_bax_batch(e,b->table,n,sel);
+
+  m = 0;
+  for (i = 0; i < n; i += 64)
+    for (w = sel[i>>6]; w != 0; w &= w-1)
+      idx[m++] = i + __builtin_ctzll(w);
+
+  f.bax   = b;
+  f.idx   = idx;
+  f.m     = m;
+  f.nrun  = (m + BATCH_SIZE-1) / BATCH_SIZE;
+  f.bt    = bt;
+  f.nthr  = nthr;
+  f.done  = done;
+  f.next  = 0;
+  f.nwrit = 0;
+  f.error = 0;
+  for (t = 0; t < nthr; t++)
+    done[t] = 0;
+  pthread_mutex_init(&f.lock,NULL);
+  pthread_cond_init(&f.cond,NULL);
+
+  for (nwork = 0; nwork < nthr-1 && nwork < f.nrun-1; nwork++)
+    if (pthread_create(thread+nwork,NULL,format_runs,&f) != 0)
+      break;
+
+  pthread_mutex_lock(&f.lock);
+  while ( ! f.error && f.nwrit < f.nrun)
+    { t = f.nwrit % nthr;
+      if (done[t] == f.nwrit+1)
+        { pthread_mutex_unlock(&f.lock);
+          writeBatch(bt[t],fas,arr,qvs);
+          pthread_mutex_lock(&f.lock);
+          f.nwrit += 1;
+          pthread_cond_broadcast(&f.cond);
+        }
+      else if ((j = claim_run(&f)) >= 0)
+        { pthread_mutex_unlock(&f.lock);
+          format_run(&f,j);
+        }
+      else
+        pthread_cond_wait(&f.cond,&f.lock);
     }
+  pthread_cond_broadcast(&f.cond);
+  pthread_mutex_unlock(&f.lock);
+
+  for (t = 0; t < nwork; t++)
+    pthread_join(thread[t],NULL);
+  pthread_cond_destroy(&f.cond);
+  pthread_mutex_destroy(&f.lock);
+
+  free(sel);
+  return (f.error);
 }
 
-  //  Write subread data in samRecord rec to non-NULL file types
+  //  Write the subreads of loaded bax b that pass filter e: 0 => OK, 1 => error (message sent).
+  //    A fully loaded window is tabled and formatted in parallel, a streamed one (-m) is
+  //    iterated chunk by chunk.
 
-static void writeSamRecord(samRecord *rec, FILE *fas, FILE *arr, FILE* qvs)
-{ int i;
+static int extractBax(BaxData *b, Filter *e, Batch **bt, int nthr,
+                      FILE *fas, FILE *arr, FILE *qvs)
+{ SubreadIter iter;
+  int         n;
 
-  if (fas != NULL)
-    { fprintf(fas,">%s/%d/%d_%d RQ=0.%d\n",rec->header,rec->well,rec->beg,
-                                               rec->end,(int) (rec->qual*1000.));
-      for (i = 0; i < rec->len; i += 80)
-        if (i+80 <= rec->len)
-          fprintf(fas,"%.80s\n",rec->seq+i);
-        else
-          fprintf(fas,"%.*s\n",rec->len-i,rec->seq+i);
-    }
+  if (b->file_id < 0)
+    return (writeBaxTable(b,e,bt,nthr,fas,arr,qvs));
 
-  if (arr != NULL)
-    { fprintf(arr,">%s SN=%.2f,%.2f,%.2f,%.2f\n",rec->header,
-                      rec->snr[0],rec->snr[1],rec->snr[2],rec->snr[3]);
-      for (i = 0; i < rec->len; i += 80)
-        if (i+80 <= rec->len)
-          fprintf(arr,"%.80s\n",rec->arr+i);
-        else
-          fprintf(arr,"%.*s\n",rec->len-i,rec->arr+i);
+  initSubreadIter(&iter,b,b->zbeg,b->zend);
+  do
+    { n = bax_batch_extract(&iter,e,bt[0]);
+      if (n < 0)
+        return (1);
+      writeBatch(bt[0],fas,arr,qvs);
     }
+  while (n == BATCH_SIZE);
+  return (0);
+}
+
+  //  With -P, a run of consecutive .bax.h5 inputs (e.g. the 3 parts of an RS II movie) are
+  //    loaded and extracted concurrently, each part into temporary files that are then
+  //    appended to the outputs in input order.
+
+typedef struct
+  { BaxData   bax;       //  this part's bax buffer
+    Batch   **batch;     //  and nthr batches
+    int       nthr;
+    Filter   *expr;
+    char     *fname;     //  .bax.h5 file to extract
+    FILE     *out[3];    //  temporary .fasta, .arrow, and .quiva output (if wanted)
+    int       status;    //  getBaxData status
+    int       ret;       //  0 => OK, 1 => error
+    int       forked;    //  part is being extracted by thread
+    pthread_t thread;
+  } Part;
+
+static void *extractPart(void *arg)
+{ Part *p = (Part *) arg;
+
+  p->status = getBaxData(&p->bax,p->fname);
+  if (p->status != 0)
+    p->ret = 1;
+  else
+    p->ret = extractBax(&p->bax,p->expr,p->batch,p->nthr,p->out[0],p->out[1],p->out[2]);
+  return (NULL);
+}
 
-  if (qvs != NULL)
-    { fprintf(qvs,">%s/%d/%d_%d RQ=0.%d\n",rec->header,rec->well,rec->beg,
-                                               rec->end,(int) (rec->qual*1000.));
-      fprintf(qvs,"%.*s\n",rec->len,rec->qv[0]);
-      fprintf(qvs,"%.*s\n",rec->len,rec->qv[1]);
-      fprintf(qvs,"%.*s\n",rec->len,rec->qv[2]);
-      fprintf(qvs,"%.*s\n",rec->len,rec->qv[3]);
-      fprintf(qvs,"%.*s\n",rec->len,rec->qv[4]);
+  //  Wait for the parts [beg,end) of a run that are still underway, so that no part is
+  //    left inside the HDF5 library when exiting on an error
+
+static void waitParts(Part *part, int beg, int end)
+{ for ( ; beg < end; beg++)
+    if (part[beg].forked)
+      { pthread_join(part[beg].thread,NULL);
+        part[beg].forked = 0;
+      }
+}
+
+  //  Append the contents of temporary file src to dst and close src: 0 => OK, 1 => error
+
+static int appendPart(FILE *dst, FILE *src)
+{ char   buf[0x10000];
+  size_t n;
+
+  if (src == NULL)
+    return (0);
+  rewind(src);
+  while ((n = fread(buf,1,sizeof(buf),src)) > 0)
+    if (fwrite(buf,1,n,dst) != n)
+      { fprintf(stderr,"%s: Could not write output\n",Prog_Name);
+        fclose(src);
+        return (1);
+      }
+  if (ferror(src))
+    { fprintf(stderr,"%s: Could not read back temporary part output\n",Prog_Name);
+      fclose(src);
+      return (1);
     }
+  fclose(src);
+  return (0);
 }
 
   //  Main
 
 int main(int argc, char* argv[])
 { char *output;
+  char *oroot;
   char *path, *core;
   FILE *fileFas;
   FILE *fileArr;
   FILE *fileQvs;
+  FILE *fileJson;
 
   int     ARROW;
   int     QUIVA;
   int     FASTA;
   int     VERBOSE;
-  Filter *EXPR;
+  int     NTHREADS;
+  int     BUFFER;
+  int     CHUNK;
+  int     PARTS;
+  int     IMAGE;
+  Filter *EXPR, *WATCH;
+  char   *JSON;
+  Shard   SHARD, *SP;
 
   //  Process command line arguments
 
   { int   i, j, k;
     int   flags[128];
+    char *eptr;
 
     ARG_INIT("dextract")
 
-    path   = NULL;
-    core   = NULL;
-    output = NULL;
-    EXPR   = NULL;
+    path     = NULL;
+    core     = NULL;
+    output   = NULL;
+    oroot    = NULL;
+    EXPR     = NULL;
+    JSON     = NULL;
+    NTHREADS = 4;
+    BUFFER   = 4;
+    CHUNK    = 0;
+    PARTS    = 1;
+    SP       = NULL;
 
     j = 1;
     for (i = 1; i < argc; i++)
       if (argv[i][0] == '-')
         switch (argv[i][1])
         { default:
-            ARG_FLAGS("vfaq")
+            ARG_FLAGS("vfaqi")
             break;
           case 'o':
             output = argv[i]+2;
             break;
+          case 'J':
+            JSON = argv[i]+2;
+            break;
+          case 'T':
+            ARG_POSITIVE(NTHREADS,"Number of threads")
+            break;
+          case 'B':
+            ARG_POSITIVE(BUFFER,"Read-ahead buffer size (MB)")
+            if (BUFFER > 1024)
+              { fprintf(stderr,"%s: Read-ahead buffer size (MB) must be <= 1024\n",Prog_Name);
+                exit (1);
+              }
+            break;
           case 'e':
             EXPR = parse_filter(argv[i]+2);
             break;
+          case 'm':
+            ARG_POSITIVE(CHUNK,"Bax chunk size (MB)")
+            break;
+          case 'P':
+            ARG_POSITIVE(PARTS,"Number of concurrent bax parts")
+            break;
+          case 's':
+            if (parse_shard(argv[i]+2,&SHARD))
+              exit (1);
+            SP = &SHARD;
+            break;
         }
       else
         argv[j++] = argv[i];
@@ -210,23 +424,42 @@ int main(int argc, char* argv[])
     ARROW   = flags['a'];
     QUIVA   = flags['q'];
     FASTA   = flags['f'];
+    IMAGE   = flags['i'];
     if ( ! (ARROW || FASTA || QUIVA))
       FASTA = 1;
 
+    sam_set_buffer(BUFFER);
+
     if (EXPR == NULL)
       EXPR = parse_filter("ln>=500 && rq>=750");
 
     if (argc == 1)
-      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage);
+      { fprintf(stderr,"Usage: %s %s\n",Prog_Name,Usage[0]);
+        fprintf(stderr,"       %*s %s\n",(int) strlen(Prog_Name),"",Usage[1]);
         fprintf(stderr,"\n");
         fprintf(stderr,"      -f: extract a .fasta file with Pacbio-style line headers.\n");
         fprintf(stderr,"      -a: extract a .arrow file with SNR encoded in line headers.\n");
         fprintf(stderr,"      -q: extract a .quiva file with Pacbio-style line headers.\n");
         fprintf(stderr,"\n");
-        fprintf(stderr,"      -o: If absent, output files use root name of input .bax or .bam.\n");
+        fprintf(stderr,"      -i: Read each .bax.h5 whole into memory with one sequential read.\n");
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -T: Number of threads used to decompress .bam input and to inflate\n");
+        fprintf(stderr,"        : the base streams of .bax.h5 input.\n");
+        fprintf(stderr,"      -P: Load and extract up to this many consecutive .bax.h5 inputs\n");
+        fprintf(stderr,"        : concurrently, e.g. -P3 for the 3 parts of an RS II movie.\n");
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -s: Only extract the i'th of n equal slices of the wells of each input,\n");
+        fprintf(stderr,"        : or the wells with hole numbers in [lo,hi].  A slice of a .bam\n");
+        fprintf(stderr,"        : requires its .pbi index.\n");
+        fprintf(stderr,"\n");
+        fprintf(stderr,"      -o: If absent, output files use root name of input .bax or .bam,\n");
+        fprintf(stderr,"        : followed by .<i>of<n> or .<lo>-<hi> if -s is set.\n");
         fprintf(stderr,"        : If no path given, output sent to standard output.\n");
         fprintf(stderr,"        : If path given, output files use path name as root name.\n");
         fprintf(stderr,"\n");
+        fprintf(stderr,"      -v: Report progress and per file filter statistics and timing.\n");
+        fprintf(stderr,"      -J: Write the per file filter statistics to path as JSON.\n");
+        fprintf(stderr,"\n");
         fprintf(stderr,"      -e: subread selection expression.  Possible variables are:\n");
         fprintf(stderr,"           zm  - well number\n");
         fprintf(stderr,"           ln  - length of subread\n");
@@ -240,6 +473,24 @@ int main(int argc, char* argv[])
       }
   }
 
+  //  With -v or -J, filtering is done through watched handles on EXPR that count what each
+  //    input's records do, while the bax loaders' pre-tests stay on the plain EXPR
+
+  WATCH = EXPR;
+  if (VERBOSE || JSON != NULL)
+    { WATCH = watch_filter(EXPR);
+      if (WATCH == NULL)
+        exit (1);
+    }
+
+  fileJson = NULL;
+  if (JSON != NULL)
+    { fileJson = Fopen(JSON,"w");
+      if (fileJson == NULL)
+        exit (1);
+      fprintf(fileJson,"{ \"program\": \"dextract\", \"inputs\": [");
+    }
+
   //  If -o set then set up output file streams
 
   fileFas = NULL;
@@ -249,6 +500,9 @@ int main(int argc, char* argv[])
     { if (*output != '\0')
         { path   = PathTo(output);
           output = Root(output,NULL);
+          oroot  = Strdup(Catenate(path,"/",output,""),"Allocating output name");
+          if (oroot == NULL)
+            goto error;
 
           if (FASTA)
             { fileFas = Fopen(Catenate(path,"/",output,".fasta"), "w");
@@ -266,6 +520,7 @@ int main(int argc, char* argv[])
                 goto error;
             }
           free(path);
+          path = NULL;
         }
       else
         { if (ARROW + FASTA + QUIVA > 1)
@@ -284,57 +539,113 @@ int main(int argc, char* argv[])
  
   //  Process each input file
 
-  { int      i;
-    BaxData  b, *bp = &b;
+  { int      i, k;
+    BaxData  b[2], *bp;
     samFile *in;
+    Batch  **batch;
+    Part    *part;
+    int      pbeg, pend;
+
+    //  Two bax buffers so that the next .bax.h5 is loaded while the current one is written
+
+    for (k = 0; k < 2; k++)
+      { initBaxData(b+k,0,QUIVA,ARROW);
+        setBaxChunk(b+k,CHUNK);
+        setBaxThreads(b+k,NTHREADS);
+        setBaxImage(b+k,IMAGE);
+        setBaxFilter(b+k,keepSubread,EXPR);
+        if (SP != NULL)
+          setBaxShard(b+k,SP->part,SP->nparts,SP->lo,SP->hi);
+      }
+    bp = b;
+
+    //  One batch per thread for formatting a bax subread table in parallel
 
-    initBaxData(bp,0,QUIVA,ARROW);
+    batch = (Batch **) Malloc(sizeof(Batch *)*NTHREADS,"Allocating batches");
+    if (batch == NULL)
+      goto error;
+    for (k = 0; k < NTHREADS; k++)
+      { batch[k] = new_batch(BATCH_SIZE,(ARROW ? HASPW : 0) | (QUIVA ? HASQV : 0));
+        if (batch[k] == NULL)
+          goto error;
+      }
+
+    //  With -P, a bax buffer and batches for each concurrent part
+
+    part = NULL;
+    if (PARTS > 1)
+      { part = (Part *) Malloc(sizeof(Part)*PARTS,"Allocating parts");
+        if (part == NULL)
+          goto error;
+        for (k = 0; k < PARTS; k++)
+          { int t;
+
+            initBaxData(&part[k].bax,0,QUIVA,ARROW);
+            setBaxChunk(&part[k].bax,CHUNK);
+            setBaxThreads(&part[k].bax,NTHREADS);
+            setBaxImage(&part[k].bax,IMAGE);
+            setBaxFilter(&part[k].bax,keepSubread,EXPR);
+            if (SP != NULL)
+              setBaxShard(&part[k].bax,SP->part,SP->nparts,SP->lo,SP->hi);
+            part[k].nthr  = NTHREADS;
+            part[k].expr  = WATCH;
+            if (WATCH != EXPR && (part[k].expr = watch_filter(EXPR)) == NULL)
+              goto error;
+            part[k].fname = NULL;
+            part[k].batch = (Batch **) Malloc(sizeof(Batch *)*NTHREADS,"Allocating batches");
+            if (part[k].batch == NULL)
+              goto error;
+            for (t = 0; t < NTHREADS; t++)
+              { part[k].batch[t] = new_batch(BATCH_SIZE,(ARROW ? HASPW : 0) |
+                                                        (QUIVA ? HASQV : 0));
+                if (part[k].batch[t] == NULL)
+                  goto error;
+              }
+          }
+      }
+    pbeg = pend = 1;
 
     for (i = 1; i < argc; i++)
-      { FILE *file;
-        int   status, intype;
+      { int     status, intype;
+        Filter *watch;
 
         //  Determine file type
 
-#define IS_BAX 0
-#define IS_BAM 1
-#define IS_SAM 2
-
-        path  = PathTo(argv[i]);
-        core  = Root(argv[i],".subreads.bam");
-        if ((file = fopen(Catenate(path,"/",core,".subreads.bam"),"r")) == NULL)
-          { core  = Root(argv[i],".subreads.sam");
-            if ((file = fopen(Catenate(path,"/",core,".subreads.sam"),"r")) == NULL)
-              { core  = Root(argv[i],".bax.h5");
-                if ((file = fopen(Catenate(path,"/",core,".bax.h5"),"r")) == NULL)
-                  { fprintf(stderr,"%s: Cannot find %s/%s with a Pacbio extension\n",
-                                   Prog_Name,path,core);
-                    goto error;
-                  }
-                intype = IS_BAX;
-              }
-            else
-              intype = IS_SAM;
+        intype = inputType(argv[i],&path,&core);
+        if (intype < 0)
+          { fprintf(stderr,"%s: Cannot find %s/%s with a Pacbio extension\n",
+                           Prog_Name,path,core);
+            goto error;
           }
-        else
-          intype = IS_BAM;
-        fclose(file);
 
-        //  If -o not set then setup output file streams for this input
+        //  If -o not set then setup output file streams for this input, distinguishing the
+        //    outputs of different shards
 
         if (output == NULL)
-          { if (FASTA)
-              { fileFas = Fopen(Catenate(path,"/",core,".fasta"), "w");
+          { char sfx[50];
+
+            if (SP == NULL)
+              sfx[0] = '\0';
+            else if (SP->nparts > 0)
+              sprintf(sfx,".%dof%d",SP->part,SP->nparts);
+            else
+              sprintf(sfx,".%d-%d",SP->lo,SP->hi);
+            oroot = Strdup(Catenate(path,"/",core,sfx),"Allocating output name");
+            if (oroot == NULL)
+              goto error;
+
+            if (FASTA)
+              { fileFas = Fopen(Catenate(oroot,"",".fasta",""), "w");
                 if (fileFas == NULL)
                   goto error;
               }
             if (ARROW)
-              { fileArr = Fopen(Catenate(path,"/",core,".arrow"), "w");
+              { fileArr = Fopen(Catenate(oroot,"",".arrow",""), "w");
                 if (fileArr == NULL)
                   goto error;
               }
             if (QUIVA)
-              { fileQvs = Fopen(Catenate(path,"/",core,".quiva"), "w");
+              { fileQvs = Fopen(Catenate(oroot,"",".quiva",""), "w");
                 if (fileQvs == NULL)
                   goto error;
               }
@@ -342,10 +653,76 @@ int main(int argc, char* argv[])
 
         //  Extract from a .bax.h5
 
-        if (intype == IS_BAX)
-          { SubRead *s;
+        if (intype == IS_BAX && PARTS > 1)
+          { Part *p;
+
+            //  Start the run of up to PARTS bax inputs beginning with this one if not yet
+            //    underway
+
+            if (i >= pend)
+              { pbeg = i;
+                for (pend = i; pend < argc && pend < i+PARTS; pend++)
+                  { char *npath, *ncore;
+                    int   ntype;
+
+                    p = part + (pend-i);
+                    ntype = inputType(argv[pend],&npath,&ncore);
+                    if (ntype == IS_BAX)
+                      p->fname = Strdup(Catenate(npath,"/",ncore,".bax.h5"),
+                                        "Allocating file name");
+                    free(npath);
+                    free(ncore);
+                    if (ntype != IS_BAX)
+                      break;
+                    if (p->fname == NULL)
+                      { waitParts(part,0,pend-i);
+                        goto error;
+                      }
+
+                    p->out[0] = p->out[1] = p->out[2] = NULL;
+                    if ((FASTA && (p->out[0] = tmpfile()) == NULL) ||
+                        (ARROW && (p->out[1] = tmpfile()) == NULL) ||
+                        (QUIVA && (p->out[2] = tmpfile()) == NULL))
+                      { fprintf(stderr,"%s: Cannot create temporary output for %s\n",
+                                       Prog_Name,p->fname);
+                        waitParts(part,0,pend-i);
+                        goto error;
+                      }
+                    p->forked = (pthread_create(&p->thread,NULL,extractPart,p) == 0);
+                  }
+              }
+
+            //  Wait for this part and append its output
 
             if (VERBOSE)
+              { fprintf(stderr, "Merging part : %s ...\n", core); fflush(stderr); }
+
+            p = part + (i-pbeg);
+            watch = p->expr;
+            if (p->forked)
+              waitParts(part,i-pbeg,i-pbeg+1);
+            else
+              extractPart(p);
+            free(p->fname);
+            p->fname = NULL;
+
+            if (p->status != 0)
+              { fprintf(stderr, "%s: ", Prog_Name);
+                printBaxError(p->status);
+                waitParts(part,0,pend-pbeg);
+                goto error;
+              }
+            if (VERBOSE && ! p->ret)
+              printBaxTiming(&p->bax);
+            if (p->ret || appendPart(fileFas,p->out[0]) || appendPart(fileArr,p->out[1]) ||
+                          appendPart(fileQvs,p->out[2]))
+              { waitParts(part,0,pend-pbeg);
+                goto error;
+              }
+          }
+
+        else if (intype == IS_BAX)
+          { if (VERBOSE)
               { fprintf(stderr, "Fetching file : %s ...\n", core); fflush(stderr); }
 
             if ((status = getBaxData(bp,Catenate(path,"/",core,".bax.h5"))) != 0)
@@ -354,20 +731,26 @@ int main(int argc, char* argv[])
                 goto error;
               }
 
-            if (VERBOSE)
-              { fprintf(stderr, "Extracting subreads ...\n"); fflush(stderr); }
-
-            nextSubread(bp,1);
-            while (1)
-              { s = nextSubread(bp,0);
-                if (s == NULL)
-                  break;
+            if (i+1 < argc)
+              { char *npath, *ncore;
 
-                if ( ! evaluate_bax_filter(EXPR,bp,s))
-                  continue;
+                if (inputType(argv[i+1],&npath,&ncore) == IS_BAX)
+                  prefetchBaxData(b + (bp == b),Catenate(npath,"/",ncore,".bax.h5"));
+                free(npath);
+                free(ncore);
+              }
 
-                writeSubread(&b,s,fileFas,fileArr,fileQvs);
+            if (VERBOSE)
+              { printBaxTiming(bp);
+                fprintf(stderr, "Extracting subreads ...\n");
+                fflush(stderr);
               }
+
+            watch = WATCH;
+            if (extractBax(bp,WATCH,batch,NTHREADS,fileFas,fileArr,fileQvs))
+              goto error;
+
+            bp = b + (bp == b);
           }
 
         //  Extract from a .bam or .sam
@@ -377,20 +760,21 @@ int main(int argc, char* argv[])
               { fprintf(stderr, "Processing file : %s ...\n", core); fflush(stderr); }
 
             if (intype == IS_BAM)
-              { if ((in = sam_open(Catenate(path,"/",core,".subreads.bam"))) == NULL)
+              { if ((in = sam_open(Catenate(path,"/",core,".subreads.bam"),NTHREADS)) == NULL)
                   { fprintf(stderr, "%s: can't open %s as a Bam file\n", Prog_Name, argv[i]);
                     goto error;
                   }
               }
             else
-              { if ((in = sam_open(Catenate(path,"/",core,".subreads.sam"))) == NULL)
+              { if ((in = sam_open(Catenate(path,"/",core,".subreads.sam"),NTHREADS)) == NULL)
                   { fprintf(stderr, "%s: can't open %s as a Sam file\n", Prog_Name, argv[i]);
                     goto error;
                   }
               }
 
+            watch  = WATCH;
             status = sam_header_process(in,0);
-            if (status < 0)
+            if (status < 0 || select_bam_filter(WATCH,SP,in))
               goto error;
             else if ((status & HASPW) == 0 && ARROW)
               { fprintf(stderr, "%s: %s does not have Arrow information\n", Prog_Name, argv[i]);
@@ -401,20 +785,15 @@ int main(int argc, char* argv[])
                 goto error;
               }
             else
-              { samRecord *rec;
-  
-                while (1)
-                  { rec = sam_record_extract(in, status);
-                    if (rec == NULL)
-                      goto error;
-                    if (rec == SAM_EOF)
-                      break;
+              { int n;
 
-                    if ( ! evaluate_bam_filter(EXPR,rec))
-                      continue;
-
-                    writeSamRecord(rec,fileFas,fileArr,fileQvs);
+                do
+                  { n = sam_batch_extract(in,WATCH,batch[0]);
+                    if (n < 0)
+                      goto error;
+                    writeBatch(batch[0],fileFas,fileArr,fileQvs);
                   }
+                while (n == BATCH_SIZE);
               }
 
             if (sam_close(in))
@@ -435,7 +814,19 @@ int main(int argc, char* argv[])
             fileFas = NULL;
             fileQvs = NULL;
             fileArr = NULL;
+            free(oroot);
+            oroot = NULL;
+          }
+
+        //  Report and reset the filter statistics of the input
+
+        if (VERBOSE)
+          print_filter_stats(watch,stderr);
+        if (fileJson != NULL)
+          { fprintf(fileJson,"%s\n  ",i > 1 ? "," : "");
+            json_filter_stats(watch,argv[i],fileJson);
           }
+        reset_filter_stats(watch);
 
         free(path);
         free(core);
@@ -443,8 +834,33 @@ int main(int argc, char* argv[])
         if (VERBOSE)
           { fprintf(stderr, "Done\n"); fflush(stdout); }
       }
+
+    for (k = 0; k < NTHREADS; k++)
+      free_batch(batch[k]);
+    free(batch);
+    freeBaxData(b);
+    freeBaxData(b+1);
+    if (part != NULL)
+      { for (i = 0; i < PARTS; i++)
+          { for (k = 0; k < NTHREADS; k++)
+              free_batch(part[i].batch[k]);
+            free(part[i].batch);
+            freeBaxData(&part[i].bax);
+            if (part[i].expr != EXPR)
+              free_filter(part[i].expr);
+          }
+        free(part);
+      }
+    if (WATCH != EXPR)
+      free_filter(WATCH);
+    free_filter(EXPR);
   }
 
+  if (fileJson != NULL)
+    { fprintf(fileJson," ] }\n");
+      fclose(fileJson);
+    }
+
   //  If -o<name> then close named outputs
 
   if (output != NULL && *output != '\0')
@@ -454,6 +870,7 @@ int main(int argc, char* argv[])
         fclose(fileArr);
       if (fileQvs != NULL)
         fclose(fileQvs);
+      free(oroot);
       free(output);
     }
 
@@ -462,35 +879,31 @@ int main(int argc, char* argv[])
   //  An error occured, carefully undo any files in progress
 
 error:
-  if (output == NULL)
-    { if (fileFas != NULL)
-        { fclose(fileFas);
-          unlink(Catenate(path,"/",core,".fasta"));
-        }
-      if (fileQvs != NULL)
-        { fclose(fileQvs);
-          unlink(Catenate(path,"/",core,".quiva"));
-        }
-      if (fileArr != NULL)
-        { fclose(fileArr);
-          unlink(Catenate(path,"/",core,".arrow"));
-        }
+
+  //  Remove the JSON statistics, which are incomplete, and the outputs opened for the input
+  //    being processed (all of them if -o<path>), named by their root oroot
+
+  if (fileJson != NULL)
+    { fclose(fileJson);
+      unlink(JSON);
     }
-  else if (*output != '\0')
+  if (oroot != NULL)
     { if (fileFas != NULL)
         { fclose(fileFas);
-          unlink(Catenate("","",output,".fasta"));
+          unlink(Catenate(oroot,"",".fasta",""));
         }
       if (fileQvs != NULL)
         { fclose(fileQvs);
-          unlink(Catenate("","",output,".quiva"));
+          unlink(Catenate(oroot,"",".quiva",""));
         }
       if (fileArr != NULL)
         { fclose(fileArr);
-          unlink(Catenate("","",output,".arrow"));
+          unlink(Catenate(oroot,"",".arrow",""));
         }
-      free(output);
+      free(oroot);
     }
+  if (output != NULL && *output != '\0')
+    free(output);
   free(path);
   free(core);
 
@@ -9,7 +9,15 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <string.h>
 #include <ctype.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_FILTER
+#endif
 
 #undef PRINT_TREE
 
@@ -51,11 +59,16 @@ static char *Error_Messages[] =
     "Expecting comparison operator"
   };
 
-static char      *Scan;
-static int        Error;
+  //  The state of a parse, local to each call of parse_filter so that filters may be parsed
+  //    (and the resulting programs evaluated) by any number of threads at once
+
+typedef struct
+  { char *scan;    //  next character of the expression
+    int   error;   //  index of the syntax error message (0 => out of memory)
+  } Parser;
 
 #define ERROR(msg)	\
-{ Error = msg;		\
+{ P->error = msg;	\
   return (NULL);	\
 }
 
@@ -63,6 +76,7 @@ typedef struct _node
   { int           op;
     struct _node *lft;
     struct _node *rgt;
+    int64         npass;   //  # of the records profiled for which the node is true
   } Node;
 
 static Node *node(int op, Node *lft, Node *rgt)
@@ -70,143 +84,144 @@ static Node *node(int op, Node *lft, Node *rgt)
 
   v = (Node *) malloc(sizeof(Node));
   if (v == NULL)
-    ERROR(0);
-  v->op  = op;
-  v->lft = lft;
-  v->rgt = rgt;
+    return (NULL);
+  v->op    = op;
+  v->lft   = lft;
+  v->rgt   = rgt;
+  v->npass = 0;
   return (v);
 }
 
-static Node *terminal()
+static Node *terminal(Parser *P)
 { int   op;
   int64 x;
 
-  switch (*Scan)
+  switch (*P->scan)
   { case 'z':
-      if (Scan[1] != 'm')
+      if (P->scan[1] != 'm')
         ERROR(1);
       op = OP_ZM;
-      Scan += 2;
+      P->scan += 2;
       break;
     case 'l':
-      if (Scan[1] != 'n')
+      if (P->scan[1] != 'n')
         ERROR(1);
       op = OP_LN;
-      Scan += 2;
+      P->scan += 2;
       break;
     case 'r':
-      if (Scan[1] != 'q')
+      if (P->scan[1] != 'q')
         ERROR(1);
       op = OP_RQ;
-      Scan += 2;
+      P->scan += 2;
       break;
     case 'b':
-      if (Scan[1] == 'c')
-        { if (Scan[2] == '1')
+      if (P->scan[1] == 'c')
+        { if (P->scan[2] == '1')
             op = OP_BC1;
-          else if (Scan[2] == '2')
+          else if (P->scan[2] == '2')
             op = OP_BC2;
           else
             ERROR(1);
-          Scan += 3;
+          P->scan += 3;
         }
-      else if (Scan[1] == 'q')
+      else if (P->scan[1] == 'q')
         { op = OP_BQ;
-          Scan += 2;
+          P->scan += 2;
         }
       else
         ERROR(1);
       break;
     case 'n':
-      if (Scan[1] != 'p')
+      if (P->scan[1] != 'p')
         ERROR(1);
       op = OP_NP;
-      Scan += 2;
+      P->scan += 2;
       break;
     case 'q':
-      if (Scan[1] != 's')
+      if (P->scan[1] != 's')
         ERROR(1);
       op = OP_QS;
-      Scan += 2;
+      P->scan += 2;
       break;
     default:
-      if (!isdigit(*Scan))
+      if (!isdigit(*P->scan))
         ERROR(1);
-      x = *Scan++-'0';
-      while (isdigit(*Scan))
-        x = 10*x + (*Scan++ - '0');
+      x = *P->scan++-'0';
+      while (isdigit(*P->scan))
+        x = 10*x + (*P->scan++ - '0');
       return (node(OP_INT,(Node *) x,NULL));
   }
   return (node(op,NULL,NULL));
 }
 
-static Node *or();
+static Node *or(Parser *P);
 
-static Node *pred()
+static Node *pred(Parser *P)
 { Node *v;
 
-  while (isspace(*Scan))
-    Scan += 1;
-  if (*Scan == '(')
-    { Scan += 1;
-      v = or();
+  while (isspace(*P->scan))
+    P->scan += 1;
+  if (*P->scan == '(')
+    { P->scan += 1;
+      v = or(P);
       if (v == NULL)
         return (NULL);
-      while (isspace(*Scan))
-        Scan += 1;
-      if (*Scan != ')')
+      while (isspace(*P->scan))
+        P->scan += 1;
+      if (*P->scan != ')')
         ERROR(2);
-      Scan += 1;
+      P->scan += 1;
       return (v);
     }
 
   { Node *w;
     int   op;
 
-    v = terminal();
+    v = terminal(P);
     if (v == NULL)
       return (NULL);
 
-    while (isspace(*Scan))
-      Scan += 1;
-    if (*Scan == '<')
-      { if (Scan[1] == '=')
-          { Scan += 2;
+    while (isspace(*P->scan))
+      P->scan += 1;
+    if (*P->scan == '<')
+      { if (P->scan[1] == '=')
+          { P->scan += 2;
             op = OP_LE;
           }
         else
-          { Scan += 1;
+          { P->scan += 1;
             op = OP_LT;
           }
       }
-    else if (*Scan == '>')
-      { if (Scan[1] == '=')
-          { Scan += 2;
+    else if (*P->scan == '>')
+      { if (P->scan[1] == '=')
+          { P->scan += 2;
             op = OP_GE;
           }
         else
-          { Scan += 1;
+          { P->scan += 1;
             op = OP_GT;
           }
       }
-    else if (*Scan == '!')
-      { if (Scan[1] != '=')
+    else if (*P->scan == '!')
+      { if (P->scan[1] != '=')
           ERROR(3);
-        Scan += 2;
+        P->scan += 2;
         op = OP_NE;
       }
-    else if (*Scan == '=')
-      { if (Scan[1] != '=')
+    else if (*P->scan == '=')
+      { if (P->scan[1] != '=')
           ERROR(3);
-        Scan += 2;
+        P->scan += 2;
         op = OP_EQ;
       }
     else
       ERROR(3);
 
-    while (isspace(*Scan))
-      Scan += 1;
-    w = terminal();
+    while (isspace(*P->scan))
+      P->scan += 1;
+    w = terminal(P);
     if (w == NULL)
       return (NULL);
 
@@ -214,42 +229,42 @@ static Node *pred()
   }
 }
 
-static Node *and()
+static Node *and(Parser *P)
 { Node *v, *w; 
 
-  v = pred();
+  v = pred(P);
   if (v == NULL)
     return (NULL);
   while (1)
-    { while (isspace(*Scan))
-        Scan += 1;
-      if (*Scan != '&')
+    { while (isspace(*P->scan))
+        P->scan += 1;
+      if (*P->scan != '&')
         return (v);
-      if (Scan[1] != '&')
+      if (P->scan[1] != '&')
         ERROR(1);
-      Scan += 2;
-      w = pred();
+      P->scan += 2;
+      w = pred(P);
       if (w == NULL)
         return (NULL);
       v = node(OP_AND,v,w);
     }
 }
 
-static Node *or()
+static Node *or(Parser *P)
 { Node *v, *w; 
 
-  v = and();
+  v = and(P);
   if (v == NULL)
     return (NULL);
   while (1)
-    { while (isspace(*Scan))
-        Scan += 1;
-      if (*Scan != '|')
+    { while (isspace(*P->scan))
+        P->scan += 1;
+      if (*P->scan != '|')
         return (v);
-      if (Scan[1] != '|')
+      if (P->scan[1] != '|')
         ERROR(1);
-      Scan += 2;
-      w = and();
+      P->scan += 2;
+      w = and(P);
       if (w == NULL)
         return (NULL);
       v = node(OP_OR,v,w);
@@ -276,120 +291,1264 @@ static void print_tree(Node *v, int level)
 
 #endif
 
-Filter *parse_filter(char *expr)
+  //  A parsed filter is compiled into a flat program for each source, bam and bax, that is
+  //    run by a loop with a single accumulator.  Every comparison of the grammar is between
+  //    two terminals and so is one instruction, either of a variable against a constant (VI)
+  //    or of two variables (VV), that sets the accumulator to 0 or 1.  && and || jump over
+  //    their right operand if the accumulator already decides them.  Before compiling, the
+  //    variables that are constant for a source (bc1, bc2, bq, and np are -1 for bax input)
+  //    are replaced by their value and the tree is constant folded.
+
+#define I_VI   0     //  acc = (x[a] <cmp> b), cmp = op - I_VI in the order LT, LE, GT, GE, NE, EQ
+#define I_VV   6     //  acc = (x[a] <cmp> x[b]), cmp = op - I_VV
+#define I_NOT 12     //  acc = ! acc
+#define I_JF  13     //  if acc == 0 goto a
+#define I_JT  14     //  if acc != 0 goto a
+#define I_SET 15     //  acc = a
+#define I_END 16     //  return acc
+
+#define BAM_CODE 0
+#define BAX_CODE 1
+
+#define NUM_VARS  FILTER_VARS   //  x[op-OP_ZM] is the value of variable op
+
+typedef struct
+  { int op;
+    int a, b;
+  } Code;
+
+typedef struct
+  { Node  *tree;         //  the expression as parsed
+    Node  *fold[2];      //  the folded tree for bam and bax input (profiled, see below)
+    Code  *code[2];      //  its program for bam and bax input, replaced once when adapted
+    int    njump[2];     //    and the # of jumps therein (the same after adapting)
+    int64  nsample[2];   //  # of records of each source profiled so far
+    Code  *first[2];     //  the program as first compiled, kept while others may run it
+    Node  *order[2];     //  the reordered tree once adapted (sharing the comparisons of fold)
+
+    int    npred;        //  # of top-level predicates, the operands of the outermost && or
+    char **ptext;        //    || chain (or the whole expression), their text, and their
+    Code **pcode[2];     //    programs for bam and bax input with their # of jumps, for
+    int   *pjump[2];     //    watched filters
+  } Program;
+
+  //  The statistics of a watched filter (see watch_filter)
+
+typedef struct
+  { int64  nrec, nbase;    //  # of records and bases tested
+    int64  npass, bpass;   //  # of records and bases that pass
+    int64 *nrej, *brej;    //  # of records and bases for which each top-level predicate is false
+    int64  npost;          //  # of records tested one at a time after profiling (see tally)
+    double time;           //  wall seconds spent evaluating the filter (estimated)
+  } Stats;
+
+  //  A Filter is a handle on a program, with statistics if watched
+
+typedef struct _handle
+  { Program        *prog;
+    Stats          *stats;   //  NULL => not watched
+    struct _handle *base;    //  the unwatched handle on prog
+  } Handle;
+
+static int Flip[] = { OP_GT, OP_GE, OP_LT, OP_LE, OP_NE, OP_EQ };   //  a <op> b == b <Flip> a
+
+static int compare(int op, int a, int b)
+{ switch (op)
+  { case OP_LT:
+      return (a < b);
+    case OP_LE:
+      return (a <= b);
+    case OP_GT:
+      return (a > b);
+    case OP_GE:
+      return (a >= b);
+    case OP_NE:
+      return (a != b);
+    default:
+      return (a == b);
+  }
+}
+
+#define IS_INT(v)  ((v)->op == OP_INT)
+#define INT_OF(v)  ((int) (int64) ((v)->lft))
+
+  //  Free the expression tree v
+
+static void free_tree(Node *v)
+{ if (v->op < OP_INT)
+    { free_tree(v->lft);
+      if (v->op != OP_NOT)
+        free_tree(v->rgt);
+    }
+  free(v);
+}
+
+  //  Return a copy of v in which the variables in cons (a bit vector over op-OP_ZM) are
+  //    replaced by -1 and every operator with constant operands by its value: NULL => out
+  //    of memory
+
+static Node *fold(Node *v, int cons)
+{ Node *l, *r;
+
+  if (v->op == OP_INT)
+    return (node(OP_INT,v->lft,NULL));
+  if (v->op > OP_INT)
+    { if (cons & (1 << (v->op-OP_ZM)))
+        return (node(OP_INT,(Node *) (int64) -1,NULL));
+      return (node(v->op,NULL,NULL));
+    }
+
+  l = fold(v->lft,cons);
+  if (l == NULL)
+    return (NULL);
+  if (v->op == OP_NOT)
+    { if (IS_INT(l))
+        { l->lft = (Node *) (int64) (INT_OF(l) == 0);
+          return (l);
+        }
+      return (node(OP_NOT,l,NULL));
+    }
+
+  if (v->op == OP_AND || v->op == OP_OR)    //  x && y == 0 if x == 0, y otherwise, and
+    { if (IS_INT(l))                        //    x || y == 1 if x != 0, y otherwise, as
+        { if ((INT_OF(l) != 0) == (v->op == OP_OR))    //  y is a comparison (0 or 1)
+            { l->lft = (Node *) (int64) (v->op == OP_OR);
+              return (l);
+            }
+          free(l);
+          return (fold(v->rgt,cons));
+        }
+      r = fold(v->rgt,cons);
+      if (r == NULL)
+        return (NULL);
+      if (IS_INT(r))
+        { if ((INT_OF(r) != 0) == (v->op == OP_OR))    //  x && 0 == 0 and x || 1 == 1
+            { free_tree(l);                             //    as x has no side effects
+              r->lft = (Node *) (int64) (v->op == OP_OR);
+              return (r);
+            }
+          free(r);                                      //  x && 1 == x and x || 0 == x
+          return (l);
+        }
+      return (node(v->op,l,r));
+    }
+
+  r = fold(v->rgt,cons);
+  if (r == NULL)
+    return (NULL);
+  if (IS_INT(l) && IS_INT(r))
+    { l->lft = (Node *) (int64) compare(v->op,INT_OF(l),INT_OF(r));
+      free(r);
+      return (l);
+    }
+  return (node(v->op,l,r));
+}
+
+static int size(Node *v)
+{ if (v->op == OP_NOT)
+    return (size(v->lft) + 1);
+  if (v->op <= OP_EQ)
+    return (size(v->lft) + size(v->rgt) + 1);
+  return (1);
+}
+
+  //  Emit the code for folded expression v at c+n and return the index following it
+
+static int emit(Code *c, int n, Node *v)
+{ Node *l, *r;
+  int   j, op;
+
+  switch (v->op)
+  { case OP_OR:
+    case OP_AND:
+      n = emit(c,n,v->lft);
+      j = n++;
+      c[j].op = (v->op == OP_OR ? I_JT : I_JF);
+      n = emit(c,n,v->rgt);
+      c[j].a = n;
+      return (n);
+    case OP_NOT:
+      n = emit(c,n,v->lft);
+      c[n].op = I_NOT;
+      return (n+1);
+    case OP_INT:
+      c[n].op = I_SET;
+      c[n].a  = (INT_OF(v) != 0);
+      return (n+1);
+  }
+
+  l  = v->lft;
+  r  = v->rgt;
+  op = v->op;
+  if (IS_INT(l))
+    { l  = v->rgt;
+      r  = v->lft;
+      op = Flip[op-OP_LT];
+    }
+  if (IS_INT(r))
+    { c[n].op = I_VI + (op-OP_LT);
+      c[n].a  = l->op-OP_ZM;
+      c[n].b  = INT_OF(r);
+    }
+  else
+    { c[n].op = I_VV + (op-OP_LT);
+      c[n].a  = l->op-OP_ZM;
+      c[n].b  = r->op-OP_ZM;
+    }
+  return (n+1);
+}
+
+  //  Compile folded expression v: NULL => out of memory
+
+static Code *compile(Node *v, int *njump)
+{ Code *c;
+  int   i, n;
+
+  c = (Code *) malloc(sizeof(Code)*(size(v)+1));
+  if (c == NULL)
+    return (NULL);
+  n = emit(c,0,v);
+  c[n].op = I_END;
+  *njump = 0;
+  for (i = 0; i < n; i++)
+    if (c[i].op == I_JF || c[i].op == I_JT)
+      *njump += 1;
+  return (c);
+}
+
+static int run(Code *code, int *x)
+{ Code *c;
+  int   acc;
+
+  acc = 0;
+  for (c = code; 1; c++)
+    switch (c->op)
+    { case I_VI+0: acc = (x[c->a] <  c->b); break;
+      case I_VI+1: acc = (x[c->a] <= c->b); break;
+      case I_VI+2: acc = (x[c->a] >  c->b); break;
+      case I_VI+3: acc = (x[c->a] >= c->b); break;
+      case I_VI+4: acc = (x[c->a] != c->b); break;
+      case I_VI+5: acc = (x[c->a] == c->b); break;
+      case I_VV+0: acc = (x[c->a] <  x[c->b]); break;
+      case I_VV+1: acc = (x[c->a] <= x[c->b]); break;
+      case I_VV+2: acc = (x[c->a] >  x[c->b]); break;
+      case I_VV+3: acc = (x[c->a] >= x[c->b]); break;
+      case I_VV+4: acc = (x[c->a] != x[c->b]); break;
+      case I_VV+5: acc = (x[c->a] == x[c->b]); break;
+      case I_NOT:  acc = ! acc; break;
+      case I_JF:   if (acc == 0) c = code + (c->a-1); break;
+      case I_JT:   if (acc != 0) c = code + (c->a-1); break;
+      case I_SET:  acc = c->a; break;
+      default:     return (acc);
+    }
+}
+
+  //  Adaptive ordering.  The operands of a chain of &&'s (or ||'s) have no side effects
+  //    and so may be tested in any order without changing the result.  The first SAMPLE_SIZE
+  //    records of each source are evaluated on the folded tree testing every node, counting
+  //    the records for which each is true.  The thread profiling the last of them then
+  //    orders the operands of every chain by increasing cost per record decided, i.e.
+  //    size/(1-pass rate) for && and size/(pass rate) for ||, recompiles, and publishes the
+  //    new program atomically.  Threads still running the old program finish with it, so
+  //    it is kept until free_filter.  A filter is profiled only once, so when one filter
+  //    serves a series of inputs the order is that best for the first SAMPLE_SIZE records
+  //    of the first input of each source, and is not revisited for the later inputs.
+
+#define SAMPLE_SIZE 4096
+
+static int profile(Node *v, int *x)
+{ int a, b, r;
+
+  switch (v->op)
+  { case OP_OR:
+    case OP_AND:
+      a = profile(v->lft,x);
+      b = profile(v->rgt,x);
+      r = (v->op == OP_OR ? (a || b) : (a && b));
+      break;
+    case OP_NOT:
+      r = ! profile(v->lft,x);
+      break;
+    case OP_INT:
+      r = (INT_OF(v) != 0);
+      break;
+    default:
+      a = (IS_INT(v->lft) ? INT_OF(v->lft) : x[v->lft->op-OP_ZM]);
+      b = (IS_INT(v->rgt) ? INT_OF(v->rgt) : x[v->rgt->op-OP_ZM]);
+      r = compare(v->op,a,b);
+      break;
+  }
+  if (r)
+    __atomic_fetch_add(&v->npass,1,__ATOMIC_RELAXED);
+  return (r);
+}
+
+  //  Put the operands of the chain of op's rooted at v in c[n..] and return the new count
+
+static int chain(Node *v, int op, Node **c, int n)
+{ if (v->op != op)
+    { c[n] = v;
+      return (n+1);
+    }
+  n = chain(v->lft,op,c,n);
+  return (chain(v->rgt,op,c,n));
+}
+
+  //  Return a tree equivalent to v (sharing its comparisons) with the operands of every chain
+  //    ordered as above given ns records were profiled: NULL => out of memory
+
+static Node *reorder(Node *v, int64 ns)
+{ int    n, i, j;
+  double r, p;
+  Node  *w;
+
+  if (v->op == OP_NOT)
+    { w = reorder(v->lft,ns);
+      if (w == NULL)
+        return (NULL);
+      return (node(OP_NOT,w,NULL));
+    }
+  if (v->op != OP_AND && v->op != OP_OR)
+    return (v);
+
+  { Node  *c[size(v)];
+    double rank[size(v)];
+
+    n = chain(v,v->op,c,0);
+    for (i = 0; i < n; i++)
+      { p = ((double) c[i]->npass) / ns;
+        if (v->op == OP_OR)
+          p = 1.-p;
+        if (p >= 1.)
+          r = 1e30;
+        else
+          r = size(c[i]) / (1.-p);
+        w = reorder(c[i],ns);
+        if (w == NULL)
+          return (NULL);
+        for (j = i; j > 0 && rank[j-1] > r; j--)
+          { c[j]    = c[j-1];
+            rank[j] = rank[j-1];
+          }
+        c[j]    = w;
+        rank[j] = r;
+      }
+
+    w = c[0];
+    for (i = 1; i < n; i++)
+      { w = node(v->op,w,c[i]);
+        if (w == NULL)
+          return (NULL);
+      }
+    return (w);
+  }
+}
+
+  //  Free the operators of reordered tree v, leaving the comparisons it shares with fold
+
+static void free_order(Node *v)
+{ if (v->op > OP_NOT)
+    return;
+  free_order(v->lft);
+  if (v->op != OP_NOT)
+    free_order(v->rgt);
+  free(v);
+}
+
+static void adapt(Program *p, int src)
 { Node *v;
+  Code *c;
+  int   njump;
 
-  Scan = expr;
-  v    = or();
+  v = reorder(p->fold[src],SAMPLE_SIZE);
   if (v == NULL)
-    { if (Error == 0)
-        fprintf(stderr,"%s: Out of memory parsing filter expression\n",Prog_Name);
+    return;
+  c = compile(v,&njump);
+  if (c == NULL)
+    { free_order(v);
+      return;
+    }
+  p->order[src] = v;
+  __atomic_store_n(p->code+src,c,__ATOMIC_RELEASE);
+}
+
+  //  Evaluate p for source src on the record with variable values x
+
+static int evaluate(Program *p, int src, int *x)
+{ int r;
+
+  if (__atomic_load_n(p->nsample+src,__ATOMIC_RELAXED) >= SAMPLE_SIZE)
+    return (run(__atomic_load_n(p->code+src,__ATOMIC_ACQUIRE),x));
+
+  r = profile(p->fold[src],x);
+  if (__atomic_add_fetch(p->nsample+src,1,__ATOMIC_ACQ_REL) == SAMPLE_SIZE)
+    adapt(p,src);
+  return (r);
+}
+
+static double wallTime()
+{ struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return (t.tv_sec + t.tv_nsec*1e-9);
+}
+
+  //  Evaluate handle h for source src on x, tallying the record if h is watched.  While the
+  //    filter is being profiled each evaluation walks the tree and is timed as is.  Once
+  //    the program is adapted an evaluation takes a few nanoseconds, less than reading the
+  //    clock, so only every TALLY_PERIOD'th record is timed, over TALLY_RUNS runs of the
+  //    program, and the time scaled to all such records.  The top-level predicates are
+  //    only run when the outcome does not decide them: every operand of a passing && chain
+  //    passes, and every operand of a failing || chain fails, as does a lone predicate
+  //    that fails.
+
+#define TALLY_PERIOD 256
+#define TALLY_RUNS    16
+
+static int tally(Handle *h, int src, int *x)
+{ Program *p = h->prog;
+  Stats   *s = h->stats;
+  double   t;
+  int      r, k, ln, op;
+
+  if (s == NULL)
+    return (evaluate(p,src,x));
+
+  if (__atomic_load_n(p->nsample+src,__ATOMIC_RELAXED) < SAMPLE_SIZE)
+    { t = wallTime();
+      r = evaluate(p,src,x);
+      s->time += wallTime() - t;
+    }
+  else
+    { r = evaluate(p,src,x);
+      if (s->npost++ % TALLY_PERIOD == 0)
+        { Code        *c = __atomic_load_n(p->code+src,__ATOMIC_ACQUIRE);
+          volatile int sink;
+
+          t = wallTime();
+          for (k = 0; k < TALLY_RUNS; k++)     //  the barrier keeps the runs from being merged
+            { sink = run(c,x);
+              __asm__ __volatile__ ("" : : : "memory");
+            }
+          (void) sink;
+          s->time += (wallTime() - t) * (TALLY_PERIOD / TALLY_RUNS);
+        }
+    }
+
+  ln = x[OP_LN-OP_ZM];
+  s->nrec  += 1;
+  s->nbase += ln;
+  if (r)
+    { s->npass += 1;
+      s->bpass += ln;
+    }
+
+  op = p->tree->op;
+  if (r && op != OP_OR)
+    return (r);
+  for (k = 0; k < p->npred; k++)
+    if ((! r && op != OP_AND) || ! run(p->pcode[src][k],x))
+      { s->nrej[k] += 1;
+        s->brej[k] += ln;
+      }
+  return (r);
+}
+
+  //  Batch evaluation runs a program on 64 subreads at a time, every instruction giving a
+  //    mask with a bit per subread.  A jump saves the mask of its left operand and at its
+  //    target the mask of the right operand is and'ed (&&) or or'ed (||) with it.  The
+  //    right operand is skipped only if the left decides all 64.  Comparisons are done 4
+  //    lanes at a time with SSE2 on x86 (checked at run time).
+
+#ifdef SIMD_FILTER
+
+__attribute__((target("sse2")))
+static uint64 compare_sse2(int cmp, int *x, int *y, int b)
+{ __m128i u, v, k;
+  uint64  m;
+  int     i;
+
+  k = _mm_set1_epi32(b);
+  m = 0;
+  for (i = 0; i < 64; i += 4)
+    { u = _mm_loadu_si128((__m128i *) (x+i));
+      if (y == NULL)
+        v = k;
       else
-        { fprintf(stderr,"%s: Filter expression syntax error:\n\n",Prog_Name);
-          fprintf(stderr,"    %s\n",expr);
-          fprintf(stderr,"%*s^ %s\n",(int) ((Scan-expr)+4),"",Error_Messages[Error]);
+        v = _mm_loadu_si128((__m128i *) (y+i));
+      if (cmp == OP_LT || cmp == OP_GE)
+        v = _mm_cmplt_epi32(u,v);
+      else if (cmp == OP_GT || cmp == OP_LE)
+        v = _mm_cmpgt_epi32(u,v);
+      else
+        v = _mm_cmpeq_epi32(u,v);
+      m |= ((uint64) _mm_movemask_ps(_mm_castsi128_ps(v))) << i;
+    }
+  if (cmp == OP_GE || cmp == OP_LE || cmp == OP_NE)
+    m = ~m;
+  return (m);
+}
+
+#endif
+
+  //  Mask of x[i] <cmp> y[i] (or b if y is NULL) for i in [0,m)
+
+static uint64 compare_lanes(int cmp, int *x, int *y, int b, int m)
+{ uint64 s;
+  int    i;
+
+#ifdef SIMD_FILTER
+  if (m == 64 && __builtin_cpu_supports("sse2"))
+    return (compare_sse2(cmp,x,y,b));
+#endif
+  s = 0;
+  for (i = 0; i < m; i++)
+    if (compare(cmp,x[i],(y == NULL ? b : y[i])))
+      s |= (1ull << i);
+  return (s);
+}
+
+static uint64 run_lanes(Code *code, int njump, int **x, int o, int m)
+{ Code  *c, *jump[njump+1];
+  uint64 acc, all, save[njump+1];
+  int    pc, top;
+
+  if (m < 64)
+    all = (1ull << m) - 1;
+  else
+    all = ~0ull;
+  acc = 0;
+  top = 0;
+  for (c = code; 1; c++)
+    { pc = c-code;
+      while (top > 0 && jump[top-1]->a == pc)
+        { top -= 1;
+          if (jump[top]->op == I_JF)
+            acc &= save[top];
+          else
+            acc |= save[top];
+        }
+      if (c->op < I_VV)
+        acc = compare_lanes(OP_LT + (c->op-I_VI),x[c->a]+o,NULL,c->b,m);
+      else if (c->op < I_NOT)
+        acc = compare_lanes(OP_LT + (c->op-I_VV),x[c->a]+o,x[c->b]+o,0,m);
+      else
+        switch (c->op)
+        { case I_NOT:
+            acc = ~acc;
+            break;
+          case I_JF:
+          case I_JT:
+            save[top]   = acc;
+            jump[top++] = c;
+            if ((acc & all) == (c->op == I_JF ? 0 : all))
+              c = code + (c->a-1);
+            break;
+          case I_SET:
+            acc = (c->a ? all : 0);
+            break;
+          default:
+            return (acc & all);
         }
     }
+}
+
+  //  Sum of ln[i] over the bits i set in w
 
-  return ((Filter *) v);
+static int64 sum_lanes(uint64 w, int *ln)
+{ int64 sum;
+
+  sum = 0;
+  for ( ; w != 0; w &= w-1)
+    sum += ln[__builtin_ctzll(w)];
+  return (sum);
+}
+
+int evaluate_filter_batch(Filter *v, int isbax, int n, int **col, uint64 *sel)
+{ Program *p = ((Handle *) v)->prog;
+  Stats   *s = ((Handle *) v)->stats;
+  double   t;
+  int      i, j, k, m, src, cnt;
+
+  src = (isbax ? BAX_CODE : BAM_CODE);
+  cnt = 0;
+  t   = 0.;
+  if (s != NULL)
+    t = wallTime();
+  for (i = 0; i < n; i += 64)
+    { m = n-i;
+      if (m > 64)
+        m = 64;
+      if (__atomic_load_n(p->nsample+src,__ATOMIC_RELAXED) < SAMPLE_SIZE)
+        { int x[NUM_VARS], j, k;     //  still profiling: one record at a time
+
+          sel[i>>6] = 0;
+          for (j = 0; j < m; j++)
+            { for (k = 0; k < NUM_VARS; k++)
+                x[k] = (col[k] == NULL ? -1 : col[k][i+j]);
+              if (evaluate(p,src,x))
+                sel[i>>6] |= (1ull << j);
+            }
+        }
+      else
+        sel[i>>6] = run_lanes(__atomic_load_n(p->code+src,__ATOMIC_ACQUIRE),p->njump[src],
+                              col,i,m);
+      cnt += __builtin_popcountll(sel[i>>6]);
+    }
+  if (s == NULL)
+    return (cnt);
+
+  s->time  += wallTime() - t;
+  s->nrec  += n;
+  s->npass += cnt;
+  for (i = 0; i < n; i += 64)
+    { uint64 all, w;
+      int   *ln = col[FILTER_LN] + i;
+
+      m = n-i;
+      if (m > 64)
+        m = 64;
+      all = (m < 64 ? (1ull << m) - 1 : ~0ull);
+      for (j = 0; j < m; j++)
+        s->nbase += ln[j];
+      s->bpass += sum_lanes(sel[i>>6],ln);
+      for (k = 0; k < p->npred; k++)
+        { w = ~run_lanes(p->pcode[src][k],p->pjump[src][k],col,i,m) & all;
+          s->nrej[k] += __builtin_popcountll(w);
+          s->brej[k] += sum_lanes(w,ln);
+        }
+    }
+  return (cnt);
 }
 
-static samRecord *S_Record;
+  //  Print v at s in the syntax of filters, parenthesizing it if paren is set and it is a
+  //    chain, and return the end of the text (at most 24 characters per node)
+
+static char *Token[] = { "||", "&&", "!", "<", "<=", ">", ">=", "!=", "==", "",
+                         "zm", "ln", "rq", "bc1", "bc2", "bq", "np", "qs" };
 
-static int eval_S(Node *v)
+static char *unparse(Node *v, char *s, int paren)
 { switch (v->op)
   { case OP_OR:
-      return (eval_S(v->lft) || eval_S(v->rgt));
     case OP_AND:
-      return (eval_S(v->lft) && eval_S(v->rgt));
+      if (paren)
+        *s++ = '(';
+      s  = unparse(v->lft,s,v->lft->op != v->op);
+      s += sprintf(s," %s ",Token[v->op]);
+      s  = unparse(v->rgt,s,v->rgt->op != v->op);
+      if (paren)
+        *s++ = ')';
+      break;
     case OP_NOT:
-      return ( ! eval_S(v->lft));
-    case OP_LT:
-      return (eval_S(v->lft) < eval_S(v->rgt));
-    case OP_LE:
-      return (eval_S(v->lft) <= eval_S(v->rgt));
-    case OP_GT:
-      return (eval_S(v->lft) > eval_S(v->rgt));
-    case OP_GE:
-      return (eval_S(v->lft) >= eval_S(v->rgt));
-    case OP_NE:
-      return (eval_S(v->lft) != eval_S(v->rgt));
-    case OP_EQ:
-      return (eval_S(v->lft) == eval_S(v->rgt));
+      s += sprintf(s,"!");
+      s  = unparse(v->lft,s,1);
+      break;
     case OP_INT:
-      return ((int) (int64) (v->lft));
-    case OP_ZM:
-      return (S_Record->well);
-    case OP_LN:
-      return (S_Record->len);
-    case OP_RQ:
-      return ((int) (1000*S_Record->qual));
-    case OP_BC1:
-      return (S_Record->bc[0]);
-    case OP_BC2:
-      return (S_Record->bc[1]);
-    case OP_BQ:
-      return (S_Record->bqual);
-    case OP_NP:
-      return (S_Record->nump);
-    case OP_QS:
-      return (S_Record->beg);
+      s += sprintf(s,"%d",INT_OF(v));
+      break;
+    default:
+      if (v->op <= OP_EQ)
+        { s  = unparse(v->lft,s,1);
+          s += sprintf(s,"%s",Token[v->op]);
+          s  = unparse(v->rgt,s,1);
+        }
+      else
+        s += sprintf(s,"%s",Token[v->op]);
+      break;
   }
+  *s = '\0';
+  return (s);
+}
+
+  //  Set up the top-level predicates of p: 1 => out of memory
+
+static int predicates(Program *p, int cons[2])
+{ Node *v = p->tree;
+  Node *c[size(v)], *f;
+  int   n, k, src;
+
+  if (v->op == OP_AND || v->op == OP_OR)
+    n = chain(v,v->op,c,0);
+  else
+    { c[0] = v;
+      n    = 1;
+    }
+  p->npred = n;
+  p->ptext = (char **) malloc(sizeof(char *)*n);
+  p->pcode[0] = (Code **) malloc(sizeof(Code *)*2*n);
+  p->pjump[0] = (int *) malloc(sizeof(int)*2*n);
+  if (p->ptext == NULL || p->pcode[0] == NULL || p->pjump[0] == NULL)
+    return (1);
+  p->pcode[1] = p->pcode[0] + n;
+  p->pjump[1] = p->pjump[0] + n;
+
+  for (k = 0; k < n; k++)
+    { p->ptext[k] = (char *) malloc(24*size(c[k])+1);
+      if (p->ptext[k] == NULL)
+        return (1);
+      unparse(c[k],p->ptext[k],0);
+      for (src = 0; src < 2; src++)
+        { f = fold(c[k],cons[src]);
+          if (f == NULL)
+            return (1);
+          p->pcode[src][k] = compile(f,p->pjump[src]+k);
+          free_tree(f);
+          if (p->pcode[src][k] == NULL)
+            return (1);
+        }
+    }
   return (0);
 }
 
+#define BAX_CONSTANT  (1 << (OP_BC1-OP_ZM) | 1 << (OP_BC2-OP_ZM) | \
+                       1 << (OP_BQ-OP_ZM)  | 1 << (OP_NP-OP_ZM))
+
+Filter *parse_filter(char *expr)
+{ Parser   P;
+  Node    *v;
+  Program *p;
+  Handle  *h;
+  int      cons[2];
+
+  P.scan  = expr;
+  P.error = 0;
+  v = or(&P);
+  if (v == NULL)
+    { if (P.error == 0)
+        fprintf(stderr,"%s: Out of memory parsing filter expression\n",Prog_Name);
+      else
+        { fprintf(stderr,"%s: Filter expression syntax error:\n\n",Prog_Name);
+          fprintf(stderr,"    %s\n",expr);
+          fprintf(stderr,"%*s^ %s\n",(int) ((P.scan-expr)+4),"",Error_Messages[P.error]);
+        }
+      return (NULL);
+    }
+
+  cons[BAM_CODE] = 0;
+  cons[BAX_CODE] = BAX_CONSTANT;
+
+  h = (Handle *) malloc(sizeof(Handle));
+  p = (Program *) malloc(sizeof(Program));
+  if (h == NULL || p == NULL)
+    goto nomem;
+  h->prog  = p;
+  h->stats = NULL;
+  h->base  = h;
+
+  p->tree = v;
+  p->fold[BAM_CODE] = fold(v,cons[BAM_CODE]);
+  p->fold[BAX_CODE] = fold(v,cons[BAX_CODE]);
+  if (p->fold[BAM_CODE] == NULL || p->fold[BAX_CODE] == NULL)
+    goto nomem;
+  p->code[BAM_CODE] = compile(p->fold[BAM_CODE],p->njump+BAM_CODE);
+  p->code[BAX_CODE] = compile(p->fold[BAX_CODE],p->njump+BAX_CODE);
+  p->nsample[BAM_CODE] = 0;
+  p->nsample[BAX_CODE] = 0;
+  p->first[BAM_CODE] = p->code[BAM_CODE];
+  p->first[BAX_CODE] = p->code[BAX_CODE];
+  p->order[BAM_CODE] = NULL;
+  p->order[BAX_CODE] = NULL;
+  if (p->code[BAM_CODE] == NULL || p->code[BAX_CODE] == NULL)
+    goto nomem;
+  if (predicates(p,cons))
+    goto nomem;
+
+  return ((Filter *) h);
+
+nomem:
+  fprintf(stderr,"%s: Out of memory compiling filter expression\n",Prog_Name);
+  return (NULL);
+}
+
+Filter *watch_filter(Filter *v)
+{ Handle  *h = ((Handle *) v)->base;
+  Handle  *w;
+  Stats   *s;
+  int64   *c;
+
+  w = (Handle *) malloc(sizeof(Handle));
+  s = (Stats *) malloc(sizeof(Stats));
+  c = (int64 *) malloc(sizeof(int64)*2*h->prog->npred);
+  if (w == NULL || s == NULL || c == NULL)
+    { fprintf(stderr,"%s: Out of memory allocating filter statistics\n",Prog_Name);
+      free(c);
+      free(s);
+      free(w);
+      return (NULL);
+    }
+  w->prog  = h->prog;
+  w->stats = s;
+  w->base  = h;
+  s->nrej  = c;
+  s->brej  = c + h->prog->npred;
+  reset_filter_stats((Filter *) w);
+  return ((Filter *) w);
+}
+
+void reset_filter_stats(Filter *v)
+{ Stats *s = ((Handle *) v)->stats;
+  int    k;
+
+  if (s == NULL)
+    return;
+  s->nrec  = s->nbase = 0;
+  s->npass = s->bpass = 0;
+  s->npost = 0;
+  s->time  = 0.;
+  for (k = 0; k < ((Handle *) v)->prog->npred; k++)
+    s->nrej[k] = s->brej[k] = 0;
+}
+
+void print_filter_stats(Filter *v, FILE *out)
+{ Program *p = ((Handle *) v)->prog;
+  Stats   *s = ((Handle *) v)->stats;
+  int      k;
+
+  if (s == NULL)
+    return;
+  fprintf(out,"   Filter passed ");
+  Print_Number(s->npass,0,out);
+  fprintf(out," of ");
+  Print_Number(s->nrec,0,out);
+  fprintf(out," subreads (");
+  Print_Number(s->bpass,0,out);
+  fprintf(out," of ");
+  Print_Number(s->nbase,0,out);
+  fprintf(out," bases) in est. %.3fs\n",s->time);
+  for (k = 0; k < p->npred; k++)
+    { fprintf(out,"     ");
+      Print_Number(s->nrej[k],0,out);
+      fprintf(out," subreads (");
+      Print_Number(s->brej[k],0,out);
+      fprintf(out," bases) fail %s\n",p->ptext[k]);
+    }
+}
+
+  //  Print string x as a JSON string
+
+static void json_string(char *x, FILE *out)
+{ fputc('"',out);
+  for ( ; *x != '\0'; x++)
+    if (*x == '"' || *x == '\\')
+      fprintf(out,"\\%c",*x);
+    else if ((unsigned char) *x < ' ')
+      fprintf(out,"\\u%04x",*x);
+    else
+      fputc(*x,out);
+  fputc('"',out);
+}
+
+void json_filter_stats(Filter *v, char *input, FILE *out)
+{ Program *p = ((Handle *) v)->prog;
+  Stats   *s = ((Handle *) v)->stats;
+  int      k;
+
+  if (s == NULL)
+    return;
+  fprintf(out,"{ \"input\": ");
+  json_string(input,out);
+  fprintf(out,", \"records\": %lld, \"bases\": %lld,",s->nrec,s->nbase);
+  fprintf(out," \"passed\": %lld, \"passed_bases\": %lld,",s->npass,s->bpass);
+  fprintf(out," \"est_seconds\": %.6f,\n    \"predicates\": [",s->time);
+  for (k = 0; k < p->npred; k++)
+    { fprintf(out,"%s\n      { \"predicate\": ",k > 0 ? "," : "");
+      json_string(p->ptext[k],out);
+      fprintf(out,", \"rejected\": %lld, \"rejected_bases\": %lld }",s->nrej[k],s->brej[k]);
+    }
+  fprintf(out," ] }");
+}
+
+void free_filter(Filter *v)
+{ Handle  *h = (Handle *) v;
+  Program *p;
+  int      k, src;
+
+  if (h == NULL)
+    return;
+  if (h->stats != NULL)
+    { free(h->stats->nrej);
+      free(h->stats);
+      free(h);
+      return;
+    }
+
+  p = h->prog;
+  for (k = 0; k < p->npred; k++)
+    { free(p->ptext[k]);
+      free(p->pcode[BAM_CODE][k]);
+      free(p->pcode[BAX_CODE][k]);
+    }
+  free(p->ptext);
+  free(p->pcode[0]);
+  free(p->pjump[0]);
+  for (src = 0; src < 2; src++)
+    { if (p->code[src] != p->first[src])
+        free(p->code[src]);
+      free(p->first[src]);
+      if (p->order[src] != NULL && p->order[src] != p->fold[src])
+        free_order(p->order[src]);
+      free_tree(p->fold[src]);
+    }
+  free_tree(p->tree);
+  free(p);
+  free(h);
+}
+
 int evaluate_bam_filter(Filter *v, samRecord *s)
-{ S_Record = s;
-  return (eval_S((Node *) v));
+{ int x[NUM_VARS];
+
+  x[OP_ZM-OP_ZM]  = s->well;
+  x[OP_LN-OP_ZM]  = s->len;
+  x[OP_RQ-OP_ZM]  = (int) (1000*s->qual);
+  x[OP_BC1-OP_ZM] = s->bc[0];
+  x[OP_BC2-OP_ZM] = s->bc[1];
+  x[OP_BQ-OP_ZM]  = s->bqual;
+  x[OP_NP-OP_ZM]  = s->nump;
+  x[OP_QS-OP_ZM]  = s->beg;
+  return (tally((Handle *) v,BAM_CODE,x));
 }
 
-static SubRead *X_Record;
-static BaxData *X_Data;
+  //  Does the expression v refer to variable op?
 
-static int eval_X(Node *v)
-{ switch (v->op)
+static int refers_to(Node *v, int op)
+{ if (v->op == OP_NOT)
+    return (refers_to(v->lft,op));
+  if (v->op <= OP_EQ)
+    return (refers_to(v->lft,op) || refers_to(v->rgt,op));
+  return (v->op == op);
+}
+
+int filter_wants(Filter *v)
+{ Node *t;
+  int   want;
+
+  t    = ((Handle *) v)->prog->tree;
+  want = 0;
+  if (refers_to(t,OP_BC1) || refers_to(t,OP_BC2) || refers_to(t,OP_BQ))
+    want |= WANT_BC;
+  if (refers_to(t,OP_NP))
+    want |= WANT_NP;
+  return (want);
+}
+
+int parse_shard(char *arg, Shard *s)
+{ char *e, *f;
+  long  a, b;
+
+  a = strtol(arg,&e,10);
+  if (e == arg || a < 0 || (*e != '/' && *e != '-'))
+    goto error;
+  b = strtol(e+1,&f,10);
+  if (f == e+1 || *f != '\0' || b < 0 || a > INT32_MAX || b > INT32_MAX)
+    goto error;
+
+  if (*e == '/')
+    { if (a < 1 || a > b)
+        { fprintf(stderr,"%s: Shard %ld/%ld is not in range\n",Prog_Name,a,b);
+          return (1);
+        }
+      s->part   = a;
+      s->nparts = b;
+    }
+  else
+    { if (a > b)
+        { fprintf(stderr,"%s: Shard range %ld-%ld is empty\n",Prog_Name,a,b);
+          return (1);
+        }
+      s->nparts = 0;
+      s->lo     = a;
+      s->hi     = b;
+    }
+  return (0);
+
+error:
+  fprintf(stderr,"%s: Shard '%s' is not of the form <int>/<int> or <int>-<int>\n",Prog_Name,arg);
+  return (1);
+}
+
+  //  Filter callback with which the reader of sf tests each record before decoding it in full
+
+static int pass_bam_filter(void *v, samRecord *r)
+{ return (evaluate_bam_filter((Filter *) v,r)); }
+
+int select_bam_filter(Filter *v, Shard *s, samFile *sf)
+{ samIndex *x;
+  Node     *t;
+  uint8    *keep;
+  uint64   *sel;
+  int      *idx, *col[FILTER_VARS];
+  int       i, j, k, n, ret, test;
+  int       beg, end;
+
+  sam_set_filter(sf,pass_bam_filter,v);
+
+  x = sam_index_load(sf);
+  if (x == NULL)
+    { if (s == NULL)
+        return (0);
+      if (s->nparts > 0)
+        { fprintf(stderr,"%s: Shard %d/%d of %s requires a .bam with a .pbi index\n",
+                         Prog_Name,s->part,s->nparts,sf->name);
+          return (1);
+        }
+      sam_set_wells(sf,s->lo,s->hi);
+      return (0);
+    }
+
+  t    = ((Handle *) v)->prog->tree;
+  test = ! (refers_to(t,OP_NP) ||
+              ( ! x->hasbc && (refers_to(t,OP_BC1) || refers_to(t,OP_BC2)
+                                                   || refers_to(t,OP_BQ))));
+  if ( ! test && s == NULL)
+    { sam_index_free(x);
+      return (0);
+    }
+
+  keep = (uint8 *) malloc(x->nreads+1);
+  if (keep == NULL)
+    { fprintf(stderr,"%s: Out of memory selecting records of %s\n",Prog_Name,sf->name);
+      sam_index_free(x);
+      return (1);
+    }
+
+  //  Records [beg,end) are in the shard.  A part is cut at the nearest well boundary
+  //    following an equal division of the records.
+
+  beg = 0;
+  end = x->nreads;
+  if (s != NULL && s->nparts > 0)
+    { beg = ((int64) x->nreads * (s->part-1)) / s->nparts;
+      end = ((int64) x->nreads * s->part) / s->nparts;
+      while (beg > 0 && beg < x->nreads && x->well[beg] == x->well[beg-1])
+        beg += 1;
+      while (end > 0 && end < x->nreads && x->well[end] == x->well[end-1])
+        end += 1;
+    }
+
+  for (i = 0; i < x->nreads; i++)
+    keep[i] = (i >= beg && i < end &&
+                 (s == NULL || s->nparts > 0 || (x->well[i] >= s->lo && x->well[i] <= s->hi)));
+
+  //  The filter is evaluated on the records of the shard in one batch over compacted index
+  //    columns, whereupon the reader need no longer tally the records it tests
+
+  if (test && end > beg)
+    { n   = end-beg;
+      sel = (uint64 *) malloc(sizeof(uint64)*(n/64+1) + 9*sizeof(int)*n);
+      if (sel == NULL)
+        { fprintf(stderr,"%s: Out of memory selecting records of %s\n",Prog_Name,sf->name);
+          free(keep);
+          sam_index_free(x);
+          return (1);
+        }
+      idx = (int *) (sel + (n/64+1));
+      for (k = 0; k < FILTER_VARS; k++)
+        col[k] = idx + (k+1)*n;
+      col[FILTER_NP] = NULL;
+      if ( ! x->hasbc)
+        col[FILTER_BC1] = col[FILTER_BC2] = col[FILTER_BQ] = NULL;
+
+      n = 0;
+      for (i = beg; i < end; i++)
+        if (keep[i])
+          { idx[n] = i;
+            col[FILTER_ZM][n] = x->well[i];
+            col[FILTER_LN][n] = x->end[i] - x->beg[i];
+            col[FILTER_RQ][n] = (int) (1000*x->qual[i]);
+            col[FILTER_QS][n] = x->beg[i];
+            if (x->hasbc)
+              { col[FILTER_BC1][n] = x->bc[0][i];
+                col[FILTER_BC2][n] = x->bc[1][i];
+                col[FILTER_BQ][n]  = x->bqual[i];
+              }
+            n += 1;
+          }
+      evaluate_filter_batch(v,0,n,col,sel);
+      for (j = 0; j < n; j++)
+        keep[idx[j]] = ((sel[j>>6] >> (j&0x3f)) & 1);
+      free(sel);
+
+      sam_set_filter(sf,pass_bam_filter,((Handle *) v)->base);
+    }
+
+  ret = sam_index_select(sf,x,keep);
+
+  free(keep);
+  sam_index_free(x);
+  return (ret);
+}
+
+int evaluate_bax_filter(Filter *v, BaxData *b, SubRead *s)
+{ int x[NUM_VARS];
+
+  (void) b;
+  x[OP_ZM-OP_ZM]  = s->well;
+  x[OP_LN-OP_ZM]  = s->lpulse - s->fpulse;
+  x[OP_RQ-OP_ZM]  = s->qv;
+  x[OP_BC1-OP_ZM] = -1;
+  x[OP_BC2-OP_ZM] = -1;
+  x[OP_BQ-OP_ZM]  = -1;
+  x[OP_NP-OP_ZM]  = -1;
+  x[OP_QS-OP_ZM]  = s->fpulse;
+  return (tally((Handle *) v,BAX_CODE,x));
+}
+
+#define BAX_BLOCK 1024   //  # of subreads whose fields are gathered into columns at a time
+
+int evaluate_bax_batch(Filter *v, SubRead *s, int n, uint64 *sel)
+{ int  well[BAX_BLOCK], len[BAX_BLOCK], qv[BAX_BLOCK], beg[BAX_BLOCK];
+  int *col[FILTER_VARS];
+  int  i, k, m, cnt;
+
+  col[FILTER_ZM]  = well;
+  col[FILTER_LN]  = len;
+  col[FILTER_RQ]  = qv;
+  col[FILTER_BC1] = NULL;
+  col[FILTER_BC2] = NULL;
+  col[FILTER_BQ]  = NULL;
+  col[FILTER_NP]  = NULL;
+  col[FILTER_QS]  = beg;
+
+  cnt = 0;
+  for (k = 0; k < n; k += BAX_BLOCK)
+    { m = n-k;
+      if (m > BAX_BLOCK)
+        m = BAX_BLOCK;
+      for (i = 0; i < m; i++)
+        { well[i] = s[k+i].well;
+          len[i]  = s[k+i].lpulse - s[k+i].fpulse;
+          qv[i]   = s[k+i].qv;
+          beg[i]  = s[k+i].fpulse;
+        }
+      cnt += evaluate_filter_batch(v,1,m,col,sel+(k>>6));
+    }
+  return (cnt);
+}
+
+#ifdef FILTER_CHECK
+
+  //  make filter_check: evaluate each expression below in batches over random columns of
+  //    various lengths, and over random bax subreads, and check that every selection bit
+  //    and count agrees with the one-record-at-a-time evaluator (on a watched handle for
+  //    bax), and that both agree with the parsed tree evaluated directly (which checks the
+  //    folding for each source).
+
+static char *FC_Expr[] =
+  { "ln>=500 && rq>=750",
+    "ln<1000 || rq>800",
+    "zm>=500 && ln!=7",
+    "zm==17 || ln<=100 || rq>=999",
+    "(ln>=500 && rq>=750) || (zm>900 && qs>=2500)",
+    "bc1==bc2 && bq>=50",
+    "bc1<bc2 || np>10 || bq<=20",
+    "ln>qs && (rq<500 || zm>=100)",
+    "(ln<500 || 750>rq) && (zm!=3 || 1==1) && 3<=zm",
+    "np>=5 && (bc1==1 || bc2==2) && ln>=100",
+    "ln>=500 && bc1==5",
+    "ln>=500 || bq<=0",
+    "rq>800 || 1<2",
+    "ln>1000 && 2<1 || zm<10",
+    NULL
+  };
+
+static int FC_Len[] = { 1, 5, 63, 64, 65, 128, 200, 1000, 1023, 1024, 1025, 4097 };
+
+#define FC_MAX 4097
+
+static int fc_rand(int n)
+{ return ((int) (drand48()*n)); }
+
+static int fc_eval(Node *v, int *x)
+{ int a, b;
+
+  switch (v->op)
   { case OP_OR:
-      return (eval_X(v->lft) || eval_X(v->rgt));
+      return (fc_eval(v->lft,x) || fc_eval(v->rgt,x));
     case OP_AND:
-      return (eval_X(v->lft) && eval_X(v->rgt));
+      return (fc_eval(v->lft,x) && fc_eval(v->rgt,x));
     case OP_NOT:
-      return ( ! eval_X(v->lft));
-    case OP_LT:
-      return (eval_X(v->lft) < eval_X(v->rgt));
-    case OP_LE:
-      return (eval_X(v->lft) <= eval_X(v->rgt));
-    case OP_GT:
-      return (eval_X(v->lft) > eval_X(v->rgt));
-    case OP_GE:
-      return (eval_X(v->lft) >= eval_X(v->rgt));
-    case OP_NE:
-      return (eval_X(v->lft) != eval_X(v->rgt));
-    case OP_EQ:
-      return (eval_X(v->lft) == eval_X(v->rgt));
-    case OP_INT:
-      return ((int) (int64) (v->lft));
-    case OP_ZM:
-      return (X_Record->well);
-    case OP_LN:
-      return (X_Record->lpulse - X_Record->fpulse);
-    case OP_RQ:
-      return (X_Record->qv);
-    case OP_BC1:
-      return (-1);
-    case OP_BC2:
-      return (-1);
-    case OP_BQ:
-      return (-1);
-    case OP_NP:
-      return (-1);
-    case OP_QS:
-      return (X_Record->fpulse);
+      return ( ! fc_eval(v->lft,x));
+    default:
+      a = (IS_INT(v->lft) ? INT_OF(v->lft) : x[v->lft->op-OP_ZM]);
+      b = (IS_INT(v->rgt) ? INT_OF(v->rgt) : x[v->rgt->op-OP_ZM]);
+      return (compare(v->op,a,b));
   }
-  return (0);
 }
 
-int evaluate_bax_filter(Filter *v, BaxData *b, SubRead *s)
-{ X_Record = s;
-  X_Data   = b;
-  return (eval_X((Node *) v));
+int main()
+{ static int     val[FILTER_VARS][FC_MAX];
+  static SubRead sub[FC_MAX];
+  static uint64  sel[FC_MAX/64+1];
+  static int     range[FILTER_VARS] = { 1000, 20000, 1001, 4, 4, 101, 21, 5000 };
+  Filter  *f, *w;
+  Program *p;
+  int     *col[FILTER_VARS];
+  int      x[NUM_VARS];
+  int      e, l, i, k, n, cnt, scnt, bad, fail;
+
+  Prog_Name = "filter_check";
+  srand48(20161031);
+  for (k = 0; k < FILTER_VARS; k++)
+    col[k] = val[k];
+
+  fail = 0;
+  for (e = 0; FC_Expr[e] != NULL; e++)
+    { f = parse_filter(FC_Expr[e]);
+      if (f == NULL || (w = watch_filter(f)) == NULL)
+        exit (1);
+      p = ((Handle *) f)->prog;
+      bad = 0;
+      for (l = 0; l < (int) (sizeof(FC_Len)/sizeof(int)); l++)
+        { n = FC_Len[l];
+
+          for (i = 0; i < n; i++)
+            for (k = 0; k < FILTER_VARS; k++)
+              val[k][i] = fc_rand(range[k]);
+          cnt  = evaluate_filter_batch(f,0,n,col,sel);
+          scnt = 0;
+          for (i = 0; i < n; i++)
+            { for (k = 0; k < FILTER_VARS; k++)
+                x[k] = val[k][i];
+              k = run(p->code[BAM_CODE],x);
+              scnt += k;
+              if (k != (int) ((sel[i>>6] >> (i&0x3f)) & 0x1) || k != fc_eval(p->tree,x))
+                bad = 1;
+            }
+          if (cnt != scnt)
+            bad = 1;
+
+          for (i = 0; i < n; i++)
+            { sub[i].well   = fc_rand(range[FILTER_ZM]);
+              sub[i].fpulse = fc_rand(range[FILTER_QS]);
+              sub[i].lpulse = sub[i].fpulse + fc_rand(range[FILTER_LN]);
+              sub[i].qv     = fc_rand(range[FILTER_RQ]);
+            }
+          cnt  = evaluate_bax_batch(f,sub,n,sel);
+          scnt = 0;
+          for (i = 0; i < n; i++)
+            { x[FILTER_ZM]  = sub[i].well;
+              x[FILTER_LN]  = sub[i].lpulse - sub[i].fpulse;
+              x[FILTER_RQ]  = sub[i].qv;
+              x[FILTER_BC1] = x[FILTER_BC2] = x[FILTER_BQ] = x[FILTER_NP] = -1;
+              x[FILTER_QS]  = sub[i].fpulse;
+              k = evaluate_bax_filter(w,NULL,sub+i);
+              scnt += k;
+              if (k != (int) ((sel[i>>6] >> (i&0x3f)) & 0x1) || k != fc_eval(p->tree,x))
+                bad = 1;
+            }
+          if (cnt != scnt)
+            bad = 1;
+        }
+      if (bad)
+        { printf("  FAIL  batch evaluation of %s\n",FC_Expr[e]);
+          fail = 1;
+        }
+      else
+        printf("  ok    batch evaluation of %s\n",FC_Expr[e]);
+      free_filter(w);
+      free_filter(f);
+    }
+  exit (fail);
 }
+
+#endif
@@ -15,9 +15,83 @@
 
 typedef void *Filter;
 
+  // parse_filter: NULL => syntax error or out of memory (message sent), otherwise the filter
+  //   compiled for bam and for bax input.  Parsing is reentrant.  A filter is shared mutable
+  //   state: over the first 4096 records of each source the evaluators count the records
+  //   each predicate passes (npass) and those profiled (nsample), and the thread profiling
+  //   the last of them replaces the program (code) with one ordering the operands of each
+  //   && and || by these rates.  The counts are bumped with atomic adds, and the program is
+  //   swapped with an atomic release store read with acquire loads, the old one being kept,
+  //   so any number of threads may evaluate the same filter at once.  The order is set once,
+  //   on the first records a filter is given, and not revisited for later inputs.
+  //   free_filter frees a filter and all it holds, and so must only be called once no
+  //   thread evaluates it any longer.
+
 Filter *parse_filter(char *expr);
+void    free_filter(Filter *v);
+
+  // watch_filter: NULL => out of memory (message sent), otherwise a second handle on v that
+  //   evaluates exactly as v does but also counts the records and bases it is given, those
+  //   that pass, and those for which each top-level predicate (the operands of the outermost
+  //   && or || chain, or else the whole expression) is false, and an estimate of the time
+  //   spent evaluating (batches and the records profiled are timed, the single records
+  //   after that are sampled).  A watched handle must only be used by one thread at a time,
+  //   and free_filter on it frees just the handle and its counts, v living on.
+  //   reset_filter_stats zeroes the counts, print_filter_stats lists them as text, and
+  //   json_filter_stats writes them as one JSON object with input as its "input" member.
+  //   All three ignore unwatched handles.
+
+Filter *watch_filter(Filter *v);
+void    reset_filter_stats(Filter *v);
+void    print_filter_stats(Filter *v, FILE *out);
+void    json_filter_stats(Filter *v, char *input, FILE *out);
 
 int evaluate_bam_filter(Filter *v, samRecord *s);
+
+  // The fields of a samRecord that must be decoded to evaluate v: WANT_BC and/or WANT_NP
+
+int filter_wants(Filter *v);
+
 int evaluate_bax_filter(Filter *v, BaxData *b, SubRead *s);
 
+  // Batch evaluation of v on n subreads whose fields are given as the columns
+  //   col[FILTER_ZM..FILTER_QS], each of n ints with rq as 1000 times the read quality.
+  //   Columns v does not refer to may be NULL, as may bc1, bc2, bq, and np for bax input.
+  //   Bit i%64 of sel[i/64] is set iff subread i passes.  The # of subreads that pass is
+  //   returned.  evaluate_bax_batch does the same for the subreads s[0..n-1] of a bax.
+
+#define FILTER_ZM   0
+#define FILTER_LN   1
+#define FILTER_RQ   2
+#define FILTER_BC1  3
+#define FILTER_BC2  4
+#define FILTER_BQ   5
+#define FILTER_NP   6
+#define FILTER_QS   7
+#define FILTER_VARS 8
+
+int evaluate_filter_batch(Filter *v, int isbax, int n, int **col, uint64 *sel);
+int evaluate_bax_batch(Filter *v, SubRead *s, int n, uint64 *sel);
+
+  // A shard is a contiguous range of the wells of an input, either the part'th of nparts
+  //   slices of roughly equal size, or all wells with hole numbers in [lo,hi].
+  //   parse_shard accepts "<part>/<nparts>" or "<lo>-<hi>": 1 => error (message sent).
+
+typedef struct
+  { int part, nparts;   //  1 <= part <= nparts, or nparts = 0 if a hole range
+    int lo, hi;         //  hole number range if nparts = 0
+  } Shard;
+
+int parse_shard(char *arg, Shard *s);
+
+  // Restrict the extraction from sf to the records of shard s (if not NULL) that pass filter
+  //   v.  The reader tests each record on v before unpacking its sequence and streams (see
+  //   sam_set_filter), so the status given sam_record_extract must include filter_wants(v).
+  //   If sf is a bam file with a .pbi index then records are also selected on the index
+  //   and those not wanted are never read.  The filter is tested on the index only if it
+  //   holds every variable in v.  A shard given as a part requires an index.  To be called
+  //   after sam_header_process.  1 => error (message sent), 0 otherwise.
+
+int select_bam_filter(Filter *v, Shard *s, samFile *sf);
+
 #endif // _FILTER_EXPR
@@ -1,9 +1,10 @@
 /*******************************************************************************************
  *
  *  SAM/BAM reader & pacbio extractor
- *    Uses zlib file IO routines to read either SAM or BAM encoding and extracts just the
- *    information needed for by the Dazzler (sequence, fasta header, well, beg & end pulse,
- *    per base snr, and pulse width sequence).
+ *    Reads either SAM or BAM encoding and extracts just the information needed for by the
+ *    Dazzler (sequence, fasta header, well, beg & end pulse, per base snr, and pulse width
+ *    sequence).  The BGZF blocks of a BAM file are inflated by a pool of threads that run
+ *    ahead of the record parser.
  *
  *  Author:  Gene Myers
  *  Date  :  Oct. 9, 2016
@@ -14,7 +15,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <zlib.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define SIMD_UNPACK
+#endif
 
 #include "sam.h"
 #include "DB.h"
@@ -48,13 +59,12 @@ static void flip_double(void *w)
   SWAP(3,4);
 }
 
- // Universal data buffer for all routines
+ // Grow *buf to hold at least len bytes
 
-static uint8 *data = NULL;
-static int    dmax = 0;
+static int grow_buffer(uint8 **buf, int *max, int len)
+{ int dmax = *max;
 
-static int make_room(int len)
-{ if (len > dmax)
+  if (len > dmax)
     { if (dmax == 0)
         dmax = 8192;
       else
@@ -69,31 +79,718 @@ static int make_room(int len)
         { fprintf(stderr,"%s: More than MAX_INT memory requested ? Corrupt BAM?\n",Prog_Name);
           return (1);
         }
-      data = realloc(data,dmax);
-      if (data == NULL)
+      *buf = realloc(*buf,dmax);
+      if (*buf == NULL)
         { fprintf(stderr,"%s: Could not (re)allocate %d bytes of memory\n",Prog_Name,dmax);
           return (1);
         }
+      *max = dmax;
     }
   return (0);
 }
 
- // Universal sam Record for all routines
+ // Data buffer of a sam file for lines, the header, and stitched records
+
+static int make_room(samFile *sf, int len)
+{ return (grow_buffer(&sf->data,&sf->dmax,len)); }
 
-static samRecord theR;
-static int       rmax = 0;  //  maximum length for a sequence
+ // Ensure the record of a sam file can hold sequences of length len
 
-static int init_record(int len)
-{ if (len > rmax)
-    { if (rmax == 0)
-        theR.seq = NULL;
-      rmax = 1.2*len + 1000;
-      theR.seq = realloc(theR.seq,rmax);
-      if (theR.seq == NULL)
-        { fprintf(stderr,"%s: Could not (re)allocate %d bytes of memory\n",Prog_Name,2*rmax);
+static int init_record(samFile *sf, int len)
+{ samRecord *r = &sf->rec;
+  int        rmax;
+
+  if (len > sf->rmax)
+    { rmax   = 1.2*len + 1000;
+      r->seq = realloc(r->seq,7ll*rmax);
+      if (r->seq == NULL)
+        { fprintf(stderr,"%s: Could not (re)allocate %lld bytes of memory\n",Prog_Name,7ll*rmax);
           return (1);
         }
+      r->arr   = r->seq + rmax;
+      r->qv[0] = r->arr + rmax;
+      r->qv[1] = r->qv[0] + rmax;
+      r->qv[2] = r->qv[1] + rmax;
+      r->qv[3] = r->qv[2] + rmax;
+      r->qv[4] = r->qv[3] + rmax;
+      sf->rmax = rmax;
+    }
+  return (0);
+}
+
+
+/*******************************************************************************************
+ *
+ *  BUFFERED INPUT
+ *
+ ********************************************************************************************/
+
+static int In_Buffer = 0x400000;   //  size of each of the two read-ahead buffers
+
+void sam_set_buffer(int mbytes)
+{ In_Buffer = mbytes * 0x100000; }
+
+  //  While the caller consumes buf, a reader thread fills nbuf with the next In_Buffer bytes
+  //    of the file so that disk latency overlaps with inflation and parsing.
+
+typedef struct
+  { int    fd;     //  file descriptor
+    uint8 *buf;    //  buffer being consumed
+    int    bpos;   //  next unread byte of buf
+    int    blen;   //  # of bytes in buf
+    int64  fpos;   //  file offset of buf[0]
+    int    bsize;  //  size of buf and nbuf
+
+    uint8 *nbuf;   //  buffer being read ahead
+    int    nlen;   //  # of bytes in nbuf (0 => eof, -1 => error)
+    int64  noff;   //  file offset of nbuf[0]
+    int    want;   //  reader has been asked to fill nbuf
+    int    full;   //  nbuf has been filled
+    int    stop;   //  reader should exit
+
+    pthread_t       reader;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+  } InFile;
+
+  //  Read up to n bytes into buf: # read (< n only at eof) or -1 on error
+
+static int read_fully(int fd, uint8 *buf, int n)
+{ int m, r;
+
+  m = 0;
+  while (m < n)
+    { r = read(fd,buf+m,n-m);
+      if (r < 0)
+        { if (errno == EINTR)
+            continue;
+          return (-1);
+        }
+      if (r == 0)
+        break;
+      m += r;
+    }
+  return (m);
+}
+
+static void *in_reader(void *arg)
+{ InFile *in = (InFile *) arg;
+  int     n;
+
+  pthread_mutex_lock(&in->lock);
+  while (1)
+    { while ( ! in->want && ! in->stop)
+        pthread_cond_wait(&in->cond,&in->lock);
+      if (in->stop)
+        break;
+      pthread_mutex_unlock(&in->lock);
+
+      n = read_fully(in->fd,in->nbuf,in->bsize);
+
+      pthread_mutex_lock(&in->lock);
+      in->nlen = n;
+      in->want = 0;
+      in->full = 1;
+      pthread_cond_broadcast(&in->cond);
+    }
+  pthread_mutex_unlock(&in->lock);
+  return (NULL);
+}
+
+  //  Ask the reader to fill nbuf from file offset off (the fd must be positioned there)
+
+static void in_request(InFile *in, int64 off)
+{ in->noff = off;
+  in->full = 0;
+  in->want = 1;
+  pthread_cond_broadcast(&in->cond);
+}
+
+static InFile *in_open(char *name)
+{ InFile *in;
+
+  in = (InFile *) malloc(sizeof(InFile));
+  if (in == NULL)
+    return (NULL);
+  in->bsize = In_Buffer;
+  in->buf   = (uint8 *) malloc(2*((size_t) in->bsize));
+  if (in->buf == NULL)
+    { free(in);
+      return (NULL);
+    }
+  in->nbuf = in->buf + in->bsize;
+  if (strcmp(name,"-") == 0)
+    in->fd = STDIN_FILENO;
+  else
+    in->fd = open(name,O_RDONLY);
+  if (in->fd < 0)
+    { free(in->buf);
+      free(in);
+      return (NULL);
+    }
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(in->fd,0,0,POSIX_FADV_SEQUENTIAL);
+#endif
+  in->bpos = 0;
+  in->blen = 0;
+  in->fpos = 0;
+  in->stop = 0;
+  pthread_mutex_init(&in->lock,NULL);
+  pthread_cond_init(&in->cond,NULL);
+  in_request(in,0);
+  if (pthread_create(&in->reader,NULL,in_reader,in) != 0)
+    { pthread_cond_destroy(&in->cond);
+      pthread_mutex_destroy(&in->lock);
+      if (in->fd != STDIN_FILENO)
+        close(in->fd);
+      free(in->buf);
+      free(in);
+      return (NULL);
+    }
+  return (in);
+}
+
+static void in_close(InFile *in)
+{ pthread_mutex_lock(&in->lock);
+  in->stop = 1;
+  pthread_cond_broadcast(&in->cond);
+  pthread_mutex_unlock(&in->lock);
+  pthread_join(in->reader,NULL);
+  pthread_cond_destroy(&in->cond);
+  pthread_mutex_destroy(&in->lock);
+  if (in->fd != STDIN_FILENO)
+    close(in->fd);
+  free(in->buf < in->nbuf ? in->buf : in->nbuf);
+  free(in);
+}
+
+  //  Refill the buffer: 1 => more data, 0 => eof, -1 => error
+
+static int in_fill(InFile *in)
+{ uint8 *x;
+  int    n;
+
+  pthread_mutex_lock(&in->lock);
+  while ( ! in->full)
+    pthread_cond_wait(&in->cond,&in->lock);
+  n = in->nlen;
+  if (n > 0)
+    { x        = in->buf;
+      in->buf  = in->nbuf;
+      in->nbuf = x;
+      in->fpos = in->noff;
+      in->bpos = 0;
+      in->blen = n;
+      in_request(in,in->noff + n);
+    }
+  pthread_mutex_unlock(&in->lock);
+  if (n < 0)
+    return (-1);
+  return (n > 0);
+}
+
+  //  Read n bytes into dst, return # of bytes read (< n only at eof), -1 on error
+
+static int in_read(InFile *in, uint8 *dst, int n)
+{ int k, m, r;
+
+  m = 0;
+  while (m < n)
+    { if (in->bpos >= in->blen)
+        { r = in_fill(in);
+          if (r < 0)
+            return (-1);
+          if (r == 0)
+            break;
+        }
+      k = in->blen - in->bpos;
+      if (k > n-m)
+        k = n-m;
+      memcpy(dst+m,in->buf+in->bpos,k);
+      in->bpos += k;
+      m += k;
+    }
+  return (m);
+}
+
+  //  Return next byte without consuming it, EOF at end of file or on an error
+
+static int in_peek(InFile *in)
+{ if (in->bpos >= in->blen && in_fill(in) <= 0)
+    return (EOF);
+  return (in->buf[in->bpos]);
+}
+
+  //  File offset of the next unread byte
+
+static int64 in_tell(InFile *in)
+{ return (in->fpos + in->bpos); }
+
+  //  Make the byte at file offset off the next one read: 0 => OK, -1 => error.  Any
+  //    read-ahead is discarded once the reader is idle.
+
+static int in_seek(InFile *in, int64 off)
+{ int ret;
+
+  if (off >= in->fpos && off <= in->fpos + in->blen)
+    { in->bpos = off - in->fpos;
+      return (0);
+    }
+  pthread_mutex_lock(&in->lock);
+  while (in->want)
+    pthread_cond_wait(&in->cond,&in->lock);
+  if (in->full && in->nlen > 0 && off >= in->noff && off < in->noff + in->nlen)
+    { pthread_mutex_unlock(&in->lock);
+      if (in_fill(in) < 0)
+        return (-1);
+      in->bpos = off - in->fpos;
+      return (0);
+    }
+  if (lseek(in->fd,off,SEEK_SET) < 0)
+    ret = -1;
+  else
+    { ret = 0;
+      in->fpos = off;
+      in->bpos = 0;
+      in->blen = 0;
+      in_request(in,off);
+    }
+  pthread_mutex_unlock(&in->lock);
+  return (ret);
+}
+
+/*******************************************************************************************
+ *
+ *  BGZF BLOCK READER
+ *    A BAM file is a series of independently deflated blocks each of at most 64KB.  Blocks
+ *    are read in order from the input into a ring of buffers where a pool of worker threads
+ *    inflates them.  The parser consumes the ring in order, releasing each block for reuse
+ *    once it has moved past it.  With fewer than 2 threads blocks are read and inflated
+ *    on demand by the parser itself.
+ *
+ ********************************************************************************************/
+
+#define BGZF_MAX_BLOCK 0x10000
+
+#define BLOCK_BUSY   0   //  read, not yet inflated
+#define BLOCK_READY  1   //  inflated
+#define BLOCK_FAILED 2   //  corrupt
+
+typedef struct
+  { int64  coff;     //  file offset of the block
+    uint8 *cdata;    //  compressed block including header and trailer
+    int    csize;    //  size of compressed block
+    int    hsize;    //  size of its gzip header
+    uint8 *udata;    //  inflated block
+    int    usize;    //  size of inflated block
+    int    state;    //  BLOCK_BUSY, BLOCK_READY, or BLOCK_FAILED
+  } Block;
+
+typedef struct
+  { InFile         *in;        //  compressed input
+    int             nthreads;  //  # of inflating threads (0 => synchronous)
+    int             nblock;    //  # of blocks in ring
+    Block          *block;     //  ring of blocks
+    int64           nread;     //  # of blocks read from input
+    int64           nused;     //  # of blocks released by the parser
+    int             ieof;      //  input exhausted (1) or unreadable (-1)
+    int             quit;      //  workers should exit
+    pthread_t      *thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  ready;     //  a block has been inflated or input is exhausted
+    pthread_cond_t  freed;     //  a block has been released
+    z_stream        zs;        //  inflater for synchronous mode
+    Block          *cur;       //  block being parsed, NULL if none
+    int             upos;      //  parse position in cur
+    uint8          *sbuf;      //  buffer for stitching data that straddles blocks
+    int             smax;      //  current size of sbuf
+    int64          *range;     //  if not NULL, only read blocks in [range[2i],range[2i+1])
+    int             nrange;    //  # of ranges
+    int             rnext;     //  first range not yet passed by the input
+  } BGZF;
+
+  //  Read the next block (in the next range if any) from the input: 0 => OK, 1 => eof,
+  //    -1 => error
+
+static int bgzf_fetch(BGZF *bg, Block *b)
+{ InFile *in = bg->in;
+  uint8  *h, *p, *e;
+  int     n, xlen, slen, bsize;
+
+  if (bg->range != NULL)
+    { int64 pos = in_tell(in);
+
+      while (bg->rnext < bg->nrange && pos >= bg->range[2*bg->rnext+1])
+        bg->rnext += 1;
+      if (bg->rnext >= bg->nrange)
+        return (1);
+      if (pos < bg->range[2*bg->rnext] && in_seek(in,bg->range[2*bg->rnext]))
+        return (-1);
+    }
+
+  b->coff = in_tell(in);
+  h = b->cdata;
+  n = in_read(in,h,12);
+  if (n == 0)
+    return (1);
+  if (n != 12 || h[0] != 31 || h[1] != 139 || h[2] != 8 || (h[3] & 0x4) == 0)
+    return (-1);
+
+  xlen = h[10] | (h[11] << 8);
+  if (in_read(in,h+12,xlen) != xlen)
+    return (-1);
+  bsize = -1;
+  e = h+12+xlen;
+  for (p = h+12; p+4 <= e; p += 4+slen)
+    { slen = p[2] | (p[3] << 8);
+      if (p[0] == 'B' && p[1] == 'C' && slen == 2 && p+6 <= e)
+        bsize = (p[4] | (p[5] << 8)) + 1;
+    }
+  n = bsize - (12+xlen);
+  if (bsize < 0 || n < 8)
+    return (-1);
+  if (in_read(in,e,n) != n)
+    return (-1);
+
+  b->csize = bsize;
+  b->hsize = 12+xlen;
+  return (0);
+}
+
+  //  Inflate a block and check its length and CRC: 0 => OK, 1 => corrupt
+
+static int bgzf_inflate(Block *b, z_stream *zs)
+{ uint8 *t;
+  uint32 crc, isize;
+
+  t     = b->cdata + (b->csize-8);
+  crc   = t[0] | (t[1] << 8) | (t[2] << 16) | (((uint32) t[3]) << 24);
+  isize = t[4] | (t[5] << 8) | (t[6] << 16) | (((uint32) t[7]) << 24);
+  if (isize > BGZF_MAX_BLOCK)
+    return (1);
+
+  if (inflateReset(zs) != Z_OK)
+    return (1);
+  zs->next_in   = b->cdata + b->hsize;
+  zs->avail_in  = b->csize - (b->hsize+8);
+  zs->next_out  = b->udata;
+  zs->avail_out = BGZF_MAX_BLOCK;
+  if (inflate(zs,Z_FINISH) != Z_STREAM_END || zs->total_out != isize)
+    return (1);
+  if (crc32(crc32(0L,Z_NULL,0),b->udata,isize) != crc)
+    return (1);
+
+  b->usize = isize;
+  return (0);
+}
+
+static void *bgzf_worker(void *arg)
+{ BGZF    *bg = (BGZF *) arg;
+  z_stream zs;
+  Block   *b;
+  int      ret;
+
+  memset(&zs,0,sizeof(z_stream));
+  if (inflateInit2(&zs,-15) != Z_OK)
+    { pthread_mutex_lock(&bg->lock);
+      bg->ieof = -1;
+      pthread_cond_broadcast(&bg->ready);
+      pthread_mutex_unlock(&bg->lock);
+      return (NULL);
+    }
+
+  pthread_mutex_lock(&bg->lock);
+  while (1)
+    { while ( ! bg->quit && (bg->ieof != 0 || bg->nread >= bg->nused + bg->nblock))
+        pthread_cond_wait(&bg->freed,&bg->lock);
+      if (bg->quit)
+        break;
+
+      b   = bg->block + bg->nread % bg->nblock;
+      ret = bgzf_fetch(bg,b);
+      if (ret != 0)
+        { bg->ieof = (ret > 0 ? 1 : -1);
+          pthread_cond_broadcast(&bg->ready);
+          continue;
+        }
+      b->state   = BLOCK_BUSY;
+      bg->nread += 1;
+      pthread_mutex_unlock(&bg->lock);
+
+      ret = bgzf_inflate(b,&zs);
+
+      pthread_mutex_lock(&bg->lock);
+      b->state = (ret ? BLOCK_FAILED : BLOCK_READY);
+      pthread_cond_broadcast(&bg->ready);
+    }
+  pthread_mutex_unlock(&bg->lock);
+
+  inflateEnd(&zs);
+  return (NULL);
+}
+
+static void bgzf_close(BGZF *bg)
+{ int i;
+
+  if (bg->nthreads > 0)
+    { pthread_mutex_lock(&bg->lock);
+      bg->quit = 1;
+      pthread_cond_broadcast(&bg->freed);
+      pthread_mutex_unlock(&bg->lock);
+      for (i = 0; i < bg->nthreads; i++)
+        pthread_join(bg->thread[i],NULL);
+      free(bg->thread);
+      pthread_cond_destroy(&bg->freed);
+      pthread_cond_destroy(&bg->ready);
+      pthread_mutex_destroy(&bg->lock);
+    }
+  else
+    inflateEnd(&bg->zs);
+  free(bg->range);
+  free(bg->sbuf);
+  free(bg->block[0].cdata);
+  free(bg->block);
+  if (bg->in != NULL)
+    in_close(bg->in);
+  free(bg);
+}
+
+static BGZF *bgzf_open(InFile *in, int nthreads)
+{ BGZF  *bg;
+  uint8 *buf;
+  int    i;
+
+  bg = (BGZF *) malloc(sizeof(BGZF));
+  if (bg == NULL)
+    return (NULL);
+
+  if (nthreads <= 1)
+    nthreads = 0;
+  bg->in       = in;
+  bg->nthreads = nthreads;
+  bg->nblock   = (nthreads > 0 ? 4*nthreads : 1);
+  bg->nread    = 0;
+  bg->nused    = 0;
+  bg->ieof     = 0;
+  bg->quit     = 0;
+  bg->cur      = NULL;
+  bg->upos     = 0;
+  bg->sbuf     = NULL;
+  bg->smax     = 0;
+  bg->range    = NULL;
+  bg->nrange   = 0;
+  bg->rnext    = 0;
+
+  bg->block = (Block *) malloc(sizeof(Block)*bg->nblock);
+  buf = (uint8 *) malloc(2ll*BGZF_MAX_BLOCK*bg->nblock);
+  if (bg->block == NULL || buf == NULL)
+    { free(buf);
+      free(bg->block);
+      free(bg);
+      return (NULL);
+    }
+  for (i = 0; i < bg->nblock; i++)
+    { bg->block[i].cdata = buf;
+      bg->block[i].udata = buf + BGZF_MAX_BLOCK;
+      buf += 2*BGZF_MAX_BLOCK;
+    }
+
+  if (nthreads == 0)
+    { memset(&bg->zs,0,sizeof(z_stream));
+      if (inflateInit2(&bg->zs,-15) != Z_OK)
+        goto error;
+      return (bg);
+    }
+
+  bg->thread = (pthread_t *) malloc(sizeof(pthread_t)*nthreads);
+  if (bg->thread == NULL)
+    goto error;
+  pthread_mutex_init(&bg->lock,NULL);
+  pthread_cond_init(&bg->ready,NULL);
+  pthread_cond_init(&bg->freed,NULL);
+  for (i = 0; i < nthreads; i++)
+    if (pthread_create(bg->thread+i,NULL,bgzf_worker,bg) != 0)
+      break;
+
+  //  If not all the workers could be started make do with those that were, or if none
+  //    then inflate serially
+
+  if (i == 0)
+    { pthread_cond_destroy(&bg->freed);
+      pthread_cond_destroy(&bg->ready);
+      pthread_mutex_destroy(&bg->lock);
+      free(bg->thread);
+      bg->nthreads = 0;
+      memset(&bg->zs,0,sizeof(z_stream));
+      if (inflateInit2(&bg->zs,-15) != Z_OK)
+        goto error;
+    }
+  else
+    bg->nthreads = i;
+  return (bg);
+
+error:
+  free(bg->block[0].cdata);
+  free(bg->block);
+  free(bg);
+  return (NULL);
+}
+
+  //  Release the current block and make the next one current: 1 => OK, 0 => eof, -1 => error
+
+static int bgzf_next(BGZF *bg)
+{ Block *b;
+  int    ret;
+
+  if (bg->nthreads == 0)
+    { b   = bg->block;
+      ret = bgzf_fetch(bg,b);
+      if (ret > 0)
+        { bg->cur = NULL;
+          return (0);
+        }
+      if (ret < 0 || bgzf_inflate(b,&bg->zs))
+        goto corrupt;
     }
+
+  else
+    { pthread_mutex_lock(&bg->lock);
+      if (bg->cur != NULL)
+        { bg->cur    = NULL;
+          bg->nused += 1;
+          pthread_cond_broadcast(&bg->freed);
+        }
+      b = bg->block + bg->nused % bg->nblock;
+      while (bg->nread > bg->nused ? b->state == BLOCK_BUSY : bg->ieof == 0)
+        pthread_cond_wait(&bg->ready,&bg->lock);
+      ret = (bg->nread > bg->nused ? b->state : bg->ieof);
+      pthread_mutex_unlock(&bg->lock);
+
+      if (ret == BLOCK_FAILED || ret < 0)
+        goto corrupt;
+      if (bg->nread <= bg->nused)
+        return (0);
+    }
+
+  bg->cur  = b;
+  bg->upos = 0;
+  return (1);
+
+corrupt:
+  fprintf(stderr,"%s: Corrupted or truncated BGZF block\n",Prog_Name);
+  return (-1);
+}
+
+  //  Read n bytes into dst, return # of bytes read (< n only at eof), -1 on error
+
+static int bgzf_read(BGZF *bg, uint8 *dst, int n)
+{ int k, m, r;
+
+  m = 0;
+  while (m < n)
+    { if (bg->cur == NULL || bg->upos >= bg->cur->usize)
+        { r = bgzf_next(bg);
+          if (r < 0)
+            return (-1);
+          if (r == 0)
+            break;
+          continue;
+        }
+      k = bg->cur->usize - bg->upos;
+      if (k > n-m)
+        k = n-m;
+      memcpy(dst+m,bg->cur->udata+bg->upos,k);
+      bg->upos += k;
+      m += k;
+    }
+  return (m);
+}
+
+  //  Return a pointer to the next n bytes.  If they lie within the current block then the
+  //    pointer is into the block itself, otherwise they are stitched together in sbuf.
+  //    NULL => eof or error (*err = 0 for a clean eof)
+
+static uint8 *bgzf_span(BGZF *bg, int n, int *err)
+{ uint8 *p;
+  int    k, m, r;
+
+  *err = 0;
+  if (bg->cur != NULL && bg->cur->usize - bg->upos >= n)
+    { p = bg->cur->udata + bg->upos;
+      bg->upos += n;
+      return (p);
+    }
+
+  if (grow_buffer(&bg->sbuf,&bg->smax,n))
+    { *err = 1;
+      return (NULL);
+    }
+  m = 0;
+  while (m < n)
+    { if (bg->cur == NULL || bg->upos >= bg->cur->usize)
+        { r = bgzf_next(bg);
+          if (r <= 0)
+            { *err = (r < 0 || m > 0);
+              return (NULL);
+            }
+          if (m == 0 && bg->cur->usize >= n)
+            { bg->upos = n;
+              return (bg->cur->udata);
+            }
+          continue;
+        }
+      k = bg->cur->usize - bg->upos;
+      if (k > n-m)
+        k = n-m;
+      memcpy(bg->sbuf+m,bg->cur->udata+bg->upos,k);
+      bg->upos += k;
+      m += k;
+    }
+  return (bg->sbuf);
+}
+
+  //  Henceforth only read blocks in the nrange ranges of file offsets in range, which the
+  //    reader takes ownership of
+
+static void bgzf_plan(BGZF *bg, int64 *range, int nrange)
+{ if (bg->nthreads > 0)
+    pthread_mutex_lock(&bg->lock);
+  free(bg->range);
+  bg->range  = range;
+  bg->nrange = nrange;
+  bg->rnext  = 0;
+  if (bg->nthreads > 0)
+    pthread_mutex_unlock(&bg->lock);
+}
+
+  //  Position the parser at virtual offset voff, i.e. byte voff & 0xffff of the block at file
+  //    offset voff >> 16, skipping over any blocks in between: 0 => OK, 1 => error
+
+static int bgzf_seek(BGZF *bg, int64 voff)
+{ int64 coff;
+  int   uoff, r;
+
+  coff = (voff >> 16);
+  uoff = (voff & 0xffff);
+  while (bg->cur == NULL || bg->cur->coff < coff)
+    { r = bgzf_next(bg);
+      if (r < 0)
+        return (1);
+      if (r == 0)
+        break;
+    }
+  if (bg->cur == NULL || bg->cur->coff != coff || uoff > bg->cur->usize)
+    { fprintf(stderr,"%s: Index offset does not match a BAM record, stale .pbi?\n",Prog_Name);
+      return (1);
+    }
+  bg->upos = uoff;
+  return (0);
+}
+
+static int bgzf_eof(BGZF *bg)
+{ while (bg->cur == NULL || bg->upos >= bg->cur->usize)
+    if (bgzf_next(bg) <= 0)
+      return (1);
   return (0);
 }
 
@@ -104,9 +801,12 @@ static int init_record(int len)
  *
  ********************************************************************************************/
 
-samFile *sam_open(char *name)
+  //  Input whose first two bytes are the gzip magic number is taken to be BGZF compressed,
+  //    i.e. BAM, anything else is taken to be SAM text.
+
+samFile *sam_open(char *name, int nthreads)
 { samFile  *sf;
-  gzFile    ptr = NULL;
+  InFile   *in = NULL;
   int       one  = 1;
 
   sf = (samFile *) malloc(sizeof(samFile));
@@ -117,76 +817,144 @@ samFile *sam_open(char *name)
   if (sf->name == NULL)
     goto error;
 
-  if (strcmp(name,"-") == 0)
-    ptr = gzdopen(fileno(stdin),"r");
-  else
-    ptr = gzopen(name,"r");
-  if (ptr == NULL)
+  in = in_open(name);
+  if (in == NULL)
     goto error;
-  gzbuffer(ptr,0x10000);
 
-  if (gzdirect(ptr))
-    sf->format = sam;
+  if (in_peek(in) == 31 && (in->blen - in->bpos < 2 || in->buf[in->bpos+1] == 139))
+    { sf->format = bam;
+      sf->ptr    = bgzf_open(in,nthreads);
+      if (sf->ptr == NULL)
+        goto error;
+    }
   else
-    sf->format = bam;
+    { sf->format = sam;
+      sf->ptr    = in;
+    }
 
-  sf->ptr    = ptr;
-  sf->is_big = ( *((char *) (&one)) == 0);
-  sf->nline  = 0;
+  sf->is_big   = ( *((char *) (&one)) == 0);
+  sf->nline    = 0;
+  sf->data     = NULL;
+  sf->dmax     = 0;
+  sf->rec.seq  = NULL;
+  sf->rmax     = 0;
+  sf->seq_conv = NULL;
+  sf->arr_conv = 0;
+  sf->sel      = NULL;
+  sf->nsel     = 0;
+  sf->snext    = 0;
+  sf->wlo      = 1;
+  sf->whi      = 0;
+  sf->keep     = NULL;
+  sf->karg     = NULL;
 
   return (sf);
 
 error:
   free(sf->name);
   free(sf);
-  if (ptr != NULL)
-    gzclose(ptr);
+  if (in != NULL)
+    in_close(in);
   return (NULL);
 }
 
 int sam_eof(samFile *sf)
-{ int c;
-
-  c = gzgetc(sf->ptr);
-  gzungetc(c,sf->ptr);
-  return (c < 0);
+{ if (sf->sel != NULL)
+    return (sf->snext >= sf->nsel);
+  if (sf->format == bam)
+    return (bgzf_eof((BGZF *) sf->ptr));
+  else
+    return (in_peek((InFile *) sf->ptr) == EOF);
 }
 
 int sam_close(samFile *sf)
-{ int ret;
-
-  ret = gzclose(sf->ptr);
+{ if (sf->format == bam)
+    bgzf_close((BGZF *) sf->ptr);
+  else
+    in_close((InFile *) sf->ptr);
+  free(sf->sel);
+  free(sf->rec.seq);
+  free(sf->data);
   free(sf->name);
   free(sf);
-  return (ret != Z_OK);
+  return (0);
 }
 
+  //  Append the next line to sf->data[0..clen-1]: new length => OK, 0 => eof, -1 => error
+
 static int sam_getline(samFile *sf, int clen)
-{ gzFile file = sf->ptr;
+{ InFile *in = (InFile *) sf->ptr;
+  uint8  *p, *e;
+  int     k, r, olen;
 
   ++sf->nline;
 
-  if (make_room(8192))
-    return (-1);
-  while (gzgets(file,(char *) (data+clen),dmax-clen) != NULL)
-    { clen += strlen((char *) (data+clen));
-      if (data[clen-1] == '\n')
-        return (clen);
-      dmax *= 2;
-      data = realloc(data,dmax);
-      if (data == NULL)
-        { fprintf(stderr,"%s: Could not (re)allocate %d bytes of memory\n",Prog_Name,dmax);
-          return (-1);
+  olen = clen;
+  while (1)
+    { if (in->bpos >= in->blen)
+        { r = in_fill(in);
+          if (r < 0)
+            { fprintf(stderr,"%s: Could not get a line from %s\n",Prog_Name,sf->name);
+              return (-1);
+            }
+          if (r == 0)
+            { if (clen == olen)
+                return (0);
+              if (make_room(sf,clen+2))
+                return (-1);
+              sf->data[clen++] = '\n';
+              sf->data[clen]   = '\0';
+              return (clen);
+            }
+        }
+      p = in->buf + in->bpos;
+      k = in->blen - in->bpos;
+      e = memchr(p,'\n',k);
+      if (e != NULL)
+        k = (e-p)+1;
+      if (make_room(sf,clen+k+1))
+        return (-1);
+      memcpy(sf->data+clen,p,k);
+      in->bpos += k;
+      clen     += k;
+      if (e != NULL)
+        { sf->data[clen] = '\0';
+          return (clen);
         }
-    }
-  if (gzeof(file))
-    return (0);
-  else
-    { fprintf(stderr,"%s: Could not get a line from %s\n",Prog_Name,sf->name);
-      return (-1);
     }
 }
 
+  //  Return the next line as a '\0'-terminated string (its '\n' is overwritten), and its
+  //    length in *len.  A line wholly within the input buffer is parsed in place, only one
+  //    straddling a buffer boundary is copied to sf->data.  NULL => eof (*len = 0) or
+  //    error (*len = -1).
+
+static char *sam_nextline(samFile *sf, int *len)
+{ InFile *in = (InFile *) sf->ptr;
+  uint8  *p, *e;
+  int     clen;
+
+  if (in->bpos < in->blen)
+    { p = in->buf + in->bpos;
+      e = memchr(p,'\n',in->blen - in->bpos);
+      if (e != NULL)
+        { ++sf->nline;
+          *e = '\0';
+          in->bpos += (e-p)+1;
+          *len = e-p;
+          return ((char *) p);
+        }
+    }
+
+  clen = sam_getline(sf,0);
+  if (clen <= 0)
+    { *len = clen;
+      return (NULL);
+    }
+  sf->data[--clen] = '\0';
+  *len = clen;
+  return ((char *) sf->data);
+}
 
 /*******************************************************************************************
  *
@@ -195,7 +963,7 @@ static int sam_getline(samFile *sf, int clen)
  ********************************************************************************************/
 
 static int bam_header_read(samFile *sf)
-{ gzFile file = sf->ptr;
+{ BGZF   *file = (BGZF *) sf->ptr;
   int     nlen, ncnt, tlen;
   int     i;
 
@@ -204,7 +972,7 @@ static int bam_header_read(samFile *sf)
   { int  ret;
     char buf[4];
 
-    ret = gzread(file, buf, 4);
+    ret = bgzf_read(file, (uint8 *) buf, 4);
     if (ret != 4 || strncmp(buf, "BAM\1", 4) != 0)
       { fprintf(stderr, "%s: Corrupted BAM header\n",Prog_Name);
         return (1);
@@ -213,20 +981,20 @@ static int bam_header_read(samFile *sf)
 
   // read plain text
 
-  if (gzread(file, &tlen, 4) != 4)
+  if (bgzf_read(file, (uint8 *) &tlen, 4) != 4)
     goto IO_error;
   if (sf->is_big)
     flip_int(&tlen);
 
-  if (make_room(tlen+1))
+  if (make_room(sf,tlen+1))
     return (1);
-  if (gzread(file, data, tlen) != tlen)
+  if (bgzf_read(file, sf->data, tlen) != tlen)
     goto IO_error;
-  data[tlen++] = 0;              // make sure it is NULL terminated
+  sf->data[tlen++] = 0;              // make sure it is NULL terminated
 
   //  read through number of reference sequences
 
-  if (gzread(file, &ncnt, 4) != 4)
+  if (bgzf_read(file, (uint8 *) &ncnt, 4) != 4)
     goto IO_error;
   if (sf->is_big)
     flip_int(&ncnt);
@@ -236,15 +1004,15 @@ static int bam_header_read(samFile *sf)
   // read through reference sequence names and lengths
 
   for (i = 0; i < ncnt; i++)
-    { if (gzread(file, &nlen, 4) != 4)
+    { if (bgzf_read(file, (uint8 *) &nlen, 4) != 4)
         goto IO_error;
       if (sf->is_big)
         flip_int(&nlen);
       if (nlen <= 0)
         goto corrupted;
-      if (make_room(tlen+nlen+5))
+      if (make_room(sf,tlen+nlen+5))
         return (1);
-      if (gzread(file, data+(tlen+1), nlen+4) != nlen+4)
+      if (bgzf_read(file, sf->data+(tlen+1), nlen+4) != nlen+4)
         goto IO_error;
     }
   return (0);
@@ -263,10 +1031,7 @@ static int sam_header_read(samFile *sf)
 
   dlen = 0;
   while (1)
-    { c = gzgetc(sf->ptr);
-      if (c == EOF)
-        break;
-      gzungetc(c,sf->ptr);
+    { c = in_peek((InFile *) sf->ptr);
       if (c != '@')
         break;
       dlen = sam_getline(sf,dlen);
@@ -274,9 +1039,9 @@ static int sam_header_read(samFile *sf)
         return (1);
     }
   if (dlen == 0)
-    { if (make_room(1))
+    { if (make_room(sf,1))
         return (1);
-      data[0] = '\0';
+      sf->data[0] = '\0';
     }
   return (0);
 }
@@ -311,12 +1076,178 @@ static char  IUPAC_2_DNA[256] =
   };
  
 
-static char *SEQ_CONVERT;  //  1 of 4 tables abave: sam vs. bam, numberic vs. alpha
-static int   ARR_CONVERT;
+  //  Expand the len 4-bit packed bases at t into seq through the 16 entry table conv.
+  //    On x86 the nibbles are split and looked up 32 (SSSE3) or 64 (AVX2) at a time with
+  //    a byte shuffle, the instruction set being picked at run time.  The scalar loop
+  //    finishes the tail and is the whole story on other machines.
+
+#ifdef SIMD_UNPACK
+
+__attribute__((target("ssse3")))
+static int unpack_ssse3(char *seq, uint8 *t, int len, char *conv)
+{ __m128i tab, low, v, hi, lo;
+  int     i;
+
+  tab = _mm_loadu_si128((__m128i *) conv);
+  low = _mm_set1_epi8(0xf);
+  for (i = 0; i+32 <= len; i += 32)
+    { v  = _mm_loadu_si128((__m128i *) (t + (i>>1)));
+      hi = _mm_shuffle_epi8(tab,_mm_and_si128(_mm_srli_epi16(v,4),low));
+      lo = _mm_shuffle_epi8(tab,_mm_and_si128(v,low));
+      _mm_storeu_si128((__m128i *) (seq+i),_mm_unpacklo_epi8(hi,lo));
+      _mm_storeu_si128((__m128i *) (seq+i+16),_mm_unpackhi_epi8(hi,lo));
+    }
+  return (i);
+}
+
+__attribute__((target("avx2")))
+static int unpack_avx2(char *seq, uint8 *t, int len, char *conv)
+{ __m256i tab, low, v, hi, lo, a, b;
+  int     i;
+
+  tab = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i *) conv));
+  low = _mm256_set1_epi8(0xf);
+  for (i = 0; i+64 <= len; i += 64)
+    { v  = _mm256_loadu_si256((__m256i *) (t + (i>>1)));
+      hi = _mm256_shuffle_epi8(tab,_mm256_and_si256(_mm256_srli_epi16(v,4),low));
+      lo = _mm256_shuffle_epi8(tab,_mm256_and_si256(v,low));
+      a  = _mm256_unpacklo_epi8(hi,lo);     //  interleaves within each 128-bit lane
+      b  = _mm256_unpackhi_epi8(hi,lo);
+      _mm256_storeu_si256((__m256i *) (seq+i),_mm256_permute2x128_si256(a,b,0x20));
+      _mm256_storeu_si256((__m256i *) (seq+i+32),_mm256_permute2x128_si256(a,b,0x31));
+    }
+  return (i);
+}
+
+#endif
+
+  //  Expand bases i..len-1 one at a time (i even)
+
+static void unpack_scalar(char *seq, uint8 *t, int i, int len, char *conv)
+{ int e;
+
+  for (e = (i>>1); i < len-1; i += 2, e++)
+    { seq[i]   = conv[t[e] >> 4];
+      seq[i+1] = conv[t[e] & 0xf];
+    }
+  if (i < len)
+    seq[i] = conv[t[e] >> 4];
+}
+
+static void unpack_bases(char *seq, uint8 *t, int len, char *conv)
+{ int i;
+
+  i = 0;
+#ifdef SIMD_UNPACK
+  if (__builtin_cpu_supports("avx2"))
+    i = unpack_avx2(seq,t,len,conv);
+  if (__builtin_cpu_supports("ssse3"))
+    i += unpack_ssse3(seq+i,t+(i>>1),len-i,conv);
+#endif
+  unpack_scalar(seq,t,i,len,conv);
+}
+
+#ifdef UNPACK_BENCH
+
+  //  make unpack_bench: check each unpacking kernel against the scalar loop for every pair
+  //    of nibble codes at every length up to UB_CHECK, and time each on UB_REPS unpackings
+  //    of a UB_LEN base read.
+
+#define UB_CHECK  400
+#define UB_LEN    15000
+#define UB_REPS   20000
+
+static int ub_kernel(int k, char *seq, uint8 *t, int len, char *conv)
+{ int i;
+
+  i = 0;
+#ifdef SIMD_UNPACK
+  if (k >= 2)
+    i = unpack_avx2(seq,t,len,conv);
+  if (k >= 1)
+    i += unpack_ssse3(seq+i,t+(i>>1),len-i,conv);
+#endif
+  unpack_scalar(seq,t,i,len,conv);
+  return (i);
+}
+
+int main()
+{ static char *kname[3] = { "scalar", "ssse3", "avx2" };
+  static char *cname[2] = { "alpha", "numeric" };
+  char   *conv[2];
+  uint8  *t;
+  char   *seq, *ref;
+  int     c, k, len, r, kmax, fail;
+  struct timespec beg, end;
+  double  secs;
+
+  conv[0] = INT_2_IUPAC;
+  conv[1] = INT_2_NUMBER;
+  t   = (uint8 *) malloc(UB_LEN/2+1);
+  seq = (char *) malloc(UB_LEN+1);
+  ref = (char *) malloc(UB_LEN+1);
+  if (t == NULL || seq == NULL || ref == NULL)
+    { fprintf(stderr,"unpack_bench: Out of memory\n");
+      exit (1);
+    }
+
+  kmax = 0;
+#ifdef SIMD_UNPACK
+  if (__builtin_cpu_supports("ssse3"))
+    kmax = 1;
+  if (kmax == 1 && __builtin_cpu_supports("avx2"))
+    kmax = 2;
+#endif
+
+  //  Byte e of the packed read is e mod 256 so that every pair of nibble codes occurs
+  //    within the first 256 bytes, and is pseudo-random thereafter
+
+  for (r = 0; r <= UB_LEN/2; r++)
+    t[r] = (r < 256 ? r : (uint8) (r*2654435761u >> 13));
+
+  fail = 0;
+  for (c = 0; c < 2; c++)
+    for (k = 1; k <= kmax; k++)
+      for (len = 0; len <= UB_CHECK; len++)
+        { unpack_scalar(ref,t,0,len,conv[c]);
+          ref[len] = seq[len] = 0x7f;
+          ub_kernel(k,seq,t,len,conv[c]);
+          if (memcmp(seq,ref,len+1) != 0)
+            { printf("%s %s differs from scalar at length %d\n",kname[k],cname[c],len);
+              fail = 1;
+            }
+        }
+  if (fail)
+    exit (1);
+  printf("Kernels up to %s agree with scalar for lengths 0-%d\n",kname[kmax],UB_CHECK);
+
+  for (c = 0; c < 2; c++)
+    for (k = 0; k <= kmax; k++)
+      { clock_gettime(CLOCK_MONOTONIC,&beg);
+        for (r = 0; r < UB_REPS; r++)
+          ub_kernel(k,seq,t,UB_LEN,conv[c]);
+        clock_gettime(CLOCK_MONOTONIC,&end);
+        secs = (end.tv_sec-beg.tv_sec) + (end.tv_nsec-beg.tv_nsec)*1e-9;
+        printf("  %-7s %-6s %6.2f Gbases/s\n",cname[c],kname[k],(1e-9*UB_LEN*UB_REPS)/secs);
+      }
+
+  free(ref);
+  free(seq);
+  free(t);
+  exit (0);
+}
+
+#endif
+
+
+  //  The @RG description of a PacBio subread file lists the auxiliary streams present
+
+static char *QV_NAMES[5] = { "DeletionQV=", "DeletionTag=", "InsertionQV=",
+                             "MergeQV=", "SubstitutionQV=" };
 
 int sam_header_process(samFile *sf, int numeric)
 { char *desc, *eol, *eod, *subs, *pw;
-  int   status;
+  int   status, i;
 
   if (sf->format == bam)
     { if (bam_header_read(sf))
@@ -327,19 +1258,46 @@ int sam_header_process(samFile *sf, int numeric)
         return (-1);
     }
 
+  status = 0;
+  for (desc = strstr((char *) sf->data,"@RG\t"); desc != NULL; desc = strstr(eol,"@RG\t"))
+    { eol = index(desc,'\n');
+      if (eol == NULL)
+        eol = desc + strlen(desc);
+      desc = strstr(desc,"\tDS:");
+      if (desc == NULL || desc > eol)
+        continue;
+      eod = index(desc+1,'\t');
+      if (eod == NULL || eod > eol)
+        eod = eol;
+      subs = strstr(desc,"READTYPE=SUBREAD");
+      if (subs == NULL || subs > eod)
+        continue;
+
+      pw = strstr(desc,"PulseWidth");
+      if (pw != NULL && pw < eod)
+        status |= HASPW;
+      for (i = 0; i < 5; i++)
+        { subs = strstr(desc,QV_NAMES[i]);
+          if (subs == NULL || subs > eod)
+            break;
+        }
+      if (i >= 5)
+        status |= HASQV;
+    }
+
   if (numeric)
     { if (sf->format == sam)
-        SEQ_CONVERT = IUPAC_2_NUMBER;
+        sf->seq_conv = IUPAC_2_NUMBER;
       else
-        SEQ_CONVERT = INT_2_NUMBER;
-      ARR_CONVERT = -1;
+        sf->seq_conv = INT_2_NUMBER;
+      sf->arr_conv = -1;
     }
   else
     { if (sf->format == sam)
-        SEQ_CONVERT = IUPAC_2_DNA;
+        sf->seq_conv = IUPAC_2_DNA;
       else
-        SEQ_CONVERT = INT_2_IUPAC;
-      ARR_CONVERT = '0';
+        sf->seq_conv = INT_2_IUPAC;
+      sf->arr_conv = '0';
     }
 
   return (status);
@@ -437,81 +1395,410 @@ static void flip_auxilliary(uint8 *s, uint8 *e)
     } 
 }
 
-static int bam_record_read(samFile *sf)
-{ int ldata, lname, lcigar, lseq, aux;
+  //  Tags of interest, packed into an int
+
+#define TAG(a,b)  (((a) << 8) | (b))
+
+#define TAG_ZM  TAG('z','m')
+#define TAG_QS  TAG('q','s')
+#define TAG_QE  TAG('q','e')
+#define TAG_RQ  TAG('r','q')
+#define TAG_SN  TAG('s','n')
+#define TAG_PW  TAG('p','w')
+#define TAG_BC  TAG('b','c')
+#define TAG_BQ  TAG('b','q')
+#define TAG_NP  TAG('n','p')
+#define TAG_DQ  TAG('d','q')
+#define TAG_DT  TAG('d','t')
+#define TAG_IQ  TAG('i','q')
+#define TAG_MQ  TAG('m','q')
+#define TAG_SQ  TAG('s','q')
+
+#define GOT_PW  0x1
+#define GOT_SN  0x2
+#define GOT_QV  0x4   //  + k for each of the 5 qv streams, i.e. 0x7c when all present
+
+#define ALL_QV  0x7c
+
+  //  Reset the pacbio fields of r to their "absent" values
+
+static void clear_record(samRecord *r)
+{ r->well  = -1;
+  r->beg   = -1;
+  r->end   = -1;
+  r->qual  = 0.;
+  r->bc[0] = -1;
+  r->bc[1] = -1;
+  r->bqual = -1;
+  r->nump  = -1;
+}
 
-  { int    ret;      //  read next block
-    uint32 x[9];
+  //  Check that the requested streams were all present
 
-    if ((ret = gzread(sf->ptr, x, 36)) != 36)
-      { if (ret == 0)
-          return (0);   // normal end-of-file
-        else
-          { fprintf(stderr,"%s: Unexpected end of input file\n",Prog_Name);
-            return (-1);
+static int check_streams(int status, int got)
+{ if ((status & HASPW) && (got & (GOT_PW | GOT_SN)) != (GOT_PW | GOT_SN))
+    { fprintf(stderr,"%s: Subread is missing its pw or sn tag\n",Prog_Name);
+      return (1);
+    }
+  if ((status & HASQV) && (got & ALL_QV) != ALL_QV)
+    { fprintf(stderr,"%s: Subread is missing one or more of its dq, dt, iq, mq, sq tags\n",
+                     Prog_Name);
+      return (1);
+    }
+  return (0);
+}
+
+  //  Fetch integer value of type t at v
+
+static int bam_int(int t, uint8 *v)
+{ switch (t)
+  { case 'c':
+      return (*((int8 *) v));
+    case 'C':
+      return (*v);
+    case 's':
+      { int16 x;
+        memcpy(&x,v,2);
+        return (x);
+      }
+    case 'S':
+      { uint16 x;
+        memcpy(&x,v,2);
+        return (x);
+      }
+    default:   //  i or I
+      { int32 x;
+        memcpy(&x,v,4);
+        return (x);
+      }
+  }
+}
+
+  //  Locations of the pacbio tags of interest in the auxiliary data of a bam record
+
+#define T_ZM   0
+#define T_QS   1
+#define T_QE   2
+#define T_RQ   3
+#define T_NP   4
+#define T_BQ   5
+#define T_BC   6
+#define T_SN   7
+#define T_PW   8
+#define T_QV   9   //  + k for each of the 5 qv streams dq, dt, iq, mq, sq
+#define NTAGS 14
+
+typedef struct
+  { uint8 *v;      //  start of value (NULL if tag absent)
+    uint8 *e;      //  end of value
+    int    type;   //  type letter
+    int    sub;    //  array element type (B only)
+    int    n;      //  # of array elements (B only)
+  } TagLoc;
+
+  //  Find the pacbio tags in the auxiliary data [*pp,e) of a bam record, recording in loc
+  //    where each tag of interest is and removing it from *need.  The scan stops once the
+  //    tags stop (a subset of *need) have all been seen, *pp then being where to resume.
+  //    1 => corrupt (message sent), 0 otherwise.
+
+static int bam_scan(uint8 **pp, uint8 *e, int *need, int stop, TagLoc *loc)
+{ TagLoc *l;
+  int     tag, type, sub, size, n, k;
+  uint8  *p, *v;
+
+  p = *pp;
+  while (p < e && (*need & stop) != 0)
+    { if (p+3 > e)
+        goto corrupt;
+      tag  = TAG(p[0],p[1]);
+      type = p[2];
+      v    = p+3;
+      if (type == 'B')
+        { if (v+5 > e)
+            goto corrupt;
+          sub  = v[0];
+          memcpy(&n,v+1,4);
+          size = bam_tag_size[sub & 0x7f];
+          if (n < 0 || size == 0 || size > 8)
+            goto corrupt;
+          p  = v + (5 + ((int64) n)*size);
+          v += 5;
+        }
+      else if (type == 'Z' || type == 'H')
+        { uint8 *z = memchr(v,'\0',e-v);
+          if (z == NULL)
+            goto corrupt;
+          p   = z+1;
+          sub = n = 0;
+        }
+      else
+        { size = bam_tag_size[type & 0x7f];
+          if (size == 0 || size > 8)
+            goto corrupt;
+          p   = v + size;
+          sub = n = 0;
+        }
+      if (p > e)
+        goto corrupt;
+
+      switch (tag)
+      { case TAG_ZM: k = T_ZM;   break;
+        case TAG_QS: k = T_QS;   break;
+        case TAG_QE: k = T_QE;   break;
+        case TAG_RQ: k = T_RQ;   break;
+        case TAG_NP: k = T_NP;   break;
+        case TAG_BQ: k = T_BQ;   break;
+        case TAG_BC: k = T_BC;   break;
+        case TAG_SN: k = T_SN;   break;
+        case TAG_PW: k = T_PW;   break;
+        case TAG_DQ: k = T_QV;   break;
+        case TAG_DT: k = T_QV+1; break;
+        case TAG_IQ: k = T_QV+2; break;
+        case TAG_MQ: k = T_QV+3; break;
+        case TAG_SQ: k = T_QV+4; break;
+        default:     continue;
+      }
+      l = loc+k;
+      l->v    = v;
+      l->e    = p;
+      l->type = type;
+      l->sub  = sub;
+      l->n    = n;
+      *need &= ~(1 << k);
+    }
+  *pp = p;
+  return (0);
+
+corrupt:
+  fprintf(stderr,"%s: Corrupted auxiliary tags in BAM record\n",Prog_Name);
+  return (1);
+}
+
+  //  Decode the well, pulse range, quality, and any requested bc/bq and np fields located
+  //    by bam_scan
+
+static void bam_fields(samFile *sf, TagLoc *loc)
+{ samRecord *theR = &sf->rec;
+  TagLoc    *l;
+
+#define GET_INT(k,field)		\
+  if (loc[k].v != NULL)			\
+    field = bam_int(loc[k].type,loc[k].v);
+
+  GET_INT(T_ZM,theR->well)
+  GET_INT(T_QS,theR->beg)
+  GET_INT(T_QE,theR->end)
+  GET_INT(T_NP,theR->nump)
+  GET_INT(T_BQ,theR->bqual)
+
+  l = loc+T_RQ;
+  if (l->v != NULL && l->type == 'f')
+    memcpy(&theR->qual,l->v,4);
+
+  l = loc+T_BC;
+  if (l->v != NULL && l->type == 'B' && l->n == 2 && l->sub != 'f')
+    { theR->bc[0] = bam_int(l->sub,l->v);
+      theR->bc[1] = bam_int(l->sub,l->v+bam_tag_size[l->sub]);
+    }
+}
+
+  //  Decode the pw and sn, and/or quiver streams requested by status that bam_scan located:
+  //    1 => error (message sent), 0 otherwise
+
+static int bam_streams(samFile *sf, TagLoc *loc, int lseq, int status)
+{ samRecord *theR = &sf->rec;
+  TagLoc    *l;
+  uint8     *v;
+  int        i, n;
+
+  if (status & HASPW)
+    { l = loc+T_SN;
+      if (l->v == NULL || l->type != 'B' || l->sub != 'f' || l->n != 4)
+        goto missing_pw;
+      memcpy(theR->snr,l->v,16);
+
+      l = loc+T_PW;
+      if (l->v == NULL || l->type != 'B')
+        goto missing_pw;
+      if (l->n != lseq)
+        { fprintf(stderr,"%s: pw tag is not the same length as the sequence\n",Prog_Name);
+          return (1);
+        }
+      { char *arr = theR->arr;
+        int   x, w;
+
+        v = l->v;
+        w = bam_tag_size[l->sub];
+        for (i = 0; i < lseq; i++, v += w)
+          { x = bam_int(l->sub,v);
+            if (x >= 4)
+              x = 4;
+            arr[i] = x + sf->arr_conv;
           }
       }
+    }
+
+  if (status & HASQV)
+    for (i = 0; i < 5; i++)
+      { char *qv;
 
+        l = loc + (T_QV+i);
+        if (l->v == NULL || l->type != 'Z')
+          { fprintf(stderr,"%s: Subread is missing one or more of its dq, dt, iq, mq, sq tags\n",
+                           Prog_Name);
+            return (1);
+          }
+        if ((l->e-l->v)-1 != lseq)
+          { fprintf(stderr,"%s: QV tag is not the same length as the sequence\n",Prog_Name);
+            return (1);
+          }
+        qv = theR->qv[i];
+        memcpy(qv,l->v,lseq);
+        if (i == 1)
+          for (n = 0; n < lseq; n++)
+            qv[n] = tolower(qv[n]);
+      }
+
+  return (0);
+
+missing_pw:
+  fprintf(stderr,"%s: Subread is missing its pw or sn tag\n",Prog_Name);
+  return (1);
+}
+
+  //  Is the record whose fields are in sf->rec not to be extracted (outside the wells of
+  //    sam_set_wells or rejected by the filter of sam_set_filter)?
+
+static int reject_record(samFile *sf)
+{ samRecord *r = &sf->rec;
+
+  if (sf->wlo <= sf->whi && (r->well < sf->wlo || r->well > sf->whi))
+    return (1);
+  return (sf->keep != NULL && ! sf->keep(sf->karg,r));
+}
+
+  //  Records are parsed in place in the inflated block containing them, only those that
+  //    straddle a block boundary are stitched together in data.  The fixed fields are
+  //    decoded first and a record that is rejected (reject_record) is skipped, returning 2,
+  //    before its sequence is unpacked or any of its streams decoded.
+
+static int bam_record_read(samFile *sf, int status)
+{ BGZF      *bg       = (BGZF *) sf->ptr;
+  samRecord *theR     = &sf->rec;
+  char      *seq_conv = sf->seq_conv;
+  uint8     *rec;
+  int    ldata, lname, lcigar, lseq, aux;
+
+  { int    err;      //  get next record
+    uint8 *p;
+    int32  bsize;
+    uint32 x[8];
+
+    p = bgzf_span(bg,4,&err);
+    if (p == NULL)
+      { if (err == 0)
+          return (0);   // normal end-of-file
+        goto truncated;
+      }
+    memcpy(&bsize,p,4);
     if (sf->is_big)
-      { flip_int(x);
+      flip_int(&bsize);
+    if (bsize < 32)
+      goto nonsense;
+
+    rec = bgzf_span(bg,bsize,&err);
+    if (rec == NULL)
+      goto truncated;
+
+    memcpy(x,rec,32);
+    if (sf->is_big)
+      { flip_int(x + 2);
         flip_int(x + 3);
         flip_int(x + 4);
-        flip_int(x + 5);
       }
 
-    ldata  = ((int) x[0]) - 32;
-    lname  = (x[3] & 0xff);
-    lcigar = (x[4] & 0xffff);
-    lseq   = x[5];
+    ldata  = bsize - 32;
+    lname  = (x[2] & 0xff);
+    lcigar = (x[3] & 0xffff);
+    lseq   = x[4];
+    rec   += 32;
 
-    if (ldata < 0 || lseq < 0 || lname < 1)
-      return (-1);
+    if (lseq < 0 || lname < 1)
+      goto nonsense;
 
     aux = lname + (lcigar<<2) + ((lseq + 1)>>1) + lseq;
     if (aux > ldata)
-      { fprintf(stderr,"%s: Non-sensical SAM record, file corrupted?\n",Prog_Name);
-        return (-1);
-      }
+      goto nonsense;
 
-    if (make_room(ldata))
-      return (-1);
+    if (sf->is_big)
+      flip_auxilliary(rec+aux, rec+ldata);
+    goto parse;
 
-    if (gzread(sf->ptr, data, ldata) != ldata)
-      { fprintf(stderr,"%s: Unexpected end of input file\n",Prog_Name);
-        return (-1);
-      }
+  truncated:
+    if (err == 1)
+      fprintf(stderr,"%s: Unexpected end of input file\n",Prog_Name);
+    return (-1);
 
-    if (sf->is_big)
-      flip_auxilliary(data+aux, data+ldata);
+  nonsense:
+    fprintf(stderr,"%s: Non-sensical BAM record, file corrupted?\n",Prog_Name);
+    return (-1);
   }
-  
-  { uint8 *t;     //  Load header and sequence from required fields
-    int    i, e;
-    char  *seq, *eoh;
+
+parse:
+  { TagLoc loc[NTAGS];     //  Decode the fields and test if the record is wanted
+    uint8 *p;
+    int    k, fields, need;
 
     if (lseq <= 0)
       { fprintf(stderr,"%s: no sequence for subread !?\n",Prog_Name);
         return (-1);
       }
 
-    if (init_record(lseq))
+    fields = (1 << T_ZM) | (1 << T_QS) | (1 << T_QE) | (1 << T_RQ);
+    if (status & WANT_NP)
+      fields |= (1 << T_NP);
+    if (status & WANT_BC)
+      fields |= (1 << T_BQ) | (1 << T_BC);
+    need = fields;
+    if (status & HASPW)
+      need |= (1 << T_SN) | (1 << T_PW);
+    if (status & HASQV)
+      need |= (0x1f << T_QV);
+
+    for (k = 0; k < NTAGS; k++)
+      loc[k].v = NULL;
+
+    p = rec+aux;
+    if (bam_scan(&p,rec+ldata,&need,fields,loc))
       return (-1);
+    clear_record(theR);
+    bam_fields(sf,loc);
+    theR->len = lseq;
+    if (reject_record(sf))
+      return (2);
 
-    theR.header = (char *) data;
-    theR.len    = lseq;
-    seq         = theR.seq;
+    if (bam_scan(&p,rec+ldata,&need,need,loc))
+      return (-1);
+    if (init_record(sf,lseq))
+      return (-1);
+    if (bam_streams(sf,loc,lseq,status))
+      return (-1);
+  }
 
-    eoh = index(theR.header,'/');
+  { uint8 *t;     //  Load header and sequence from required fields
+    char  *seq, *eoh;
+
+    theR->header = (char *) rec;
+    theR->len    = lseq;
+    seq         = theR->seq;
+
+    rec[lname-1] = '\0';
+    eoh = index(theR->header,'/');
     if (eoh != NULL)
       *eoh = 0;
 
-    t = data + (lname + (lcigar<<2)); 
-    for (e = i = 0; i < lseq-1; i += 2, e++)
-      { seq[i]   = SEQ_CONVERT[t[e] >> 4];
-        seq[i+1] = SEQ_CONVERT[t[e] & 0xf];
-      }
-    if (i < lseq)
-      seq[i] = SEQ_CONVERT[t[e] >> 4];
+    t = rec + (lname + (lcigar<<2)); 
+    unpack_bases(seq,t,lseq,seq_conv);
   }
 
   return (1);
@@ -524,77 +1811,450 @@ static int bam_record_read(samFile *sf)
     }							\
 }
 
-#define NEXT_ITEM(b,e)					\
-{ b = e;						\
-  while (*e != '\0' && *e != '\t')			\
-    e++;						\
-  CHECK( *e == '\0', "Missing one or more fields")	\
-  *e = 0;						\
+  //  Parse the unsigned decimal at *p (as in a pw array) and advance *p past it
+
+static inline int next_uint(char **p)
+{ char *q = *p;
+  int   x;
+
+  x = 0;
+  while ((unsigned) (*q - '0') < 10)
+    x = 10*x + (*q++ - '0');
+  *p = q;
+  return (x);
 }
 
-static int sam_record_read(samFile *sf)
-{ char  *p;
-  int    qlen, ret;
+  //  Extract the pacbio tags in the tab-separated auxiliary fields p[0..eol-1]
 
-  //  read next line
+static int sam_tags(samFile *sf, char *p, char *eol, int lseq, int status)
+{ samRecord *theR = &sf->rec;
+  char      *v, *q;
+  int        tag, type, n, i, got;
 
-  ret = sam_getline(sf,0);
-  if (ret <= 0)
-    return (ret);
+  got = 0;
+  while (p < eol)
+    { if (*p == '\t')
+        { p += 1;
+          continue;
+        }
+      CHECK( eol-p < 5 || p[2] != ':' || p[4] != ':', "Malformed auxiliary tag in SAM record")
+      tag  = TAG(p[0],p[1]);
+      type = p[3];
+      v    = p+5;
+      p    = memchr(v,'\t',eol-v);
+      if (p == NULL)
+        p = eol;
+
+      switch (tag)
+      { case TAG_ZM:
+          theR->well = strtol(v,NULL,10);
+          break;
+        case TAG_QS:
+          theR->beg = strtol(v,NULL,10);
+          break;
+        case TAG_QE:
+          theR->end = strtol(v,NULL,10);
+          break;
+        case TAG_NP:
+          if (status & WANT_NP)
+            theR->nump = strtol(v,NULL,10);
+          break;
+        case TAG_BQ:
+          if (status & WANT_BC)
+            theR->bqual = strtol(v,NULL,10);
+          break;
+        case TAG_RQ:
+          if (type == 'f')
+            theR->qual = strtof(v,NULL);
+          break;
+        case TAG_BC:
+          if ((status & WANT_BC) && type == 'B' && *v != 'f' && v[1] == ',')
+            { theR->bc[0] = strtol(v+2,&q,10);
+              if (*q == ',')
+                theR->bc[1] = strtol(q+1,NULL,10);
+            }
+          break;
+        case TAG_SN:
+          if ((status & HASPW) && type == 'B' && *v == 'f')
+            { q = v+1;
+              for (i = 0; i < 4 && *q == ',' ; i++)
+                theR->snr[i] = strtof(q+1,&q);
+              if (i == 4)
+                got |= GOT_SN;
+            }
+          break;
+        case TAG_PW:
+          if ((status & HASPW) && type == 'B')
+            { char *arr = theR->arr;
+              int   x;
+
+              q = v+1;
+              for (i = 0; i < lseq && *q == ','; i++)
+                { q += 1;
+                  x  = next_uint(&q);
+                  if (x >= 4)
+                    x = 4;
+                  arr[i] = x + sf->arr_conv;
+                }
+              CHECK( i != lseq || *q == ',', "pw tag is not the same length as the sequence")
+              got |= GOT_PW;
+            }
+          break;
+        case TAG_DQ:
+        case TAG_DT:
+        case TAG_IQ:
+        case TAG_MQ:
+        case TAG_SQ:
+          if ((status & HASQV) && type == 'Z')
+            { char *qv;
+
+              switch (tag)
+              { case TAG_DQ: i = 0; break;
+                case TAG_DT: i = 1; break;
+                case TAG_IQ: i = 2; break;
+                case TAG_MQ: i = 3; break;
+                default:     i = 4; break;
+              }
+              CHECK( p-v != lseq, "QV tag is not the same length as the sequence")
+              qv = theR->qv[i];
+              memcpy(qv,v,lseq);
+              if (i == 1)
+                for (n = 0; n < lseq; n++)
+                  qv[n] = tolower(qv[n]);
+              got |= (GOT_QV << i);
+            }
+          break;
+      }
+    }
 
-  p = (char *) data;
+  return (check_streams(status,got) ? -1 : 0);
+}
 
-  { char *q, *seq;     //  Load header and sequence from required fields
+  //  As for bam, a rejected record returns 2 with its sequence left unconverted, but as the
+  //    tags of a sam record are parsed in a single pass its streams have been decoded.
+
+static int sam_record_read(samFile *sf, int status)
+{ samRecord *theR     = &sf->rec;
+  char      *seq_conv = sf->seq_conv;
+  char      *p, *eol, *sq;
+  int        qlen, len;
+
+  //  read next line
+
+  p = sam_nextline(sf,&len);
+  if (p == NULL)
+    return (len);
+  eol = p + len;
+
+  { char *q;     //  Load header and locate sequence from required fields
     int   i;
 
-    NEXT_ITEM(q,p)
+    q = p;
+    p = memchr(q,'\t',eol-q);
+    CHECK( p == NULL, "Missing one or more fields")
     qlen = p-q;
     CHECK( qlen <= 1, "Empty header name")
     CHECK( qlen > 255, "Header is too long")
 
-    theR.header = q;
-    q = index(q,'/');         // Truncate pacbio well & pulse numbers
-    if (q != NULL && q < p)
+    *p = '\0';
+    theR->header = q;
+    q = memchr(q,'/',qlen);   // Truncate pacbio well & pulse numbers
+    if (q != NULL)
       *q = 0;
 
     for (i = 0; i < 8; i++)   // Skip next 8 required fields
-      { p = index(p+1,'\t');
+      { p = memchr(p+1,'\t',eol-(p+1));
         CHECK( p == NULL, "Too few required fields in SAM record, file corrupted?")
       }
     p += 1;
 
-    NEXT_ITEM(q,p)
+    q = p;
+    p = memchr(q,'\t',eol-q);
+    CHECK( p == NULL, "Missing one or more fields")
     qlen = p-q;
     CHECK (*q == '*', "No sequence for read?");
 
-    if (init_record(qlen))
+    if (init_record(sf,qlen))
       return (-1);
 
-    seq = theR.seq;
-    theR.len = qlen;
-    for (i = 0; i < qlen; i++)
-      seq[i] = SEQ_CONVERT[(int) (*q++)];
+    sq = q;
+    theR->len = qlen;
 
-    p = index(p+1,'\t');  // Skip qual
+    p = memchr(p+1,'\t',eol-(p+1));  // Skip qual
     CHECK( p == NULL, "No auxilliary tags in SAM record, file corrupted?")
   }
 
+  clear_record(theR);
+  if (sam_tags(sf,p+1,eol,theR->len,status))
+    return (-1);
+  if (reject_record(sf))
+    return (2);
+
+  { char *seq = theR->seq;
+    int   i;
+
+    for (i = 0; i < qlen; i++)
+      seq[i] = seq_conv[(int) (*sq++)];
+  }
+
   return (1);
 }
 
 static samRecord _SAM_EOF;
 samRecord *SAM_EOF = &_SAM_EOF;
 
-samRecord *sam_record_extract(samFile *sf)
+void sam_set_wells(samFile *sf, int lo, int hi)
+{ sf->wlo = lo;
+  sf->whi = hi;
+}
+
+void sam_set_filter(samFile *sf, int (*keep)(void *arg, samRecord *r), void *arg)
+{ sf->keep = keep;
+  sf->karg = arg;
+}
+
+samRecord *sam_record_extract(samFile *sf, int status)
 { int64 ret;
 
-  if (sf->format == bam)
-    ret = bam_record_read(sf);
+  do
+    { if (sf->sel != NULL)
+        { if (sf->snext >= sf->nsel)
+            return (SAM_EOF);
+          if (bgzf_seek((BGZF *) sf->ptr,sf->sel[sf->snext++]))
+            return (NULL);
+        }
+
+      if (sf->format == bam)
+        ret = bam_record_read(sf,status);
+      else
+        ret = sam_record_read(sf,status);
+
+      if (ret < 0)
+        return (NULL);
+      if (ret == 0)
+        return (SAM_EOF);
+    }
+  while (ret == 2);
+
+  return (&sf->rec);
+}
+
+
+/*******************************************************************************************
+ *
+ *  PBI INDEX
+ *    A PacBio .pbi is itself BGZF compressed and holds a 32 byte header followed by columns
+ *    of per-record values: always the BasicData columns, then optionally the MappedData,
+ *    ReferenceData, and BarcodeData sections as flagged in the header.
+ *
+ ********************************************************************************************/
+
+#define PBI_MAPPED    0x1
+#define PBI_REFERENCE 0x2
+#define PBI_BARCODE   0x4
+
+  //  Read a column of n little-endian items of size bytes each into col: 0 => OK, 1 => error
+
+static int pbi_column(BGZF *bg, void *col, int size, int n, int is_big)
+{ uint8 *c = (uint8 *) col;
+  int    i;
+
+  if (bgzf_read(bg,c,size*n) != size*n)
+    return (1);
+  if (is_big)
+    { for (i = 0; i < n; i++, c += size)
+        if (size == 2)
+          flip_short(c);
+        else if (size == 4)
+          flip_int(c);
+        else if (size == 8)
+          flip_double(c);
+    }
+  return (0);
+}
+
+  //  Skip over n bytes of the index: 0 => OK, 1 => error
+
+static int pbi_skip(BGZF *bg, int64 n, uint8 *buf, int bmax)
+{ int k;
+
+  while (n > 0)
+    { k = (n > bmax ? bmax : n);
+      if (bgzf_read(bg,buf,k) != k)
+        return (1);
+      n -= k;
+    }
+  return (0);
+}
+
+void sam_index_free(samIndex *x)
+{ if (x == NULL)
+    return;
+  free(x->well);
+  free(x->voff);
+  free(x->bc[0]);
+  free(x);
+}
+
+samIndex *sam_index_load(samFile *sf)
+{ samIndex *x;
+  InFile   *in;
+  BGZF     *bg;
+  char     *name;
+  uint8     h[32], *tmp;
+  int       n, i, flags;
+
+  if (sf->format != bam)
+    return (NULL);
+
+  name = (char *) malloc(strlen(sf->name)+5);
+  if (name == NULL)
+    return (NULL);
+  sprintf(name,"%s.pbi",sf->name);
+  in = in_open(name);
+  if (in == NULL)
+    { free(name);
+      return (NULL);
+    }
+  bg = bgzf_open(in,0);
+  if (bg == NULL)
+    { in_close(in);
+      free(name);
+      return (NULL);
+    }
+
+  x   = NULL;
+  tmp = NULL;
+  if (bgzf_read(bg,h,32) != 32 || memcmp(h,"PBI\1",4) != 0)
+    goto error;
+  flags = h[8] | (h[9] << 8);
+  n     = h[10] | (h[11] << 8) | (h[12] << 16) | (h[13] << 24);
+  if (n < 0)
+    goto error;
+
+  x = (samIndex *) malloc(sizeof(samIndex));
+  if (x == NULL)
+    goto error;
+  x->nreads = n;
+  x->hasbc  = ((flags & PBI_BARCODE) != 0);
+  x->well   = (int *) malloc(4ll*(4*n+1));
+  x->voff   = (int64 *) malloc(8ll*n+8);
+  x->bc[0]  = (x->hasbc ? (int *) malloc(12ll*n+4) : NULL);
+  tmp       = (uint8 *) malloc(BGZF_MAX_BLOCK);
+  if (x->well == NULL || x->voff == NULL || (x->hasbc && x->bc[0] == NULL) || tmp == NULL)
+    goto error;
+  x->beg  = x->well + n;
+  x->end  = x->beg + n;
+  x->qual = (float *) (x->end + n);
+  if (x->hasbc)
+    { x->bc[1] = x->bc[0] + n;
+      x->bqual = x->bc[1] + n;
+    }
   else
-    ret = sam_record_read(sf);
+    x->bc[1] = x->bqual = NULL;
+
+  //  BasicData: rgId, qStart, qEnd, holeNumber, readQual, ctxtFlag, fileOffset
 
-  if (ret <= 0)
-    return (SAM_EOF);
+  if (pbi_skip(bg,4ll*n,tmp,BGZF_MAX_BLOCK)
+        || pbi_column(bg,x->beg,4,n,sf->is_big)
+        || pbi_column(bg,x->end,4,n,sf->is_big)
+        || pbi_column(bg,x->well,4,n,sf->is_big)
+        || pbi_column(bg,x->qual,4,n,sf->is_big)
+        || pbi_skip(bg,n,tmp,BGZF_MAX_BLOCK)
+        || pbi_column(bg,x->voff,8,n,sf->is_big))
+    goto error;
+
+  if (x->hasbc)
+    { if (flags & PBI_MAPPED)
+        if (pbi_skip(bg,30ll*n,tmp,BGZF_MAX_BLOCK))
+          goto error;
+      if (flags & PBI_REFERENCE)
+        { uint32 nref;
 
-  return (&theR);
+          if (pbi_column(bg,&nref,4,1,sf->is_big) || pbi_skip(bg,12ll*nref,tmp,BGZF_MAX_BLOCK))
+            goto error;
+        }
+
+      //  BarcodeData: bcForward, bcReverse, bcQual
+
+      { int16 *bcs = (int16 *) x->bc[0];
+
+        if (pbi_column(bg,bcs,2,2*n,sf->is_big))
+          goto error;
+        for (i = 2*n-1; i >= 0; i--)
+          x->bc[0][i] = bcs[i];
+      }
+      { int8 *bqs = (int8 *) x->bqual;
+
+        if (pbi_column(bg,bqs,1,n,0))
+          goto error;
+        for (i = n-1; i >= 0; i--)
+          x->bqual[i] = bqs[i];
+      }
+    }
+
+  free(tmp);
+  bgzf_close(bg);
+  free(name);
+  return (x);
+
+error:
+  fprintf(stderr,"%s: Warning: cannot read index %s, reading all of %s\n",
+                 Prog_Name,name,sf->name);
+  free(tmp);
+  sam_index_free(x);
+  bgzf_close(bg);
+  free(name);
+  return (NULL);
+}
+
+int sam_index_select(samFile *sf, samIndex *x, uint8 *keep)
+{ int64 *sel, *range, beg, end;
+  int    i, n, nr;
+
+  if (sf->format != bam)
+    return (0);
+
+  n = 0;
+  for (i = 0; i < x->nreads; i++)
+    if (keep[i])
+      n += 1;
+  sel   = (int64 *) malloc(8ll*n+8);
+  range = (int64 *) malloc(16ll*n+16);
+  if (sel == NULL || range == NULL)
+    { fprintf(stderr,"%s: Out of memory selecting records of %s\n",Prog_Name,sf->name);
+      free(range);
+      free(sel);
+      return (1);
+    }
+
+  //  Record i occupies [voff[i],voff[i+1]) so needs the blocks from voff[i] >> 16 up to
+  //    and including the one holding its last byte.  Merge these into ranges of file offsets.
+
+  n = nr = 0;
+  for (i = 0; i < x->nreads; i++)
+    if (keep[i])
+      { sel[n++] = x->voff[i];
+        beg = (x->voff[i] >> 16);
+        if (i+1 < x->nreads)
+          end = (x->voff[i+1] >> 16) + ((x->voff[i+1] & 0xffff) != 0);
+        else
+          end = INT64_MAX;
+        if (nr > 0 && beg <= range[2*nr-1])
+          { if (end > range[2*nr-1])
+              range[2*nr-1] = end;
+          }
+        else
+          { range[2*nr]   = beg;
+            range[2*nr+1] = end;
+            nr += 1;
+          }
+      }
+
+  free(sf->sel);
+  sf->sel   = sel;
+  sf->nsel  = n;
+  sf->snext = 0;
+  bgzf_plan((BGZF *) sf->ptr,range,nr);
+  return (0);
 }
@@ -1,9 +1,10 @@
 /*******************************************************************************************
  *
  *  SAM/BAM reader & pacbio extractor
- *    Uses zlib file IO routines to read either SAM or BAM encoding and extracts just the 
- *    information needed for by the Dazzler (sequence, fasta header, well, beg & end pulse,
- *    per base snr, and pulse width sequence). 
+ *    Reads either SAM or BAM encoding and extracts just the information needed for by the
+ *    Dazzler (sequence, fasta header, well, beg & end pulse, per base snr, and pulse width
+ *    sequence).  The BGZF blocks of a BAM file are inflated by a pool of threads that run
+ *    ahead of the record parser.
  *
  *  Author:  Gene Myers
  *  Date  :  Oct. 9, 2016
@@ -14,42 +15,109 @@
 #define _SAM_BAM
 
 #include <stdint.h>
-#include <zlib.h>
 
 #include "DB.h"
 
 typedef enum { sam, bam } samFormat;
 
 typedef struct
-  { samFormat format;  //  sam or bam
-    int       is_big;  //  endian (bam only)
-    int       nline;   //  current line number (sam only)
-    char     *name;    //  file name
-    gzFile    ptr;     //  pointer to file descriptor
-} samFile;
+  { int    len;        //  length of sequence
+    char  *header;     //  movie name
+    char  *seq;        //  sequence
+    char  *arr;        //  pulse width stream (if HASPW requested)
+    char  *qv[5];      //  dq, dt, iq, mq, and sq streams (if HASQV requested)
+    int    well;       //  zm
+    int    beg;        //  qs
+    int    end;        //  qe
+    float  qual;       //  rq
+    float  snr[4];     //  sn (if HASPW requested)
+    int    bc[2];      //  bc (-1 if absent)
+    int    bqual;      //  bq (-1 if absent)
+    int    nump;       //  np (-1 if absent)
+  } samRecord;
 
 typedef struct
-  { int   len;
-    char *header;
-    char *seq;
-  } samRecord;
+  { samFormat format;    //  sam or bam
+    int       is_big;    //  endian (bam only)
+    int       nline;     //  current line number (sam only)
+    char     *name;      //  file name
+    void     *ptr;       //  buffered input (sam) or BGZF block reader (bam)
+    uint8    *data;      //  buffer for lines and the header
+    int       dmax;      //  current size of data
+    samRecord rec;       //  the record last extracted
+    int       rmax;      //  maximum sequence length rec can currently hold
+    char     *seq_conv;  //  base conversion table (set by sam_header_process)
+    int       arr_conv;  //  pulse width character offset (set by sam_header_process)
+    int64    *sel;       //  if not NULL, virtual offsets of the only records to extract
+    int       nsel;      //  # of selected records
+    int       snext;     //  next selected record to extract
+    int       wlo, whi;  //  if wlo <= whi, only extract records of wells in [wlo,whi]
+    int     (*keep)(void *, samRecord *);   //  if not NULL, only extract records passing keep
+    void     *karg;
+  } samFile;
 
-  // sam_open: NULL => error, open file otherwise
+typedef struct         //  Contents of a PacBio .pbi index of a bam file
+  { int    nreads;     //  # of records
+    int    hasbc;      //  barcode columns are present
+    int   *well;       //  holeNumber
+    int   *beg;        //  qStart
+    int   *end;        //  qEnd
+    float *qual;       //  readQual
+    int64 *voff;       //  virtual file offset of record
+    int   *bc[2];      //  bcForward and bcReverse (if hasbc)
+    int   *bqual;      //  bcQual (if hasbc)
+  } samIndex;
+
+  // sam_open: NULL => error, open file otherwise.  BGZF blocks are inflated by nthreads
+  //   worker threads (synchronously if nthreads <= 1).  All reader state lives in the
+  //   samFile so that distinct files may be read concurrently by distinct threads.
   // sam_close: 1 => error, 0 otherwise OK
-  // sam_eof: 1 => eof or error, 0 otherwise 
+  // sam_eof: 1 => eof or error, 0 otherwise
   //   error message *will not* have been sent to stderr.
+  // sam_set_buffer: files subsequently opened are read ahead by a background thread into
+  //   two buffers of mbytes MB each (4MB by default).
 
-samFile *sam_open(char *sf);          //   Open a SAM/BAM file for reading
-int      sam_close(samFile *sf);      //   Close an open SAM/BAM file
-int      sam_eof(samFile *sf);        //   Return non-zero if at eof
+void     sam_set_buffer(int mbytes);         //   Set the read-ahead buffer size
+samFile *sam_open(char *sf, int nthreads);   //   Open a SAM/BAM file for reading
+int      sam_close(samFile *sf);             //   Close an open SAM/BAM file
+int      sam_eof(samFile *sf);               //   Return non-zero if at eof
 
-  // sam_header_process: 0 => no codec, 1 => codec, -1 => error
-  // sam_record_extract: NULL => error, EOF => error, filled in sam record otherwise
+  // sam_header_process: -1 => error, otherwise the bit vector of streams present:
+  //   HASPW => pulse widths, HASQV => all 5 quiver streams
+  // sam_record_extract: NULL => error, SAM_EOF => end of file, filled in sam record otherwise.
+  //   Well, pulse range, and quality are always decoded, the streams in status (HASPW,
+  //   HASQV) and the fields in status (WANT_BC => bc & bqual, WANT_NP => nump) only on
+  //   request, being left at -1 otherwise.  The record belongs to sf and is overwritten by
+  //   the next call on sf.
   //   error message *will* have been sent to stderr.
 
+#define HASPW   0x1
+#define HASQV   0x2
+#define WANT_BC 0x4
+#define WANT_NP 0x8
+
 extern samRecord *SAM_EOF;
 
 int        sam_header_process(samFile *sf, int numeric);
-samRecord *sam_record_extract(samFile *sf)
+samRecord *sam_record_extract(samFile *sf, int status);
+
+  // sam_index_load: NULL => sf is not bam or has no readable <name>.pbi, the index otherwise.
+  //   A .pbi that exists but cannot be read is reported to stderr as a warning.
+  // sam_index_select: after the header has been processed, restrict extraction to the
+  //   records i for which keep[i] is non-zero.  Blocks holding no such record are never
+  //   read or inflated.  1 => error (message sent), 0 otherwise.
+
+  // sam_set_wells: extract only the records of wells with hole numbers in [lo,hi].
+  // sam_set_filter: extract only the records r for which keep(arg,r) is non-zero.  keep is
+  //   called once the well, pulse range, quality, length, and fields requested by the status
+  //   of sam_record_extract are decoded, and the sequence and streams of a bam record it
+  //   rejects are never decoded.
+
+void       sam_set_wells(samFile *sf, int lo, int hi);
+void       sam_set_filter(samFile *sf, int (*keep)(void *arg, samRecord *r), void *arg);
+
+samIndex  *sam_index_load(samFile *sf);
+void       sam_index_free(samIndex *x);
+int        sam_index_select(samFile *sf, samIndex *x, uint8 *keep);
 
 #endif // _SAM_BAM